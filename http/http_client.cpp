@@ -4,6 +4,12 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+#include <cctype>
 
 using namespace boost;
 
@@ -63,6 +69,25 @@ class HTTPClient;
 class HTTPResponse;
 class HTTPRequest;
 
+struct ClientConfig
+{
+    // Most connections open to one server at a time, in use
+    // or idle.
+    std::size_t max_connections_per_host = 6;
+
+    // How long a connection is kept open while idle.
+    std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds(30);
+
+    // How long the addresses of a host name are used before
+    // it is resolved again, and for how much longer they are
+    // still used while that is under way.
+    std::chrono::steady_clock::duration dns_ttl = std::chrono::seconds(60);
+    std::chrono::steady_clock::duration dns_stale_ttl = std::chrono::seconds(300);
+
+    // How long a failure to resolve a host name is remembered.
+    std::chrono::steady_clock::duration dns_negative_ttl = std::chrono::seconds(5);
+};
+
 using Callback = void (*)(const HTTPRequest &request, const HTTPResponse &response, const system::error_code &ec);
 
 class HTTPResponse
@@ -122,6 +147,488 @@ private:
     std::istream m_response_stream_;
 };
 
+// Keep-alive connections of an HTTPClient, by host and port.
+// At most max_per_host connections to a host are open at a
+// time, in use or idle; requests beyond that wait for one to
+// be released. Idle connections are closed once idle for
+// idle_timeout, by a sweep that runs every half of it while
+// there are any, and checked before being lent out again, as
+// the server may have closed them meanwhile.
+class ConnectionPool
+{
+public:
+    // Called with an idle connection to reuse, or with
+    // nullptr when the request is to open one of its own.
+    using Handler = std::function<void(std::unique_ptr<asio::ip::tcp::socket> sock)>;
+
+    ConnectionPool(asio::io_service &ios,
+                   std::size_t max_per_host,
+                   std::chrono::steady_clock::duration idle_timeout) : m_ios_(ios),
+                                                                       m_max_per_host_(max_per_host),
+                                                                       m_idle_timeout_(idle_timeout),
+                                                                       m_sweep_timer_(ios),
+                                                                       m_sweeping_(false),
+                                                                       m_closed_(false) {}
+
+    // Lends out a connection to host:port, or the right to
+    // open one, as soon as there is one. The handler is
+    // posted to the io_service.
+    void acquire(const std::string &host, unsigned int port, const void *owner, Handler handler)
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        Host &entry = m_hosts_[key(host, port)];
+        closeExpired(entry);
+
+        // The most recently used connection first.
+        while (!entry.idle.empty())
+        {
+            std::unique_ptr<asio::ip::tcp::socket> sock = std::move(entry.idle.back().sock);
+            entry.idle.pop_back();
+
+            if (isUsable(*sock))
+            {
+                post(std::move(handler), std::move(sock));
+                return;
+            }
+
+            closeSocket(*sock);
+            entry.open--;
+        }
+
+        if (entry.open < m_max_per_host_)
+        {
+            entry.open++;
+            post(std::move(handler), nullptr);
+            return;
+        }
+
+        entry.waiters.push_back(Waiter{owner, std::move(handler)});
+    }
+
+    // Gives back a connection acquired for host:port, to be
+    // kept if reusable and closed otherwise. sock is nullptr
+    // if no connection could be opened.
+    void release(const std::string &host, unsigned int port,
+                 std::unique_ptr<asio::ip::tcp::socket> sock, bool reusable)
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        auto it = m_hosts_.find(key(host, port));
+        assert(it != m_hosts_.end());
+        Host &entry = it->second;
+
+        if ((!reusable || m_closed_) && sock)
+        {
+            closeSocket(*sock);
+            sock.reset();
+        }
+
+        // A waiting request takes over the connection, or
+        // its place.
+        if (!entry.waiters.empty())
+        {
+            Waiter waiter = std::move(entry.waiters.front());
+            entry.waiters.pop_front();
+
+            post(std::move(waiter.handler), std::move(sock));
+            return;
+        }
+
+        if (!sock)
+        {
+            entry.open--;
+            forgetIfUnused(it);
+            return;
+        }
+
+        entry.idle.push_back(Idle{std::move(sock), std::chrono::steady_clock::now()});
+        startSweeping();
+    }
+
+    // Withdraws owner's acquire if it is still waiting.
+    // Returns true if it was.
+    bool abandon(const std::string &host, unsigned int port, const void *owner)
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        auto it = m_hosts_.find(key(host, port));
+        if (it == m_hosts_.end())
+        {
+            return false;
+        }
+
+        auto &waiters = it->second.waiters;
+        for (auto waiter = waiters.begin(); waiter != waiters.end(); ++waiter)
+        {
+            if (waiter->owner == owner)
+            {
+                waiters.erase(waiter);
+                forgetIfUnused(it);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Closes the idle connections, and those released from
+    // now on.
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        m_closed_ = true;
+        m_sweep_timer_.cancel();
+
+        for (auto it = m_hosts_.begin(); it != m_hosts_.end();)
+        {
+            for (auto &idle : it->second.idle)
+            {
+                closeSocket(*idle.sock);
+                it->second.open--;
+            }
+
+            it->second.idle.clear();
+            it = forgetIfUnused(it);
+        }
+    }
+
+private:
+    struct Idle
+    {
+        std::unique_ptr<asio::ip::tcp::socket> sock;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Waiter
+    {
+        const void *owner;
+        Handler handler;
+    };
+
+    struct Host
+    {
+        std::deque<Idle> idle; // Least recently used first.
+        std::deque<Waiter> waiters;
+        std::size_t open = 0;
+    };
+
+    using HostMap = std::map<std::string, Host>;
+
+    static std::string key(const std::string &host, unsigned int port)
+    {
+        return host + ":" + std::to_string(port);
+    }
+
+    // Hosts with no connections and no waiting requests are
+    // dropped. Returns the next host.
+    HostMap::iterator forgetIfUnused(HostMap::iterator it)
+    {
+        if (it->second.open == 0 && it->second.waiters.empty())
+        {
+            return m_hosts_.erase(it);
+        }
+        return ++it;
+    }
+
+    // Called with m_mux_ held.
+    void startSweeping()
+    {
+        if (m_sweeping_ || m_closed_)
+        {
+            return;
+        }
+
+        m_sweeping_ = true;
+        m_sweep_timer_.expires_after(m_idle_timeout_ / 2);
+        m_sweep_timer_.async_wait([this](const system::error_code &ec)
+                                  { onSweep(ec); });
+    }
+
+    void onSweep(const system::error_code &ec)
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        m_sweeping_ = false;
+
+        if (ec == asio::error::operation_aborted || m_closed_)
+        {
+            return;
+        }
+
+        bool idle_left = false;
+
+        for (auto it = m_hosts_.begin(); it != m_hosts_.end();)
+        {
+            closeExpired(it->second);
+            idle_left = idle_left || !it->second.idle.empty();
+
+            it = forgetIfUnused(it);
+        }
+
+        if (idle_left)
+        {
+            startSweeping();
+        }
+    }
+
+    void closeExpired(Host &entry)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        while (!entry.idle.empty() && now - entry.idle.front().since >= m_idle_timeout_)
+        {
+            closeSocket(*entry.idle.front().sock);
+            entry.idle.pop_front();
+            entry.open--;
+        }
+    }
+
+    // An idle connection has nothing to read. Data or an
+    // end of stream mean the server has given up on it.
+    static bool isUsable(asio::ip::tcp::socket &sock)
+    {
+        system::error_code ec;
+        char byte;
+
+        sock.non_blocking(true, ec);
+        sock.receive(asio::buffer(&byte, 1), asio::socket_base::message_peek, ec);
+
+        bool usable = ec == asio::error::would_block;
+
+        system::error_code ignored_ec;
+        sock.non_blocking(false, ignored_ec);
+
+        return usable;
+    }
+
+    static void closeSocket(asio::ip::tcp::socket &sock)
+    {
+        system::error_code ignored_ec;
+        sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+        sock.close(ignored_ec);
+    }
+
+    void post(Handler handler, std::unique_ptr<asio::ip::tcp::socket> sock)
+    {
+        asio::post(m_ios_, [handler = std::move(handler), sock = std::move(sock)]() mutable
+                   { handler(std::move(sock)); });
+    }
+
+    asio::io_service &m_ios_;
+    const std::size_t m_max_per_host_;
+    const std::chrono::steady_clock::duration m_idle_timeout_;
+
+    std::mutex m_mux_;
+    HostMap m_hosts_;
+    asio::steady_timer m_sweep_timer_;
+    bool m_sweeping_;
+    bool m_closed_;
+};
+
+// Addresses of host names, shared by the requests of an
+// HTTPClient. The system resolver gives no record TTLs, so
+// results are kept for the configured ones: successes for
+// dns_ttl and failures for dns_negative_ttl. Past its TTL a
+// success is still handed out for dns_stale_ttl while it is
+// resolved again in the background; only then do requests
+// wait. Concurrent lookups of a name share one resolution,
+// and IP literals are not resolved at all.
+class ResolverCache
+{
+public:
+    using Endpoints = std::vector<asio::ip::tcp::endpoint>;
+    using Handler = std::function<void(const system::error_code &ec, const Endpoints &endpoints)>;
+
+    ResolverCache(asio::io_service &ios, const ClientConfig &config) : m_ios_(ios),
+                                                                       m_resolver_(ios),
+                                                                       m_ttl_(config.dns_ttl),
+                                                                       m_stale_ttl_(config.dns_stale_ttl),
+                                                                       m_negative_ttl_(config.dns_negative_ttl) {}
+
+    // Finds the endpoints of host:port. The handler is posted
+    // to the io_service, or called from it.
+    void resolve(const std::string &host, unsigned int port, Handler handler)
+    {
+        system::error_code ec;
+        asio::ip::address literal = asio::ip::make_address(unbracket(host), ec);
+
+        if (!ec)
+        {
+            Endpoints endpoints{asio::ip::tcp::endpoint(literal, port)};
+            asio::post(m_ios_, [handler = std::move(handler), endpoints]()
+                       { handler(system::error_code(), endpoints); });
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        auto now = std::chrono::steady_clock::now();
+        Entry &entry = m_entries_[host];
+
+        bool fresh = entry.resolved && now < entry.expires;
+        bool stale = entry.resolved && !entry.ec && now < entry.expires + m_stale_ttl_;
+
+        if (fresh || stale)
+        {
+            if (!fresh && !entry.resolving && now >= entry.retry_at)
+            {
+                startResolving(host, entry, now);
+            }
+
+            system::error_code result = entry.ec;
+            Endpoints endpoints = toEndpoints(entry.addresses, port);
+
+            asio::post(m_ios_, [handler = std::move(handler), result, endpoints]()
+                       { handler(result, endpoints); });
+            return;
+        }
+
+        entry.waiters.push_back(Waiter{port, std::move(handler)});
+
+        if (!entry.resolving)
+        {
+            startResolving(host, entry, now);
+        }
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+        m_resolver_.cancel();
+    }
+
+private:
+    struct Waiter
+    {
+        unsigned int port;
+        Handler handler;
+    };
+
+    struct Entry
+    {
+        bool resolved = false;
+        bool resolving = false;
+        system::error_code ec;
+        std::vector<asio::ip::address> addresses;
+        std::chrono::steady_clock::time_point expires;
+        // No refresh before then, after one has failed.
+        std::chrono::steady_clock::time_point retry_at;
+        std::vector<Waiter> waiters;
+    };
+
+    // "[::1]" as written in a URL.
+    static std::string unbracket(const std::string &host)
+    {
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        {
+            return host.substr(1, host.size() - 2);
+        }
+        return host;
+    }
+
+    static Endpoints toEndpoints(const std::vector<asio::ip::address> &addresses, unsigned int port)
+    {
+        Endpoints endpoints;
+        endpoints.reserve(addresses.size());
+
+        for (const auto &address : addresses)
+        {
+            endpoints.emplace_back(address, port);
+        }
+        return endpoints;
+    }
+
+    // Called with m_mux_ held.
+    void startResolving(const std::string &host, Entry &entry, std::chrono::steady_clock::time_point now)
+    {
+        entry.resolving = true;
+
+        // Names nobody has asked for in a while go, so the
+        // cache does not grow with every host ever visited.
+        for (auto it = m_entries_.begin(); it != m_entries_.end();)
+        {
+            const Entry &other = it->second;
+
+            if (other.resolved && !other.resolving && other.waiters.empty() &&
+                now >= other.expires + m_stale_ttl_)
+            {
+                it = m_entries_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        m_resolver_.async_resolve(host, "0", asio::ip::resolver_base::numeric_service,
+                                  [this, host](const system::error_code &ec, asio::ip::tcp::resolver::results_type results)
+                                  { onResolved(host, ec, results); });
+    }
+
+    void onResolved(const std::string &host, const system::error_code &ec, const asio::ip::tcp::resolver::results_type &results)
+    {
+        std::unique_lock<std::mutex> lock(m_mux_);
+
+        auto now = std::chrono::steady_clock::now();
+        Entry &entry = m_entries_[host];
+        entry.resolving = false;
+
+        std::vector<Waiter> waiters;
+        waiters.swap(entry.waiters);
+
+        if (!ec)
+        {
+            entry.addresses.clear();
+            for (const auto &result : results)
+            {
+                entry.addresses.push_back(result.endpoint().address());
+            }
+
+            entry.ec = system::error_code();
+            entry.resolved = true;
+            entry.expires = now + m_ttl_;
+        }
+        else if (ec != asio::error::operation_aborted)
+        {
+            if (entry.resolved && !entry.ec && now < entry.expires + m_stale_ttl_)
+            {
+                // A failed refresh keeps the stale addresses,
+                // until they run out, and is tried again no
+                // sooner than a failure would have been
+                entry.retry_at = now + m_negative_ttl_;
+            }
+            else
+            {
+                entry.ec = ec;
+                entry.resolved = true;
+                entry.expires = now + m_negative_ttl_;
+            }
+        }
+
+        std::vector<asio::ip::address> addresses = entry.addresses;
+        system::error_code result = ec ? ec : entry.ec;
+
+        lock.unlock();
+
+        for (auto &waiter : waiters)
+        {
+            waiter.handler(result, toEndpoints(addresses, waiter.port));
+        }
+    }
+
+    asio::io_service &m_ios_;
+    asio::ip::tcp::resolver m_resolver_;
+
+    const std::chrono::steady_clock::duration m_ttl_;
+    const std::chrono::steady_clock::duration m_stale_ttl_;
+    const std::chrono::steady_clock::duration m_negative_ttl_;
+
+    std::mutex m_mux_;
+    std::map<std::string, Entry> m_entries_;
+};
+
 class HTTPRequest
 {
 public:
@@ -173,10 +680,6 @@ public:
         assert(m_uri_.length() > 0);
         assert(m_callback_ != nullptr);
 
-        // Prepare resolver query
-        // numeric_service means treat port as a number
-        asio::ip::tcp::resolver::query resolver_query(m_host_, std::to_string(m_port_), asio::ip::resolver_base::numeric_service);
-
         std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
 
         if (m_was_cancelled_)
@@ -186,10 +689,10 @@ public:
             return;
         }
 
-        // Resolve the host name
-        m_resolver_.async_resolve(resolver_query, [this](const system::error_code &ec,
-                                                         asio::ip::tcp::resolver::iterator iterator)
-                                  { onHostNameResolved(ec, iterator); });
+        // Borrow a connection to the server from the pool, or
+        // wait for the right to open one
+        m_pool_.acquire(m_host_, m_port_, this, [this](std::unique_ptr<asio::ip::tcp::socket> sock)
+                        { onConnectionAcquired(std::move(sock)); });
     }
 
     void cancel()
@@ -198,7 +701,13 @@ public:
 
         m_was_cancelled_ = true;
 
-        m_resolver_.cancel();
+        // Still waiting for a connection
+        if (m_pool_.abandon(m_host_, m_port_, this))
+        {
+            asio::post(m_ios_, [this]()
+                       { onFinish(system::error_code(asio::error::operation_aborted)); });
+            return;
+        }
 
         if (m_sock_.is_open())
         {
@@ -207,10 +716,61 @@ public:
     }
 
 private:
-    HTTPRequest(asio::io_service &ios, unsigned int id) : m_port_(DEFAULT_PORT), m_id_(id), m_callback_(nullptr),
-                                                          m_sock_(ios), m_resolver_(ios), m_was_cancelled_(false), m_ios_(ios) {}
+    HTTPRequest(asio::io_service &ios, ConnectionPool &pool, ResolverCache &resolver, unsigned int id) : m_port_(DEFAULT_PORT), m_id_(id), m_callback_(nullptr),
+                                                                                                         m_sock_(ios), m_resolver_(resolver), m_pool_(pool),
+                                                                                m_has_connection_(false), m_reused_(false),
+                                                                                m_keep_alive_(false), m_body_remaining_(0),
+                                                                                m_was_cancelled_(false), m_ios_(ios) {}
+
+    void onConnectionAcquired(std::unique_ptr<asio::ip::tcp::socket> sock)
+    {
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            // Give the connection, or the right to open one,
+            // straight back
+            bool reusable = sock != nullptr;
+            m_pool_.release(m_host_, m_port_, std::move(sock), reusable);
+
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        m_has_connection_ = true;
+
+        if (sock)
+        {
+            m_sock_ = std::move(*sock);
+            m_reused_ = true;
+
+            cancel_lock.unlock();
+            sendRequest();
+            return;
+        }
+
+        cancel_lock.unlock();
+        resolveHost();
+    }
 
-    void onHostNameResolved(const system::error_code &ec, asio::ip::tcp::resolver::iterator itr)
+    void resolveHost()
+    {
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        // Resolve the host name, from the cache if it is there
+        m_resolver_.resolve(m_host_, m_port_, [this](const system::error_code &ec, const ResolverCache::Endpoints &endpoints)
+                            { onHostNameResolved(ec, endpoints); });
+    }
+
+    void onHostNameResolved(const system::error_code &ec, const ResolverCache::Endpoints &endpoints)
     {
         if (ec.value() != 0)
         {
@@ -227,11 +787,11 @@ private:
             return;
         }
 
-        asio::async_connect(m_sock_, itr, [this](const system::error_code &ec, asio::ip::tcp::resolver::iterator itr)
-                            { onConnectionEstablished(ec, itr); });
+        asio::async_connect(m_sock_, endpoints, [this](const system::error_code &ec, const asio::ip::tcp::endpoint &)
+                            { onConnectionEstablished(ec); });
     }
 
-    void onConnectionEstablished(const system::error_code &ec, asio::ip::tcp::resolver::iterator itr)
+    void onConnectionEstablished(const system::error_code &ec)
     {
         if (ec.value() != 0)
         {
@@ -239,8 +799,13 @@ private:
             return;
         }
 
+        sendRequest();
+    }
+
+    void sendRequest()
+    {
         // Compose the request message
-        m_request_buf_ += "GET " + m_uri_ + " HTTP/1.1\r\n";
+        m_request_buf_ = "GET " + m_uri_ + " HTTP/1.1\r\n";
 
         // Add mandatory header
         m_request_buf_ += "Host: " + m_host_ + "\r\n";
@@ -261,16 +826,44 @@ private:
                           { onRequestSent(ec, bytes_transferred); });
     }
 
+    // A pooled connection the server has closed in the
+    // meantime fails before any response arrives. The request
+    // is then sent again over a new connection.
+    bool retryOnNewConnection(const system::error_code &ec)
+    {
+        if (!m_reused_ || m_read_buf_.size() > 0)
+        {
+            return false;
+        }
+
+        if (ec != asio::error::eof && ec != asio::error::connection_reset &&
+            ec != asio::error::broken_pipe)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        system::error_code ignored_ec;
+        m_sock_.close(ignored_ec);
+        m_reused_ = false;
+
+        cancel_lock.unlock();
+        resolveHost();
+        return true;
+    }
+
     void onRequestSent(const system::error_code &ec, size_t bytes_transferred)
     {
         if (ec.value() != 0)
         {
-            onFinish(ec);
+            if (!retryOnNewConnection(ec))
+            {
+                onFinish(ec);
+            }
             return;
         }
 
-        m_sock_.shutdown(asio::ip::tcp::socket::shutdown_send);
-
         std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
 
         if (m_was_cancelled_)
@@ -281,7 +874,7 @@ private:
         }
 
         // Read the status line
-        asio::async_read_until(m_sock_, m_response_.getResponseBuf(), "\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
+        asio::async_read_until(m_sock_, m_read_buf_, "\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
                                { onStatusLineReceived(ec, bytes_transferred); });
     }
 
@@ -289,7 +882,10 @@ private:
     {
         if (ec.value() != 0)
         {
-            onFinish(ec);
+            if (!retryOnNewConnection(ec))
+            {
+                onFinish(ec);
+            }
             return;
         }
 
@@ -298,17 +894,21 @@ private:
         std::string str_status_code;
         std::string status_message;
 
-        std::istream response_stream(&m_response_.getResponseBuf());
+        std::istream response_stream(&m_read_buf_);
 
         response_stream >> http_version;
 
-        if (http_version != "HTTP/1.1")
+        if (http_version != "HTTP/1.1" && http_version != "HTTP/1.0")
         {
             // Response is incorrect;
             onFinish(http_errors::invalid_response);
             return;
         }
 
+        // HTTP/1.1 connections persist unless the server says
+        // otherwise
+        m_keep_alive_ = http_version == "HTTP/1.1";
+
         response_stream >> str_status_code;
 
         // Converst status code to integer
@@ -321,6 +921,7 @@ private:
         catch (std::logic_error &e)
         {
             onFinish(http_errors::invalid_response);
+            return;
         }
 
         std::getline(response_stream, status_message, '\r');
@@ -342,7 +943,7 @@ private:
         // At this point the status code has been received and parsed
         // Read the response headers now
 
-        asio::async_read_until(m_sock_, m_response_.getResponseBuf(), "\r\n\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
+        asio::async_read_until(m_sock_, m_read_buf_, "\r\n\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
                                { onHeadersReceived(ec, bytes_transferred); });
     }
 
@@ -356,7 +957,10 @@ private:
 
         // Parse and store the headers
         std::string header, header_name, header_value;
-        std::istream response_stream(&m_response_.getResponseBuf());
+        std::istream response_stream(&m_read_buf_);
+
+        std::string content_length;
+        bool chunked = false;
 
         while (true)
         {
@@ -384,24 +988,236 @@ private:
                     header_value = "";
                 }
                 m_response_.addHeader(header_name, header_value);
+
+                // Headers deciding where the body ends, and
+                // whether the connection can be reused
+                std::string name = toLower(header_name);
+                std::string value = toLower(trim(header_value));
+
+                if (name == "content-length")
+                {
+                    content_length = value;
+                }
+                else if (name == "transfer-encoding")
+                {
+                    chunked = value.find("chunked") != std::string::npos;
+                }
+                else if (name == "connection")
+                {
+                    if (value.find("close") != std::string::npos)
+                    {
+                        m_keep_alive_ = false;
+                    }
+                    else if (value.find("keep-alive") != std::string::npos)
+                    {
+                        m_keep_alive_ = true;
+                    }
+                }
             }
+        }
 
-            std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+        unsigned int status_code = m_response_.getStatusCode();
 
-            if (m_was_cancelled_)
+        // These responses never have a body
+        if (status_code / 100 == 1 || status_code == 204 || status_code == 304)
+        {
+            onFinish(system::error_code());
+            return;
+        }
+
+        if (chunked)
+        {
+            readChunkSize();
+            return;
+        }
+
+        if (!content_length.empty())
+        {
+            try
+            {
+                m_body_remaining_ = std::stoull(content_length);
+            }
+            catch (std::logic_error &e)
             {
-                cancel_lock.unlock();
-                onFinish(system::error_code(asio::error::operation_aborted));
+                onFinish(http_errors::invalid_response);
                 return;
             }
 
-            // Now read the response body
-            asio::async_read(m_sock_, m_response_.getResponseBuf(), [this](const system::error_code &ec, size_t bytes_transferred)
-                             { onResponseReceived(ec, bytes_transferred); });
+            readBody();
+            return;
+        }
+
+        // The body runs until the server closes the
+        // connection, which cannot be reused then
+        m_keep_alive_ = false;
+        moveBytes(m_read_buf_, m_response_.getResponseBuf(), m_read_buf_.size());
+
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
         }
+
+        // Now read the response body
+        asio::async_read(m_sock_, m_response_.getResponseBuf(), [this](const system::error_code &ec, size_t bytes_transferred)
+                         { onResponseReceived(ec, bytes_transferred); });
     }
 
-    void onResponseReceived(const system::error_code &ec, size_t bytes_transferred)
+    // Reads the m_body_remaining_ bytes of a body whose length
+    // is known.
+    void readBody()
+    {
+        std::size_t buffered = std::min<std::size_t>(m_read_buf_.size(), m_body_remaining_);
+        moveBytes(m_read_buf_, m_response_.getResponseBuf(), buffered);
+        m_body_remaining_ -= buffered;
+
+        if (m_body_remaining_ == 0)
+        {
+            onFinish(system::error_code());
+            return;
+        }
+
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        // The server closing the connection before the end
+        // of the body is an error here
+        asio::async_read(m_sock_, m_response_.getResponseBuf(), asio::transfer_exactly(m_body_remaining_),
+                         [this](const system::error_code &ec, size_t)
+                         { onFinish(ec); });
+    }
+
+    void readChunkSize()
+    {
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        asio::async_read_until(m_sock_, m_read_buf_, "\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
+                               { onChunkSizeReceived(ec, bytes_transferred); });
+    }
+
+    void onChunkSizeReceived(const system::error_code &ec, size_t)
+    {
+        if (ec.value() != 0)
+        {
+            onFinish(ec);
+            return;
+        }
+
+        std::string line;
+        std::istream response_stream(&m_read_buf_);
+
+        std::getline(response_stream, line, '\r');
+        response_stream.get();
+
+        // Chunk extensions after a ';' are ignored
+        unsigned long long chunk_size = 0;
+
+        try
+        {
+            chunk_size = std::stoull(line.substr(0, line.find(';')), nullptr, 16);
+        }
+        catch (std::logic_error &e)
+        {
+            onFinish(http_errors::invalid_response);
+            return;
+        }
+
+        if (chunk_size == 0)
+        {
+            readTrailer();
+            return;
+        }
+
+        // The chunk's data and the CRLF after it
+        m_body_remaining_ = chunk_size + 2;
+        readChunkData();
+    }
+
+    void readChunkData()
+    {
+        if (m_read_buf_.size() >= m_body_remaining_)
+        {
+            moveBytes(m_read_buf_, m_response_.getResponseBuf(), m_body_remaining_ - 2);
+            m_read_buf_.consume(2);
+
+            readChunkSize();
+            return;
+        }
+
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        asio::async_read(m_sock_, m_read_buf_, asio::transfer_exactly(m_body_remaining_ - m_read_buf_.size()),
+                         [this](const system::error_code &ec, size_t)
+                         {
+                             if (ec.value() != 0)
+                             {
+                                 onFinish(ec);
+                                 return;
+                             }
+
+                             readChunkData();
+                         });
+    }
+
+    // Skips the trailer fields after the last chunk, up to
+    // the empty line ending the response.
+    void readTrailer()
+    {
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_was_cancelled_)
+        {
+            cancel_lock.unlock();
+            onFinish(system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        asio::async_read_until(m_sock_, m_read_buf_, "\r\n", [this](const system::error_code &ec, size_t bytes_transferred)
+                               {
+                                   if (ec.value() != 0)
+                                   {
+                                       onFinish(ec);
+                                       return;
+                                   }
+
+                                   m_read_buf_.consume(bytes_transferred);
+
+                                   if (bytes_transferred == 2)
+                                   {
+                                       onFinish(system::error_code());
+                                       return;
+                                   }
+
+                                   readTrailer();
+                               });
+    }
+
+    // The end of a body that runs until the server closes
+    // the connection.
+    void onResponseReceived(const system::error_code &ec, size_t)
     {
         if (ec.value() == asio::error::eof)
         {
@@ -422,9 +1238,56 @@ private:
                       << ". Message: " << ec.message();
         }
 
+        // Return the connection to the pool. It is kept only
+        // if the response has been read in full and nothing
+        // follows it.
+        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux_);
+
+        if (m_has_connection_)
+        {
+            bool reusable = ec.value() == 0 && m_keep_alive_ && m_read_buf_.size() == 0;
+
+            std::unique_ptr<asio::ip::tcp::socket> sock;
+            if (m_sock_.is_open())
+            {
+                sock = std::make_unique<asio::ip::tcp::socket>(std::move(m_sock_));
+            }
+
+            m_has_connection_ = false;
+            m_pool_.release(m_host_, m_port_, std::move(sock), reusable);
+        }
+
+        cancel_lock.unlock();
+
         m_callback_(*this, m_response_, ec);
     }
 
+    static void moveBytes(asio::streambuf &from, asio::streambuf &to, std::size_t size)
+    {
+        std::size_t copied = asio::buffer_copy(to.prepare(size), from.data(), size);
+        to.commit(copied);
+        from.consume(copied);
+    }
+
+    static std::string toLower(std::string str)
+    {
+        for (char &c : str)
+        {
+            c = std::tolower(static_cast<unsigned char>(c));
+        }
+        return str;
+    }
+
+    static std::string trim(const std::string &str)
+    {
+        std::size_t begin = str.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+        {
+            return "";
+        }
+        return str.substr(begin, str.find_last_not_of(" \t") - begin + 1);
+    }
+
 private:
     friend class HTTPClient;
     static const unsigned int DEFAULT_PORT = 80;
@@ -443,7 +1306,21 @@ private:
     std::string m_request_buf_;
 
     asio::ip::tcp::socket m_sock_;
-    asio::ip::tcp::resolver m_resolver_;
+    ResolverCache &m_resolver_;
+
+    // Pool the connection is borrowed from; whether one is
+    // held, and whether it had served requests before.
+    ConnectionPool &m_pool_;
+    bool m_has_connection_;
+    bool m_reused_;
+
+    // Bytes read from the connection and not parsed yet.
+    asio::streambuf m_read_buf_;
+
+    // Whether the connection outlives the response, and the
+    // bytes of the body (or chunk) still to be read.
+    bool m_keep_alive_;
+    unsigned long long m_body_remaining_;
 
     HTTPResponse m_response_;
 
@@ -456,7 +1333,8 @@ private:
 class HTTPClient
 {
 public:
-    HTTPClient()
+    explicit HTTPClient(const ClientConfig &config = ClientConfig()) : m_pool_(m_ios_, config.max_connections_per_host, config.idle_timeout),
+                                                                       m_resolver_(m_ios_, config)
     {
         m_work_ = std::make_unique<asio::io_service::work>(m_ios_);
         m_thread_ = std::make_unique<std::thread>([this]()
@@ -465,7 +1343,7 @@ public:
 
     std::shared_ptr<HTTPRequest> createRequest(unsigned int id)
     {
-        return std::shared_ptr<HTTPRequest>(new HTTPRequest(m_ios_, id));
+        return std::shared_ptr<HTTPRequest>(new HTTPRequest(m_ios_, m_pool_, m_resolver_, id));
     }
 
     void close()
@@ -474,11 +1352,17 @@ public:
         // m_ios_.stop();
         m_work_.reset(nullptr);
 
+        // Nothing may be left waiting on the io_service
+        m_pool_.close();
+        m_resolver_.close();
+
         m_thread_->join();
     }
 
 private:
     asio::io_service m_ios_;
+    ConnectionPool m_pool_;
+    ResolverCache m_resolver_;
     std::unique_ptr<asio::io_service::work> m_work_ = nullptr;
     std::unique_ptr<std::thread> m_thread_ = nullptr;
 };
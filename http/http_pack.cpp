@@ -0,0 +1,440 @@
+// Compiles a document root into an asset pack for the
+// server's ServerConfig::asset_pack_path:
+//
+//   http_pack <document root> <pack>
+//
+// The pack is written next to its final path and renamed
+// over it, so that a server starting meanwhile maps either
+// the old pack or the new one, never a mix of the two.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/stat.h>
+
+// The layout read by AssetPack in http_server.cpp; the two
+// must be kept in step.
+static const char MAGIC[8] = {'A', 'H', 'T', 'T', 'P', 'P', 'K', '1'};
+
+struct Header
+{
+	char magic[8];
+	std::uint32_t entry_count;
+	std::uint32_t bucket_count;
+	std::uint64_t displacements_offset;
+	std::uint64_t entries_offset;
+	std::uint64_t file_size;
+};
+
+struct Entry
+{
+	std::uint64_t path_offset;
+	std::uint64_t headers_offset;
+	std::uint64_t etag_offset;
+	std::uint64_t body_offset;
+	std::uint64_t body_size;
+	std::int64_t mtime_ns;
+	std::uint32_t path_size;
+	std::uint32_t headers_size;
+	std::uint32_t etag_size;
+	std::uint32_t reserved;
+};
+
+static std::uint64_t hash(std::uint64_t seed, std::string_view key)
+{
+	std::uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+
+	for (unsigned char c : key)
+	{
+		h ^= c;
+		h *= 0x100000001b3ull;
+	}
+
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ull;
+	h ^= h >> 32;
+	return h;
+}
+
+// Bodies start on page boundaries.
+static const std::uint64_t PAGE_SIZE = 4096;
+
+static std::uint64_t align(std::uint64_t offset, std::uint64_t alignment)
+{
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+// A file of the document root.
+struct Asset
+{
+	std::vector<char> body;
+	std::int64_t mtime_ns;
+	std::string content_type;
+	std::uint64_t body_offset;
+};
+
+// A path served from the pack. A directory's index.html is
+// also served at the directory's own path.
+struct Route
+{
+	std::string path;
+	std::size_t asset;
+	std::string headers;
+	std::size_t etag_position;
+	std::size_t etag_size;
+};
+
+static std::string content_type(const std::filesystem::path &path)
+{
+	static const struct
+	{
+		const char *extension;
+		const char *type;
+	} types[] = {
+		{".html", "text/html; charset=utf-8"},
+		{".htm", "text/html; charset=utf-8"},
+		{".css", "text/css; charset=utf-8"},
+		{".js", "text/javascript; charset=utf-8"},
+		{".mjs", "text/javascript; charset=utf-8"},
+		{".json", "application/json"},
+		{".txt", "text/plain; charset=utf-8"},
+		{".xml", "application/xml"},
+		{".svg", "image/svg+xml"},
+		{".png", "image/png"},
+		{".jpg", "image/jpeg"},
+		{".jpeg", "image/jpeg"},
+		{".gif", "image/gif"},
+		{".webp", "image/webp"},
+		{".ico", "image/x-icon"},
+		{".woff", "font/woff"},
+		{".woff2", "font/woff2"},
+		{".wasm", "application/wasm"},
+		{".pdf", "application/pdf"},
+		{".mp4", "video/mp4"},
+	};
+
+	std::string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(),
+				   [](unsigned char c)
+				   { return static_cast<char>(std::tolower(c)); });
+
+	for (const auto &type : types)
+	{
+		if (extension == type.extension)
+		{
+			return type.type;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+static std::string format_http_date(std::time_t time)
+{
+	struct tm tm;
+	gmtime_r(&time, &tm);
+
+	char date[64];
+	std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return date;
+}
+
+// The entity tag hashes the contents, so that it stays the
+// same from one build of the pack to the next, and across
+// the servers of a deployment, for as long as the file does.
+static std::string make_etag(const std::vector<char> &body)
+{
+	std::uint64_t h = hash(0, std::string_view(body.data(), body.size()));
+
+	char etag[32];
+	std::snprintf(etag, sizeof(etag), "\"p%016llx-%llx\"",
+				  static_cast<unsigned long long>(h),
+				  static_cast<unsigned long long>(body.size()));
+	return etag;
+}
+
+static bool load(const std::filesystem::path &root,
+				 std::vector<Asset> &assets,
+				 std::vector<Route> &routes)
+{
+	std::error_code ec;
+	std::filesystem::recursive_directory_iterator it(root, ec), end;
+
+	for (; !ec && it != end; it.increment(ec))
+	{
+		if (!it->is_regular_file())
+		{
+			continue;
+		}
+
+		std::ifstream file(it->path(), std::ios::binary);
+		if (!file)
+		{
+			std::cerr << "Cannot read " << it->path() << std::endl;
+			return false;
+		}
+
+		struct stat st;
+		if (::stat(it->path().c_str(), &st) != 0)
+		{
+			std::cerr << "Cannot stat " << it->path() << std::endl;
+			return false;
+		}
+
+		Asset asset;
+		asset.body.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		asset.mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+						 st.st_mtim.tv_nsec;
+		asset.content_type = content_type(it->path());
+		asset.body_offset = 0;
+		assets.push_back(std::move(asset));
+
+		std::string path = "/" + it->path().lexically_relative(root).generic_string();
+		routes.push_back(Route{path, assets.size() - 1, std::string(), 0, 0});
+
+		if (it->path().filename() == "index.html")
+		{
+			routes.push_back(Route{path.substr(0, path.size() - 10), assets.size() - 1, std::string(), 0, 0});
+		}
+	}
+
+	if (ec)
+	{
+		std::cerr << "Cannot list " << root << ": " << ec.message() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Hash and displace: the paths are spread over buckets by
+// one hash, and each bucket, the fullest first, gets the
+// first seed of a second hash that sends all of its paths
+// to slots still free.
+static bool build_hash(const std::vector<Route> &routes,
+					   std::vector<std::uint32_t> &displacements,
+					   std::vector<std::size_t> &slot_of_route)
+{
+	std::size_t n = routes.size();
+	displacements.assign(std::max<std::size_t>(n, 1), 0);
+	slot_of_route.assign(n, 0);
+
+	std::vector<std::vector<std::size_t>> buckets(displacements.size());
+	for (std::size_t i = 0; i < n; i++)
+	{
+		buckets[hash(0, routes[i].path) % buckets.size()].push_back(i);
+	}
+
+	std::vector<std::size_t> order(buckets.size());
+	for (std::size_t i = 0; i < order.size(); i++)
+	{
+		order[i] = i;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&buckets](std::size_t a, std::size_t b)
+					 { return buckets[a].size() > buckets[b].size(); });
+
+	std::vector<bool> taken(n, false);
+	std::vector<std::size_t> slots;
+
+	for (std::size_t bucket : order)
+	{
+		if (buckets[bucket].empty())
+		{
+			break;
+		}
+
+		std::uint32_t displacement = 1;
+		for (;; displacement++)
+		{
+			if (displacement == 0)
+			{
+				// Every seed tried; cannot happen with
+				// distinct paths.
+				return false;
+			}
+
+			slots.clear();
+			bool fits = true;
+
+			for (std::size_t route : buckets[bucket])
+			{
+				std::size_t slot = hash(displacement, routes[route].path) % n;
+
+				if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+				{
+					fits = false;
+					break;
+				}
+
+				slots.push_back(slot);
+			}
+
+			if (fits)
+			{
+				break;
+			}
+		}
+
+		displacements[bucket] = displacement;
+
+		for (std::size_t i = 0; i < slots.size(); i++)
+		{
+			taken[slots[i]] = true;
+			slot_of_route[buckets[bucket][i]] = slots[i];
+		}
+	}
+
+	return true;
+}
+
+static bool write_pack(const std::string &pack_path,
+					   std::vector<Asset> &assets,
+					   std::vector<Route> &routes)
+{
+	std::vector<std::uint32_t> displacements;
+	std::vector<std::size_t> slot_of_route;
+
+	if (!build_hash(routes, displacements, slot_of_route))
+	{
+		std::cerr << "Cannot build the hash of the paths" << std::endl;
+		return false;
+	}
+
+	// The response headers the server sends for a cached
+	// file, plus the content type.
+	for (Route &route : routes)
+	{
+		const Asset &asset = assets[route.asset];
+		std::string etag = make_etag(asset.body);
+
+		route.headers = "content-length: " + std::to_string(asset.body.size()) +
+						"\r\naccept-ranges: bytes\r\netag: ";
+		route.etag_position = route.headers.size();
+		route.etag_size = etag.size();
+		route.headers += etag + "\r\nlast-modified: " +
+						 format_http_date(asset.mtime_ns / 1000000000) +
+						 "\r\ncontent-type: " + asset.content_type + "\r\n";
+	}
+
+	Header header = {};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.entry_count = static_cast<std::uint32_t>(routes.size());
+	header.bucket_count = static_cast<std::uint32_t>(displacements.size());
+	header.displacements_offset = align(sizeof(Header), alignof(std::uint32_t));
+	header.entries_offset = align(header.displacements_offset +
+									  displacements.size() * sizeof(std::uint32_t),
+								  alignof(Entry));
+
+	std::vector<Entry> entries(routes.size());
+	std::string strings;
+	std::uint64_t strings_offset = header.entries_offset + entries.size() * sizeof(Entry);
+
+	for (std::size_t i = 0; i < routes.size(); i++)
+	{
+		Entry &entry = entries[slot_of_route[i]];
+		entry.path_offset = strings_offset + strings.size();
+		entry.path_size = static_cast<std::uint32_t>(routes[i].path.size());
+		strings += routes[i].path;
+
+		entry.headers_offset = strings_offset + strings.size();
+		entry.headers_size = static_cast<std::uint32_t>(routes[i].headers.size());
+		entry.etag_offset = entry.headers_offset + routes[i].etag_position;
+		entry.etag_size = static_cast<std::uint32_t>(routes[i].etag_size);
+		strings += routes[i].headers;
+
+		entry.body_size = assets[routes[i].asset].body.size();
+		entry.mtime_ns = assets[routes[i].asset].mtime_ns;
+	}
+
+	std::uint64_t offset = align(strings_offset + strings.size(), PAGE_SIZE);
+	for (Asset &asset : assets)
+	{
+		asset.body_offset = offset;
+		offset = align(offset + asset.body.size(), PAGE_SIZE);
+	}
+
+	for (std::size_t i = 0; i < routes.size(); i++)
+	{
+		entries[slot_of_route[i]].body_offset = assets[routes[i].asset].body_offset;
+	}
+
+	header.file_size = assets.empty() ? strings_offset + strings.size()
+									  : assets.back().body_offset + assets.back().body.size();
+
+	std::string temporary_path = pack_path + ".tmp";
+	std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+
+	auto pad_to = [&out](std::uint64_t offset)
+	{
+		static const char zeros[PAGE_SIZE] = {};
+		std::uint64_t position = static_cast<std::uint64_t>(out.tellp());
+		out.write(zeros, static_cast<std::streamsize>(offset - position));
+	};
+
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	pad_to(header.displacements_offset);
+	out.write(reinterpret_cast<const char *>(displacements.data()),
+			  static_cast<std::streamsize>(displacements.size() * sizeof(std::uint32_t)));
+	pad_to(header.entries_offset);
+	out.write(reinterpret_cast<const char *>(entries.data()),
+			  static_cast<std::streamsize>(entries.size() * sizeof(Entry)));
+	out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+	for (const Asset &asset : assets)
+	{
+		pad_to(asset.body_offset);
+		out.write(asset.body.data(), static_cast<std::streamsize>(asset.body.size()));
+	}
+
+	out.close();
+
+	if (!out)
+	{
+		std::cerr << "Cannot write " << temporary_path << std::endl;
+		std::remove(temporary_path.c_str());
+		return false;
+	}
+
+	if (std::rename(temporary_path.c_str(), pack_path.c_str()) != 0)
+	{
+		std::cerr << "Cannot rename " << temporary_path << " to " << pack_path << std::endl;
+		std::remove(temporary_path.c_str());
+		return false;
+	}
+
+	std::cout << "Packed " << assets.size() << " files under "
+			  << routes.size() << " paths, "
+			  << header.file_size << " bytes." << std::endl;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <document root> <pack>" << std::endl;
+		return 1;
+	}
+
+	std::vector<Asset> assets;
+	std::vector<Route> routes;
+
+	if (!load(argv[1], assets, routes) ||
+		!write_pack(argv[2], assets, routes))
+	{
+		return 1;
+	}
+
+	return 0;
+}
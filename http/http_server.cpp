@@ -1,428 +1,10014 @@
 #include <boost/asio.hpp>
-#include <filesystem>
 
-#include <fstream>
 #include <atomic>
 #include <thread>
 #include <iostream>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <pthread.h>
+#include <sched.h>
 
 using namespace boost;
 
-class Service
+// How the event loops perform socket and file I/O.
+enum class IoBackend
+{
+	// Asio's reactor: epoll reports readiness, then every
+	// operation takes a system call of its own.
+	epoll,
+
+	// Operations are queued on a ring shared with the
+	// kernel and submitted in batches.
+	io_uring
+};
+
+// Server wide tunables, handed down from the Server to
+// every Acceptor and Service it creates.
+struct ServerConfig
 {
-	static const std::map<unsigned int, std::string>
-		http_status_table;
+	// Maximum number of requests served over one
+	// persistent connection before it is closed.
+	unsigned int max_keep_alive_requests = 100;
+
+	// How long a persistent connection may sit idle
+	// waiting for its next request.
+	std::chrono::milliseconds keep_alive_idle_timeout{5000};
+
+	// How long a client may take to send the request line,
+	// counted from the connection being accepted or from
+	// the first byte of a request on a persistent one.
+	std::chrono::milliseconds request_line_timeout{10000};
+
+	// How long a client may take to send the headers after
+	// the request line.
+	std::chrono::milliseconds request_headers_timeout{10000};
+
+	// How long sending a response may go on without the
+	// client accepting any more of it.
+	std::chrono::milliseconds response_write_timeout{30000};
+
+	// Resolution and size of the timing wheel driving all
+	// of the above, one wheel per event loop. Deadlines
+	// fire up to one tick late.
+	std::chrono::milliseconds timing_wheel_tick{100};
+	std::size_t timing_wheel_slots = 512;
+
+	// Send file bodies with sendfile(2) straight from the
+	// page cache instead of reading them into memory.
+	bool use_sendfile = true;
+
+	// Without sendfile, file bodies are streamed through a
+	// double buffer of at most this many bytes in total per
+	// connection.
+	std::size_t max_stream_buffer_bytes = 256 * 1024;
+
+	// Total memory budget of the in-memory resource cache.
+	// Zero disables the cache.
+	std::size_t cache_size_bytes = 64 * 1024 * 1024;
+
+	// Number of independently locked cache shards.
+	unsigned int cache_shards = 16;
+
+	// Files larger than this are never cached and go
+	// through the sendfile path instead.
+	std::size_t max_cached_resource_size = 1024 * 1024;
+
+	// How long a cached resource is trusted before its
+	// mtime and size are checked against the file again.
+	std::chrono::milliseconds cache_revalidate_interval{1000};
+
+	// Threads doing the file system work of serving files:
+	// finding them, opening them and reading them into the
+	// cache. Zero does it on the event loops instead.
+	unsigned int file_io_threads = 4;
+
+	// Lookups that may wait for a file I/O thread. Requests
+	// finding the queue full are answered with 503.
+	std::size_t file_io_queue_limit = 1024;
+
+	// How much of a file body sent from disk the kernel is
+	// asked to read in ahead of the first write.
+	std::size_t file_readahead_bytes = 1024 * 1024;
+
+	// Negotiate a Content-Encoding with the client for
+	// compressible resources: precompressed .br/.gz siblings
+	// are served when present, otherwise the resource is
+	// compressed once and the result kept in the cache.
+	bool negotiate_content_encoding = true;
+
+	// Instead of one event loop shared by the whole thread
+	// pool, give every thread its own loop pinned to a core
+	// and its own SO_REUSEPORT acceptor, so that the kernel
+	// spreads connections over the loops and a connection
+	// never leaves the core it was accepted on.
+	bool io_context_per_core = false;
+
+	// Finished Service objects are kept on a per thread
+	// free list, up to this many per thread, and reused for
+	// new connections instead of being freed.
+	std::size_t service_pool_size = 1024;
+
+	// Maximum number of connections served at once by the
+	// whole server. Keep it below the file descriptor limit.
+	std::size_t max_connections = 10000;
+
+	// At the limit, acceptors normally stop accepting and
+	// leave new connections in the kernel's listen backlog
+	// until some of ours finish. With this set they instead
+	// keep accepting and turn the excess away at once with
+	// a 503 carrying a Retry-After of the given delay.
+	bool reject_when_overloaded = false;
+	std::chrono::seconds overload_retry_after{1};
+
+	// Number of accept operations each acceptor keeps in
+	// flight, so that a burst of connections is taken off
+	// the listen backlog several at a time.
+	unsigned int outstanding_accepts = 4;
+
+	// Instead, wait for the listening socket to become
+	// readable and then drain its backlog with non-blocking
+	// accept4(2) calls in a loop.
+	bool batch_accept = false;
+
+	// Directory the files are served from, for the paths
+	// no other route takes.
+	std::string document_root = "/var/www/html";
+
+	// Serve those paths from an asset pack built by
+	// http_pack instead, mapped into memory at startup.
+	// The document root is then not looked at.
+	std::string asset_pack_path;
+
+	// Answer GET requests for metrics_path with the server's
+	// latency histograms and counters, in the Prometheus
+	// text format, instead of looking for a file.
+	bool expose_metrics = false;
+	std::string metrics_path = "/metrics";
+
+	// Where the background log thread writes the error log
+	// and, if enabled, the access log, one JSON object per
+	// line. Empty for the standard output.
+	std::string log_path;
+	bool access_log = true;
+
+	// Log records each thread can have waiting for the log
+	// thread, which collects them every log_flush_interval.
+	// Records beyond that are dropped and counted.
+	std::size_t log_buffer_records = 1024;
+	std::chrono::milliseconds log_flush_interval{100};
 
+	// How long Server::Stop() lets the open connections
+	// finish their requests before closing them regardless.
+	std::chrono::milliseconds shutdown_drain_timeout{10000};
+
+	// With io_uring, every event loop gets a ring of this
+	// many entries, through which its connections are
+	// accepted, read from and written to, and streamed file
+	// bodies are read. Loops fall back to epoll where the
+	// kernel does not provide io_uring.
+	IoBackend io_backend = IoBackend::epoll;
+	unsigned int io_uring_entries = 1024;
+
+	// Stream buffers registered with each ring. Connections
+	// streaming a file body borrow one, and use a buffer of
+	// their own once all are lent out.
+	std::size_t io_uring_registered_buffers = 64;
+
+	// Speak HTTP/2 over cleartext TCP with clients that
+	// either start with the HTTP/2 connection preface or ask
+	// for an Upgrade to h2c. Each connection serves up to
+	// http2_max_concurrent_streams requests at once.
+	bool enable_http2 = true;
+	std::uint32_t http2_max_concurrent_streams = 128;
+};
+
+// Owns a file descriptor and closes it on destruction.
+class FileDescriptor
+{
 public:
-	Service(std::shared_ptr<boost::asio::ip::tcp::socket> sock) : m_sock(sock),
-																  m_request(4096),
-																  m_response_status_code(200), // Assume success.
-																  m_resource_size_bytes(0) {};
+	FileDescriptor() : m_fd(-1) {}
+	explicit FileDescriptor(int fd) : m_fd(fd) {}
 
-	void start_handling()
+	FileDescriptor(const FileDescriptor &) = delete;
+	FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+	FileDescriptor(FileDescriptor &&other) noexcept : m_fd(other.release()) {}
+
+	FileDescriptor &operator=(FileDescriptor &&other) noexcept
 	{
-		asio::async_read_until(*m_sock.get(),
-							   m_request,
-							   "\r\n",
-							   [this](
-								   const boost::system::error_code &ec,
-								   std::size_t bytes_transferred)
-							   {
-								   on_request_line_received(ec,
-															bytes_transferred);
-							   });
+		reset(other.release());
+		return *this;
+	}
+
+	~FileDescriptor()
+	{
+		reset();
+	}
+
+	int get() const
+	{
+		return m_fd;
+	}
+
+	bool is_open() const
+	{
+		return m_fd >= 0;
+	}
+
+	void reset(int fd = -1)
+	{
+		if (m_fd >= 0)
+		{
+			::close(m_fd);
+		}
+
+		m_fd = fd;
+	}
+
+	int release()
+	{
+		int fd = m_fd;
+		m_fd = -1;
+		return fd;
 	}
 
 private:
-	void on_request_line_received(
-		const boost::system::error_code &ec,
-		std::size_t bytes_transferred)
+	int m_fd;
+};
+
+// Strips the spaces and tabs around a header value or
+// list item.
+inline std::string_view trim(std::string_view str)
+{
+	while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+	{
+		str.remove_prefix(1);
+	}
+
+	while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+	{
+		str.remove_suffix(1);
+	}
+
+	return str;
+}
+
+// Case insensitive comparison, as used for header
+// names and most header values.
+inline bool iequals(std::string_view a, std::string_view b)
+{
+	if (a.size() != b.size())
+	{
+		return false;
+	}
+
+	for (std::size_t i = 0; i < a.size(); i++)
+	{
+		if (std::tolower(static_cast<unsigned char>(a[i])) !=
+			std::tolower(static_cast<unsigned char>(b[i])))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Modification time of a file in nanoseconds.
+inline std::int64_t mtime_ns(const struct stat &st)
+{
+	return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+		   st.st_mtim.tv_nsec;
+}
+
+enum class ContentEncoding
+{
+	identity,
+	gzip,
+	br
+};
+
+// Token naming the encoding in HTTP headers.
+inline const char *encoding_name(ContentEncoding encoding)
+{
+	switch (encoding)
+	{
+	case ContentEncoding::gzip:
+		return "gzip";
+	case ContentEncoding::br:
+		return "br";
+	default:
+		return "identity";
+	}
+}
+
+// Extension of precompressed siblings of a file.
+inline const char *encoding_suffix(ContentEncoding encoding)
+{
+	switch (encoding)
+	{
+	case ContentEncoding::gzip:
+		return ".gz";
+	case ContentEncoding::br:
+		return ".br";
+	default:
+		return "";
+	}
+}
+
+// Strong entity tag of a file, derived from its size and
+// modification time so that computing it needs no read.
+// Each encoding of the file gets its own tag.
+inline std::string make_etag(const struct stat &st,
+							 ContentEncoding encoding = ContentEncoding::identity)
+{
+	char etag[64];
+	std::snprintf(etag, sizeof(etag), "\"%llx-%llx%s%s\"",
+				  static_cast<unsigned long long>(st.st_size),
+				  static_cast<unsigned long long>(mtime_ns(st)),
+				  encoding == ContentEncoding::identity ? "" : "-",
+				  encoding == ContentEncoding::identity ? "" : encoding_name(encoding));
+	return etag;
+}
+
+// Formats a time as an HTTP-date (IMF-fixdate).
+inline std::string format_http_date(std::time_t time)
+{
+	struct tm tm;
+	gmtime_r(&time, &tm);
+
+	char date[64];
+	std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return date;
+}
+
+// The Date header line for the current second. Each thread
+// formats it at most once a second, and every response it
+// sends meanwhile copies the same line.
+inline std::string_view date_header()
+{
+	struct Line
+	{
+		std::time_t second = -1;
+		char text[64];
+		std::size_t length = 0;
+	};
+
+	thread_local Line line;
+
+	std::time_t now = std::time(nullptr);
+	if (now != line.second)
+	{
+		struct tm tm;
+		gmtime_r(&now, &tm);
+
+		line.length = std::strftime(line.text, sizeof(line.text),
+									"date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		line.second = now;
+	}
+
+	return std::string_view(line.text, line.length);
+}
+
+// Appends the decimal digits of value, formatted in place
+// rather than through a temporary string.
+inline void append_uint(std::string &out, std::uint64_t value)
+{
+	char digits[24];
+	auto result = std::to_chars(digits, digits + sizeof(digits), value);
+	out.append(digits, result.ptr);
+}
+
+// Parses an HTTP-date in the IMF-fixdate format.
+inline bool parse_http_date(std::string_view str, std::time_t &time)
+{
+	char date[64];
+	if (str.size() >= sizeof(date))
+	{
+		return false;
+	}
+
+	std::memcpy(date, str.data(), str.size());
+	date[str.size()] = '\0';
+
+	struct tm tm = {};
+	const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == nullptr || *end != '\0')
+	{
+		return false;
+	}
+
+	time = timegm(&tm);
+	return true;
+}
+
+// Whether a file is of a type worth compressing, judging
+// by its extension. Already compressed formats (images,
+// video, archives) are not.
+inline bool is_compressible(std::string_view path)
+{
+	static const char *const extensions[] = {
+		".html", ".htm", ".css", ".js", ".mjs", ".json", ".map",
+		".txt", ".xml", ".svg", ".csv", ".md", ".wasm", ".ico"};
+
+	for (const char *extension : extensions)
+	{
+		std::size_t length = std::strlen(extension);
+		if (path.size() > length &&
+			iequals(path.substr(path.size() - length), extension))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Compresses data with the given encoding. Returns false
+// if the compressor failed.
+inline bool compress(ContentEncoding encoding,
+					 const std::vector<char> &data,
+					 std::vector<char> &out)
+{
+	if (encoding == ContentEncoding::br)
+	{
+		std::size_t out_size = BrotliEncoderMaxCompressedSize(data.size());
+		out.resize(out_size);
+
+		// Quality 9 compresses nearly as well as 11 in
+		// a fraction of the time.
+		if (BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+								  data.size(),
+								  reinterpret_cast<const uint8_t *>(data.data()),
+								  &out_size,
+								  reinterpret_cast<uint8_t *>(out.data())) == BROTLI_FALSE)
+		{
+			return false;
+		}
+
+		out.resize(out_size);
+		return true;
+	}
+
+	z_stream stream = {};
+
+	// 16 added to the window bits selects the gzip format.
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+					 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	out.resize(deflateBound(&stream, data.size()));
+
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+	stream.avail_in = static_cast<uInt>(data.size());
+	stream.next_out = reinterpret_cast<Bytef *>(out.data());
+	stream.avail_out = static_cast<uInt>(out.size());
+
+	int rc = deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return rc == Z_STREAM_END;
+}
+
+// Value of a hexadecimal digit, or -1.
+inline int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+
+	c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Sets file to the file below root that a request path
+// names: the path percent-decoded, with "." and ".."
+// segments resolved and empty ones dropped. Returns false,
+// leaving file empty, if the path does not start with '/',
+// is malformed, or leads out of root. Both empty name no
+// file at all.
+inline bool resolve_file_path(std::string_view root,
+							  std::string_view path,
+							  std::string &file)
+{
+	file.clear();
+
+	if (root.empty() && path.empty())
+	{
+		return true;
+	}
+
+	if (path.empty() || path.front() != '/')
+	{
+		return false;
+	}
+
+	file.append(root);
+	std::size_t base = file.size();
+	std::size_t i = 0;
+
+	while (i < path.size())
+	{
+		// At the '/' opening a segment.
+		std::size_t segment = file.size();
+		file.push_back('/');
+		i++;
+
+		while (i < path.size() && path[i] != '/')
+		{
+			char c = path[i++];
+
+			if (c == '%')
+			{
+				int high = i + 1 < path.size() ? hex_digit(path[i]) : -1;
+				int low = high >= 0 ? hex_digit(path[i + 1]) : -1;
+
+				if (low < 0)
+				{
+					file.clear();
+					return false;
+				}
+
+				c = static_cast<char>(high * 16 + low);
+				i += 2;
+			}
+
+			// An encoded slash would split the segment.
+			if (c == '\0' || c == '/')
+			{
+				file.clear();
+				return false;
+			}
+
+			file.push_back(c);
+		}
+
+		std::string_view name(file.data() + segment + 1, file.size() - segment - 1);
+
+		if (name == "." || (name.empty() && i < path.size()))
+		{
+			file.resize(segment);
+		}
+		else if (name == "..")
+		{
+			if (segment == base)
+			{
+				file.clear();
+				return false;
+			}
+
+			file.resize(file.rfind('/', segment - 1));
+		}
+	}
+
+	return true;
+}
+
+// Reads size bytes from the start of an open file.
+inline bool read_file(int fd, char *buffer, std::size_t size)
+{
+	// Read in one go, so let the kernel read ahead as far
+	// as it likes.
+	::posix_fadvise(fd, 0, static_cast<off_t>(size), POSIX_FADV_SEQUENTIAL);
+
+	std::size_t offset = 0;
+	while (offset < size)
+	{
+		ssize_t n = ::pread(fd,
+							buffer + offset,
+							size - offset,
+							static_cast<off_t>(offset));
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n <= 0)
+		{
+			return false;
+		}
+
+		offset += static_cast<std::size_t>(n);
+	}
+
+	return true;
+}
+
+// Reads what of size bytes at offset is in the page cache,
+// without waiting for the disk. Returns the number of bytes
+// read, zero at the end of the file, or -1 with errno set;
+// EAGAIN means that none of it is cached, or that the file
+// system cannot tell.
+inline ssize_t read_cached(int fd, char *buffer, std::size_t size, off_t offset)
+{
+	struct iovec vector = {buffer, size};
+
+	for (;;)
+	{
+		ssize_t n = ::preadv2(fd, &vector, 1, offset, RWF_NOWAIT);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n < 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+		{
+			errno = EAGAIN;
+		}
+
+		return n;
+	}
+}
+
+// Reads size bytes at offset into the page cache, through
+// a scratch buffer, for a later sendfile(2) or read not to
+// wait for the disk. Stops early at the end of the file.
+// Returns false on failure, with errno set.
+inline bool warm_file(int fd, off_t offset, std::size_t size)
+{
+	static const std::size_t SCRATCH_SIZE = 256 * 1024;
+	thread_local std::unique_ptr<char[]> scratch(new char[SCRATCH_SIZE]);
+
+	while (size > 0)
+	{
+		ssize_t n = ::pread(fd, scratch.get(), std::min(size, SCRATCH_SIZE), offset);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n <= 0)
+		{
+			return n == 0;
+		}
+
+		size -= static_cast<std::size_t>(n);
+		offset += n;
+	}
+
+	return true;
+}
+
+// An immutable snapshot of a resource. Shared between
+// the cache and every Service currently sending it, so
+// the body is never copied once loaded.
+struct CachedResource
+{
+	std::vector<char> body;
+
+	// Response headers that only depend on the resource,
+	// ready to be written out as is.
+	std::string headers;
+
+	// Length and encoding of the body.
+	std::size_t size;
+	ContentEncoding encoding;
+
+	// Metadata of the file the snapshot was taken from,
+	// and that file when it is not the resource's own, as
+	// for a precompressed sibling.
+	std::int64_t mtime_ns;
+	std::size_t file_size;
+	std::string file;
+
+	// Validators derived from that metadata.
+	std::string etag;
+	std::string last_modified;
+
+	// A body served from an asset pack is not copied in.
+	// It stays in the pack's mapping, kept alive by mapping.
+	const char *mapped_body = nullptr;
+	std::shared_ptr<const void> mapping;
+
+	const char *data() const
+	{
+		return mapped_body != nullptr ? mapped_body : body.data();
+	}
+};
+
+// A document root compiled into a single file by http_pack
+// (http/http_pack.cpp), and mapped into memory at startup.
+// Each file's response headers are in the pack ready made,
+// and its body starts on a page of its own. A perfect hash
+// of the paths finds a file with two hashes and a single
+// comparison, so serving from the pack takes no system call
+// and copies nothing. A server serves the version of the
+// pack it mapped, however the file is replaced meanwhile.
+//
+// All integers are in the byte order of the machine:
+//
+//   Header
+//   std::uint32_t displacements[bucket_count]
+//   Entry entries[entry_count], in slot order
+//   paths and header blocks
+//   bodies, page aligned
+class AssetPack
+{
+public:
+	static constexpr char MAGIC[8] = {'A', 'H', 'T', 'T', 'P', 'P', 'K', '1'};
+
+	struct Header
+	{
+		char magic[8];
+		std::uint32_t entry_count;
+		std::uint32_t bucket_count;
+		std::uint64_t displacements_offset;
+		std::uint64_t entries_offset;
+		std::uint64_t file_size;
+	};
+
+	// Offsets are from the start of the pack.
+	struct Entry
+	{
+		std::uint64_t path_offset;
+		std::uint64_t headers_offset;
+		std::uint64_t etag_offset;
+		std::uint64_t body_offset;
+		std::uint64_t body_size;
+		std::int64_t mtime_ns;
+		std::uint32_t path_size;
+		std::uint32_t headers_size;
+		std::uint32_t etag_size;
+		std::uint32_t reserved;
+	};
+
+	// A path's bucket is hash(0, path) % bucket_count, and
+	// its slot hash(displacements[bucket], path) %
+	// entry_count. Seeded FNV-1a, with the bits mixed
+	// again at the end for the modulos.
+	static std::uint64_t hash(std::uint64_t seed, std::string_view key)
+	{
+		std::uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+
+		for (unsigned char c : key)
+		{
+			h ^= c;
+			h *= 0x100000001b3ull;
+		}
+
+		h ^= h >> 32;
+		h *= 0xd6e8feb86659fd93ull;
+		h ^= h >> 32;
+		return h;
+	}
+
+	// Maps the pack at path. Throws system_error if it
+	// cannot be read, or is no valid pack.
+	explicit AssetPack(const std::string &path)
+	{
+		FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+
+		struct stat st;
+		if (!fd.is_open() || ::fstat(fd.get(), &st) != 0)
+		{
+			throw system::system_error(
+				boost::system::error_code(errno, boost::system::system_category()), path);
+		}
+
+		std::size_t size = static_cast<std::size_t>(st.st_size);
+		if (size < sizeof(Header))
+		{
+			invalid(path);
+		}
+
+		void *address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+		if (address == MAP_FAILED)
+		{
+			throw system::system_error(
+				boost::system::error_code(errno, boost::system::system_category()), path);
+		}
+
+		// Have the kernel read it all in, in the background.
+		::madvise(address, size, MADV_WILLNEED);
+
+		m_mapping.reset(address, [size](void *address)
+						{ ::munmap(address, size); });
+
+		const char *base = static_cast<const char *>(address);
+		Header header;
+		std::memcpy(&header, base, sizeof(header));
+
+		auto fits = [size](std::uint64_t offset, std::uint64_t length)
+		{
+			return offset <= size && length <= size - offset;
+		};
+
+		if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+			header.file_size != size ||
+			(header.entry_count > 0 && header.bucket_count == 0) ||
+			!fits(header.displacements_offset, std::uint64_t(header.bucket_count) * sizeof(std::uint32_t)) ||
+			!fits(header.entries_offset, std::uint64_t(header.entry_count) * sizeof(Entry)) ||
+			header.displacements_offset % alignof(std::uint32_t) != 0 ||
+			header.entries_offset % alignof(Entry) != 0)
+		{
+			invalid(path);
+		}
+
+		m_displacements = reinterpret_cast<const std::uint32_t *>(base + header.displacements_offset);
+		m_entries = reinterpret_cast<const Entry *>(base + header.entries_offset);
+		m_bucket_count = header.bucket_count;
+		m_base = base;
+
+		// Everything is checked here once, so that lookups
+		// can trust the offsets.
+		m_resources.reserve(header.entry_count);
+
+		for (std::uint32_t i = 0; i < header.entry_count; i++)
+		{
+			const Entry &entry = m_entries[i];
+
+			if (!fits(entry.path_offset, entry.path_size) ||
+				!fits(entry.headers_offset, entry.headers_size) ||
+				!fits(entry.etag_offset, entry.etag_size) ||
+				!fits(entry.body_offset, entry.body_size))
+			{
+				invalid(path);
+			}
+
+			auto resource = std::make_shared<CachedResource>();
+			resource->size = static_cast<std::size_t>(entry.body_size);
+			resource->encoding = ContentEncoding::identity;
+			resource->mtime_ns = entry.mtime_ns;
+			resource->file_size = resource->size;
+			resource->etag.assign(base + entry.etag_offset, entry.etag_size);
+			resource->last_modified = format_http_date(entry.mtime_ns / 1000000000);
+			resource->headers.assign(base + entry.headers_offset, entry.headers_size);
+			resource->mapped_body = base + entry.body_offset;
+			resource->mapping = m_mapping;
+
+			m_resources.push_back(std::move(resource));
+		}
+	}
+
+	std::size_t size() const
+	{
+		return m_resources.size();
+	}
+
+	// The resource at the request path, or nullptr if the
+	// pack has no such file.
+	std::shared_ptr<const CachedResource> find(std::string_view path) const
+	{
+		if (m_resources.empty())
+		{
+			return nullptr;
+		}
+
+		std::uint32_t displacement = m_displacements[hash(0, path) % m_bucket_count];
+		std::size_t slot = hash(displacement, path) % m_resources.size();
+		const Entry &entry = m_entries[slot];
+
+		if (path != std::string_view(m_base + entry.path_offset, entry.path_size))
+		{
+			return nullptr;
+		}
+
+		return m_resources[slot];
+	}
+
+private:
+	[[noreturn]] static void invalid(const std::string &path)
+	{
+		throw system::system_error(
+			boost::system::errc::make_error_code(boost::system::errc::invalid_argument),
+			path + ": not an asset pack");
+	}
+
+	std::shared_ptr<void> m_mapping;
+	const char *m_base = nullptr;
+	const std::uint32_t *m_displacements = nullptr;
+	const Entry *m_entries = nullptr;
+	std::uint32_t m_bucket_count = 0;
+	std::vector<std::shared_ptr<const CachedResource>> m_resources;
+};
+
+// Thread safe LRU cache of resources keyed by file path,
+// and for compressed variants by path and encoding.
+// The key space is split over several shards, each with
+// its own lock and a slice of the total byte budget, so
+// that concurrent lookups rarely contend.
+class ResourceCache
+{
+public:
+	ResourceCache(const ServerConfig &config) : m_config(config),
+												m_shards(std::max(1u, config.cache_shards))
+	{
+		for (auto &shard : m_shards)
+		{
+			shard.budget = m_config.cache_size_bytes / m_shards.size();
+		}
+	}
+
+	bool enabled() const
+	{
+		return m_config.cache_size_bytes > 0;
+	}
+
+	// Whether a resource of the given size is worth
+	// keeping in memory at all.
+	bool accepts(std::size_t size) const
+	{
+		return enabled() &&
+			   size <= m_config.max_cached_resource_size &&
+			   size <= m_shards.front().budget;
+	}
+
+	// Returns the cached resource, or its variant compressed
+	// with the given encoding, or nullptr on a miss. Entries
+	// older than the revalidation interval are checked
+	// against the file first, and dropped if it has changed
+	// or disappeared.
+	std::shared_ptr<const CachedResource> lookup(const std::string &path,
+												 ContentEncoding variant = ContentEncoding::identity)
+	{
+		const std::string &key = variant_key(path, variant);
+		Shard &shard = shard_for(key);
+		auto now = std::chrono::steady_clock::now();
+
+		bool stale = false;
+		auto resource = find(shard, key, now, stale);
+
+		if (!stale)
+		{
+			return resource;
+		}
+
+		// Revalidate outside of the lock.
+		const std::string &file = resource->file.empty() ? path : resource->file;
+
+		struct stat st;
+		bool unchanged = ::stat(file.c_str(), &st) == 0 &&
+						 S_ISREG(st.st_mode) &&
+						 static_cast<std::size_t>(st.st_size) == resource->file_size &&
+						 mtime_ns(st) == resource->mtime_ns;
+
+		std::lock_guard<std::mutex> lock(shard.guard);
+
+		auto it = shard.index.find(key);
+		if (it == shard.index.end() || it->second->resource != resource)
+		{
+			// Replaced or evicted meanwhile.
+			return unchanged ? resource : nullptr;
+		}
+
+		if (!unchanged)
+		{
+			erase(shard, it);
+			return nullptr;
+		}
+
+		it->second->validated_at = now;
+		return resource;
+	}
+
+	// Like lookup(), but never touches the file system, so
+	// that it can be done on an event loop. An entry due to
+	// be revalidated is not returned, and stale is set.
+	std::shared_ptr<const CachedResource> peek(const std::string &path,
+											   ContentEncoding variant,
+											   bool &stale)
+	{
+		const std::string &key = variant_key(path, variant);
+
+		stale = false;
+		auto resource = find(shard_for(key), key, std::chrono::steady_clock::now(), stale);
+
+		return stale ? nullptr : resource;
+	}
+
+	// Reads the already opened file described by st into
+	// a new snapshot and caches it as the variant of path
+	// in encoding. The file may be another than path, as
+	// a precompressed sibling is.
+	// Returns nullptr if the file could not be read in full,
+	// or is being read already; see load_once().
+	template <typename Waiter>
+	std::shared_ptr<const CachedResource> load(const std::string &path,
+											   const std::string &file,
+											   int fd,
+											   const struct stat &st,
+											   ContentEncoding encoding,
+											   Waiter waiter,
+											   bool &waiting)
+	{
+		auto read = [&]() -> std::shared_ptr<const CachedResource>
+		{
+			std::vector<char> body(static_cast<std::size_t>(st.st_size));
+
+			if (!read_file(fd, body.data(), body.size()))
+			{
+				return nullptr;
+			}
+
+			return store(path, encoding, st, encoding, std::move(body),
+						 file == path ? std::string() : file);
+		};
+
+		return load_once(path, encoding, read, std::move(waiter), waiting);
+	}
+
+	// Called with what the load waited for has made, on
+	// whichever thread made it.
+	using Landed = std::function<void(std::shared_ptr<const CachedResource>)>;
+
+	// Runs load, which makes the given variant of the file
+	// and caches it, unless the same variant
+	// is being made already. The caller then does not wait:
+	// waiting is set, nullptr returned, and waiter called
+	// with the result, failures included, once it lands.
+	// The result may be of another version of the file,
+	// which the waiter is to check. Returns what load
+	// returned otherwise, nullptr on failure.
+	template <typename Load, typename Waiter>
+	std::shared_ptr<const CachedResource> load_once(const std::string &path,
+													ContentEncoding variant,
+													Load load,
+													Waiter waiter,
+													bool &waiting)
+	{
+		std::string key = cache_key(path, variant);
+		Shard &shard = shard_for(key);
+
+		waiting = false;
+
+		{
+			std::lock_guard<std::mutex> lock(shard.guard);
+
+			auto it = shard.flights.find(key);
+			if (it != shard.flights.end())
+			{
+				it->second.waiters.emplace_back(std::move(waiter));
+				waiting = true;
+
+				return nullptr;
+			}
+
+			shard.flights.emplace(key, Flight());
+		}
+
+		std::shared_ptr<const CachedResource> resource;
+		try
+		{
+			resource = load();
+		}
+		catch (...)
+		{
+			land(shard, key, nullptr);
+			throw;
+		}
+
+		land(shard, key, resource);
+		return resource;
+	}
+
+	// Caches a body derived from the file described by st
+	// as the given variant of path. The body itself is
+	// encoded with encoding, which may differ from the
+	// variant when compressing did not pay off. The file
+	// is given when it is not path itself.
+	std::shared_ptr<const CachedResource> store(const std::string &path,
+												ContentEncoding variant,
+												const struct stat &st,
+												ContentEncoding encoding,
+												std::vector<char> &&body,
+												std::string file = std::string())
+	{
+		auto resource = std::make_shared<CachedResource>();
+		resource->size = body.size();
+		resource->encoding = encoding;
+		resource->file_size = static_cast<std::size_t>(st.st_size);
+		resource->mtime_ns = mtime_ns(st);
+		resource->file = std::move(file);
+		resource->etag = make_etag(st, variant);
+		resource->last_modified = format_http_date(st.st_mtim.tv_sec);
+		resource->body = std::move(body);
+
+		resource->headers = "content-length: ";
+		append_uint(resource->headers, resource->size);
+		resource->headers.append("\r\naccept-ranges: bytes\r\n")
+			.append("etag: ")
+			.append(resource->etag)
+			.append("\r\nlast-modified: ")
+			.append(resource->last_modified)
+			.append("\r\n");
+
+		if (encoding != ContentEncoding::identity)
+		{
+			resource->headers += std::string("content-encoding: ") +
+								 encoding_name(encoding) +
+								 "\r\n";
+		}
+
+		// Caches downstream must not mix up the variants.
+		if (m_config.negotiate_content_encoding &&
+			(variant != ContentEncoding::identity ||
+			 encoding != ContentEncoding::identity ||
+			 is_compressible(path)))
+		{
+			resource->headers += "vary: accept-encoding\r\n";
+		}
+
+		insert(cache_key(path, variant), resource);
+		return resource;
+	}
+
+private:
+	struct Entry
+	{
+		std::string path;
+		std::shared_ptr<const CachedResource> resource;
+		std::chrono::steady_clock::time_point validated_at;
+	};
+
+	// A variant being made by load_once(), and the other
+	// callers wanting it.
+	struct Flight
+	{
+		std::vector<Landed> waiters;
+	};
+
+	struct Shard
+	{
+		std::mutex guard;
+		std::list<Entry> lru; // Most recently used first.
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		std::unordered_map<std::string, Flight> flights;
+		std::size_t used = 0;
+		std::size_t budget = 0;
+	};
+
+	void land(Shard &shard,
+			  const std::string &key,
+			  std::shared_ptr<const CachedResource> resource)
+	{
+		std::vector<Landed> waiters;
+		{
+			std::lock_guard<std::mutex> lock(shard.guard);
+
+			auto it = shard.flights.find(key);
+			waiters.swap(it->second.waiters);
+			shard.flights.erase(it);
+		}
+
+		// Outside of the lock, as they may well look the
+		// resource up again.
+		for (auto &waiter : waiters)
+		{
+			waiter(resource);
+		}
+	}
+
+	// Finds the entry for key and marks it as most recently
+	// used. Sets stale if it is due to be revalidated.
+	std::shared_ptr<const CachedResource> find(Shard &shard,
+											   const std::string &key,
+											   std::chrono::steady_clock::time_point now,
+											   bool &stale)
+	{
+		std::lock_guard<std::mutex> lock(shard.guard);
+
+		auto it = shard.index.find(key);
+		if (it == shard.index.end())
+		{
+			return nullptr;
+		}
+
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		stale = now - it->second->validated_at >= m_config.cache_revalidate_interval;
+
+		return it->second->resource;
+	}
+
+	// Looked up on every request, so the key is only
+	// built, in a reused buffer, for compressed variants.
+	static const std::string &variant_key(const std::string &path,
+										  ContentEncoding variant)
+	{
+		thread_local std::string key;
+
+		if (variant == ContentEncoding::identity)
+		{
+			return path;
+		}
+
+		key.assign(path).append("\n").append(encoding_name(variant));
+		return key;
+	}
+
+	static std::string cache_key(const std::string &path,
+								 ContentEncoding variant)
+	{
+		if (variant == ContentEncoding::identity)
+		{
+			return path;
+		}
+
+		// No file path contains a newline.
+		return path + "\n" + encoding_name(variant);
+	}
+
+	Shard &shard_for(const std::string &path)
+	{
+		return m_shards[std::hash<std::string>()(path) % m_shards.size()];
+	}
+
+	void insert(const std::string &path,
+				std::shared_ptr<const CachedResource> resource)
+	{
+		Shard &shard = shard_for(path);
+		std::lock_guard<std::mutex> lock(shard.guard);
+
+		auto it = shard.index.find(path);
+		if (it != shard.index.end())
+		{
+			erase(shard, it);
+		}
+
+		shard.lru.push_front(Entry{path, resource, std::chrono::steady_clock::now()});
+		shard.index[path] = shard.lru.begin();
+		shard.used += resource->size;
+
+		// Evict least recently used entries until the
+		// shard fits its budget again. Services still
+		// sending an evicted resource keep it alive.
+		while (shard.used > shard.budget && !shard.lru.empty())
+		{
+			erase(shard, shard.index.find(shard.lru.back().path));
+		}
+	}
+
+	void erase(Shard &shard,
+			   std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it)
+	{
+		shard.used -= it->second->resource->size;
+		shard.lru.erase(it->second);
+		shard.index.erase(it);
+	}
+
+private:
+	const ServerConfig &m_config;
+	std::vector<Shard> m_shards;
+};
+
+// Incremental parser of an HTTP request line and header
+// block. It works in place over the receive buffer, one
+// byte at a time, and can be fed a buffer that grows
+// across several reads: each call resumes where the
+// previous one stopped. The method, target, version and
+// headers are exposed as views into that buffer, so
+// parsing never allocates. The buffer must not move or
+// change below consumed() while the views are in use.
+class HttpRequestParser
+{
+public:
+	enum class Result
+	{
+		complete,
+		incomplete,
+		bad_request,
+		too_many_headers
+	};
+
+	struct Header
+	{
+		std::string_view name;
+		std::string_view value;
+	};
+
+	static const std::size_t MAX_HEADERS = 64;
+
+	HttpRequestParser()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		m_state = State::method;
+		m_pos = 0;
+		m_token_start = 0;
+		m_header_count = 0;
+		m_method = m_target = m_version = std::string_view();
+	}
+
+	// Parses data[0, size), of which everything before the
+	// previous size must be unchanged since the last call.
+	Result parse(const char *data, std::size_t size)
+	{
+		for (; m_pos < size; m_pos++)
+		{
+			char c = data[m_pos];
+
+			switch (m_state)
+			{
+			case State::method:
+				if (c == ' ' && m_pos > m_token_start)
+				{
+					m_method = token(data);
+					m_token_start = m_pos + 1;
+					m_state = State::target;
+				}
+				else if (!is_token_char(c))
+				{
+					return Result::bad_request;
+				}
+				break;
+
+			case State::target:
+				if (c == ' ' && m_pos > m_token_start)
+				{
+					m_target = token(data);
+					m_token_start = m_pos + 1;
+					m_state = State::version;
+				}
+				else if (is_ctl(c) || c == ' ')
+				{
+					return Result::bad_request;
+				}
+				break;
+
+			case State::version:
+				if (c == '\r' && m_pos > m_token_start)
+				{
+					m_version = token(data);
+					m_state = State::request_line_lf;
+				}
+				else if (is_ctl(c) || c == ' ')
+				{
+					return Result::bad_request;
+				}
+				break;
+
+			case State::request_line_lf:
+			case State::header_lf:
+				if (c != '\n')
+				{
+					return Result::bad_request;
+				}
+				m_state = State::header_start;
+				break;
+
+			case State::header_start:
+				if (c == '\r')
+				{
+					m_state = State::final_lf;
+				}
+				else if (m_header_count == MAX_HEADERS)
+				{
+					return Result::too_many_headers;
+				}
+				else if (is_token_char(c))
+				{
+					m_token_start = m_pos;
+					m_state = State::header_name;
+				}
+				else
+				{
+					// Also rejects obsolete line folding.
+					return Result::bad_request;
+				}
+				break;
+
+			case State::header_name:
+				if (c == ':')
+				{
+					m_headers[m_header_count].name = token(data);
+					m_state = State::header_value_start;
+				}
+				else if (!is_token_char(c))
+				{
+					return Result::bad_request;
+				}
+				break;
+
+			case State::header_value_start:
+				if (c == ' ' || c == '\t')
+				{
+					break;
+				}
+				m_token_start = m_pos;
+				m_state = State::header_value;
+				[[fallthrough]];
+
+			case State::header_value:
+				if (c == '\r')
+				{
+					// Drop trailing whitespace.
+					std::string_view value = token(data);
+					while (!value.empty() &&
+						   (value.back() == ' ' || value.back() == '\t'))
+					{
+						value.remove_suffix(1);
+					}
+
+					m_headers[m_header_count++].value = value;
+					m_state = State::header_lf;
+				}
+				else if (is_ctl(c) && c != '\t')
+				{
+					return Result::bad_request;
+				}
+				break;
+
+			case State::final_lf:
+				if (c != '\n')
+				{
+					return Result::bad_request;
+				}
+				m_pos++;
+				m_state = State::done;
+				return Result::complete;
+
+			case State::done:
+				return Result::complete;
+			}
+		}
+
+		return m_state == State::done ? Result::complete
+									  : Result::incomplete;
+	}
+
+	std::string_view method() const
+	{
+		return m_method;
+	}
+
+	std::string_view target() const
+	{
+		return m_target;
+	}
+
+	std::string_view version() const
+	{
+		return m_version;
+	}
+
+	std::size_t header_count() const
+	{
+		return m_header_count;
+	}
+
+	const Header &header_at(std::size_t i) const
+	{
+		return m_headers[i];
+	}
+
+	// Value of the first header with the given name, or
+	// an empty view if there is none.
+	std::string_view header(std::string_view name) const
+	{
+		for (std::size_t i = 0; i < m_header_count; i++)
+		{
+			if (iequals(m_headers[i].name, name))
+			{
+				return m_headers[i].value;
+			}
+		}
+
+		return std::string_view();
+	}
+
+	// Whether the whole request line has been parsed.
+	bool request_line_complete() const
+	{
+		return !m_version.empty();
+	}
+
+	// Length of the request head once parse() has
+	// returned complete.
+	std::size_t consumed() const
+	{
+		return m_pos;
+	}
+
+private:
+	enum class State
+	{
+		method,
+		target,
+		version,
+		request_line_lf,
+		header_start,
+		header_name,
+		header_value_start,
+		header_value,
+		header_lf,
+		final_lf,
+		done
+	};
+
+	std::string_view token(const char *data) const
+	{
+		return std::string_view(data + m_token_start, m_pos - m_token_start);
+	}
+
+	static bool is_ctl(char c)
+	{
+		return static_cast<unsigned char>(c) < 0x20 || c == 0x7f;
+	}
+
+	static bool is_token_char(char c)
+	{
+		return std::isalnum(static_cast<unsigned char>(c)) ||
+			   (c != '\0' && std::strchr("!#$%&'*+-.^_`|~", c) != nullptr);
+	}
+
+private:
+	State m_state;
+	std::size_t m_pos;
+	std::size_t m_token_start;
+
+	std::string_view m_method;
+	std::string_view m_target;
+	std::string_view m_version;
+
+	std::array<Header, MAX_HEADERS> m_headers;
+	std::size_t m_header_count;
+};
+
+// A contiguous part of a resource to be sent.
+struct ByteRange
+{
+	std::uint64_t first;
+	std::uint64_t length;
+};
+
+// A header field as HPACK sees it.
+struct HpackField
+{
+	std::string name;
+	std::string value;
+};
+
+// The HPACK (RFC 7541) header table: the static entries
+// followed by a dynamic table of recently used fields, which
+// encoder and decoder each keep in step with their peer.
+class HpackTable
+{
+public:
+	static const std::size_t STATIC_ENTRIES = 61;
+
+	// The size both ends start with.
+	static const std::size_t DEFAULT_MAX_SIZE = 4096;
+
+	explicit HpackTable(std::size_t max_size = DEFAULT_MAX_SIZE) : m_size(0),
+																   m_max_size(max_size)
+	{
+	}
+
+	// Entry at a one based HPACK index. Returns false if
+	// there is none.
+	bool at(std::size_t index, std::string_view &name, std::string_view &value) const
+	{
+		if (index == 0)
+		{
+			return false;
+		}
+
+		if (index <= STATIC_ENTRIES)
+		{
+			name = static_entries()[index - 1].name;
+			value = static_entries()[index - 1].value;
+			return true;
+		}
+
+		index -= STATIC_ENTRIES + 1;
+		if (index >= m_entries.size())
+		{
+			return false;
+		}
+
+		name = m_entries[index].name;
+		value = m_entries[index].value;
+		return true;
+	}
+
+	// Index of the entry with the given name and value, or
+	// failing that of the first one with the name, zero if
+	// there is neither.
+	std::size_t find(std::string_view name, std::string_view value, bool &exact) const
+	{
+		std::size_t name_index = 0;
+		exact = false;
+
+		for (std::size_t i = 0; i < STATIC_ENTRIES; i++)
+		{
+			if (name == static_entries()[i].name)
+			{
+				if (value == static_entries()[i].value)
+				{
+					exact = true;
+					return i + 1;
+				}
+
+				if (name_index == 0)
+				{
+					name_index = i + 1;
+				}
+			}
+		}
+
+		for (std::size_t i = 0; i < m_entries.size(); i++)
+		{
+			if (name == m_entries[i].name)
+			{
+				if (value == m_entries[i].value)
+				{
+					exact = true;
+					return STATIC_ENTRIES + 1 + i;
+				}
+
+				if (name_index == 0)
+				{
+					name_index = STATIC_ENTRIES + 1 + i;
+				}
+			}
+		}
+
+		return name_index;
+	}
+
+	void insert(std::string_view name, std::string_view value)
+	{
+		std::size_t size = entry_size(name, value);
+
+		// An entry larger than the whole table just
+		// empties it.
+		if (size > m_max_size)
+		{
+			m_entries.clear();
+			m_size = 0;
+			return;
+		}
+
+		m_entries.push_front(HpackField{std::string(name), std::string(value)});
+		m_size += size;
+		evict();
+	}
+
+	void set_max_size(std::size_t max_size)
+	{
+		m_max_size = max_size;
+		evict();
+	}
+
+	std::size_t max_size() const
+	{
+		return m_max_size;
+	}
+
+private:
+	struct StaticEntry
+	{
+		const char *name;
+		const char *value;
+	};
+
+	static const StaticEntry *static_entries()
+	{
+		static const StaticEntry entries[STATIC_ENTRIES] = {
+			{":authority", ""},
+			{":method", "GET"},
+			{":method", "POST"},
+			{":path", "/"},
+			{":path", "/index.html"},
+			{":scheme", "http"},
+			{":scheme", "https"},
+			{":status", "200"},
+			{":status", "204"},
+			{":status", "206"},
+			{":status", "304"},
+			{":status", "400"},
+			{":status", "404"},
+			{":status", "500"},
+			{"accept-charset", ""},
+			{"accept-encoding", "gzip, deflate"},
+			{"accept-language", ""},
+			{"accept-ranges", ""},
+			{"accept", ""},
+			{"access-control-allow-origin", ""},
+			{"age", ""},
+			{"allow", ""},
+			{"authorization", ""},
+			{"cache-control", ""},
+			{"content-disposition", ""},
+			{"content-encoding", ""},
+			{"content-language", ""},
+			{"content-length", ""},
+			{"content-location", ""},
+			{"content-range", ""},
+			{"content-type", ""},
+			{"cookie", ""},
+			{"date", ""},
+			{"etag", ""},
+			{"expect", ""},
+			{"expires", ""},
+			{"from", ""},
+			{"host", ""},
+			{"if-match", ""},
+			{"if-modified-since", ""},
+			{"if-none-match", ""},
+			{"if-range", ""},
+			{"if-unmodified-since", ""},
+			{"last-modified", ""},
+			{"link", ""},
+			{"location", ""},
+			{"max-forwards", ""},
+			{"proxy-authenticate", ""},
+			{"proxy-authorization", ""},
+			{"range", ""},
+			{"referer", ""},
+			{"refresh", ""},
+			{"retry-after", ""},
+			{"server", ""},
+			{"set-cookie", ""},
+			{"strict-transport-security", ""},
+			{"transfer-encoding", ""},
+			{"user-agent", ""},
+			{"vary", ""},
+			{"via", ""},
+			{"www-authenticate", ""}};
+
+		return entries;
+	}
+
+	static std::size_t entry_size(std::string_view name, std::string_view value)
+	{
+		return name.size() + value.size() + 32;
+	}
+
+	void evict()
+	{
+		while (m_size > m_max_size)
+		{
+			m_size -= entry_size(m_entries.back().name, m_entries.back().value);
+			m_entries.pop_back();
+		}
+	}
+
+	// Newest first, as the indices count.
+	std::deque<HpackField> m_entries;
+	std::size_t m_size;
+	std::size_t m_max_size;
+};
+
+// Decodes HPACK header blocks, with everything a client may
+// use: both kinds of literals, Huffman coded strings and
+// dynamic table size updates.
+class HpackDecoder
+{
+public:
+	// Decodes a complete header block into fields. Returns
+	// false on a compression error, after which the table
+	// is out of step with the peer's and the connection
+	// must go, or if the fields would exceed max_list_size.
+	bool decode(const unsigned char *data, std::size_t size,
+				std::vector<HpackField> &fields,
+				std::size_t max_list_size)
+	{
+		const unsigned char *end = data + size;
+		std::size_t list_size = 0;
+
+		fields.clear();
+
+		while (data < end)
+		{
+			unsigned char first = *data;
+			std::uint64_t index = 0;
+			std::string_view name, value;
+
+			if (first & 0x80)
+			{
+				// Indexed field.
+				if (!decode_integer(data, end, 7, index) ||
+					!m_table.at(index, name, value))
+				{
+					return false;
+				}
+
+				fields.push_back(HpackField{std::string(name), std::string(value)});
+			}
+			else if ((first & 0xe0) == 0x20)
+			{
+				// Dynamic table size update, bounded by
+				// what we have allowed in our SETTINGS. Only
+				// allowed at the start of a block (RFC 7541,
+				// section 4.2), before any field.
+				if (!fields.empty() ||
+					!decode_integer(data, end, 5, index) ||
+					index > HpackTable::DEFAULT_MAX_SIZE)
+				{
+					return false;
+				}
+
+				m_table.set_max_size(static_cast<std::size_t>(index));
+				continue;
+			}
+			else
+			{
+				// Literal field, either added to the table
+				// or not, with a new or an indexed name.
+				bool indexing = (first & 0x40) != 0;
+				HpackField field;
+
+				if (!decode_integer(data, end, indexing ? 6 : 4, index))
+				{
+					return false;
+				}
+
+				if (index == 0)
+				{
+					if (!decode_string(data, end, field.name))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					if (!m_table.at(index, name, value))
+					{
+						return false;
+					}
+
+					field.name.assign(name);
+				}
+
+				if (!decode_string(data, end, field.value))
+				{
+					return false;
+				}
+
+				if (indexing)
+				{
+					m_table.insert(field.name, field.value);
+				}
+
+				fields.push_back(std::move(field));
+			}
+
+			list_size += fields.back().name.size() + fields.back().value.size() + 32;
+			if (list_size > max_list_size)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+private:
+	static bool decode_integer(const unsigned char *&data, const unsigned char *end,
+							   unsigned int prefix_bits, std::uint64_t &value)
+	{
+		if (data == end)
+		{
+			return false;
+		}
+
+		std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+		value = *data++ & max_prefix;
+
+		if (value < max_prefix)
+		{
+			return true;
+		}
+
+		for (unsigned int shift = 0; shift <= 28; shift += 7)
+		{
+			if (data == end)
+			{
+				return false;
+			}
+
+			unsigned char byte = *data++;
+			value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+
+			if (!(byte & 0x80))
+			{
+				return true;
+			}
+		}
+
+		// Nothing sensible needs more than 32 bits.
+		return false;
+	}
+
+	static bool decode_string(const unsigned char *&data, const unsigned char *end,
+							  std::string &str)
+	{
+		if (data == end)
+		{
+			return false;
+		}
+
+		bool huffman = (*data & 0x80) != 0;
+		std::uint64_t length = 0;
+
+		if (!decode_integer(data, end, 7, length) ||
+			length > static_cast<std::uint64_t>(end - data))
+		{
+			return false;
+		}
+
+		const unsigned char *begin = data;
+		data += length;
+
+		if (!huffman)
+		{
+			str.assign(reinterpret_cast<const char *>(begin), length);
+			return true;
+		}
+
+		return huffman_decode(begin, static_cast<std::size_t>(length), str);
+	}
+
+	// Walks the code tree bit by bit. The string must end
+	// with at most seven bits of padding, all ones, and must
+	// not contain the EOS symbol.
+	static bool huffman_decode(const unsigned char *data, std::size_t size, std::string &str)
+	{
+		const HuffmanTree &tree = huffman_tree();
+
+		str.clear();
+
+		int node = 0;
+		unsigned int padding_bits = 0;
+		bool padding_ones = true;
+
+		for (std::size_t i = 0; i < size; i++)
+		{
+			for (int bit = 7; bit >= 0; bit--)
+			{
+				unsigned int b = (data[i] >> bit) & 1;
+
+				node = tree.children[node][b];
+				padding_bits++;
+				padding_ones = padding_ones && b == 1;
+
+				if (node < 0)
+				{
+					int symbol = ~node;
+					if (symbol == 256)
+					{
+						return false;
+					}
+
+					str.push_back(static_cast<char>(symbol));
+					node = 0;
+					padding_bits = 0;
+					padding_ones = true;
+				}
+				else if (node == 0)
+				{
+					return false;
+				}
+			}
+		}
+
+		return padding_bits <= 7 && padding_ones;
+	}
+
+	// Inner nodes are indexed from the root at 0, leaves are
+	// stored as ~symbol, and 0 marks a missing child.
+	struct HuffmanTree
+	{
+		std::vector<std::array<int, 2>> children;
+	};
+
+	static const HuffmanTree &huffman_tree()
+	{
+		// Code and length of every symbol, EOS last (RFC
+		// 7541, appendix B).
+		static const std::pair<std::uint32_t, unsigned int> codes[257] = {
+			{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+			{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+			{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+			{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+			{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+			{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+			{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+			{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+			{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+			{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+			{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+			{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+			{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+			{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+			{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+			{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+			{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+			{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+			{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+			{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+			{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+			{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+			{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+			{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+			{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+			{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+			{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+			{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+			{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+			{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+			{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+			{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+			{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+			{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+			{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+			{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+			{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+			{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+			{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+			{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+			{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+			{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+			{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+			{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+			{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+			{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+			{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+			{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+			{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+			{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+			{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+			{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+			{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+			{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+			{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+			{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+			{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+			{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+			{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+			{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+			{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+			{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+			{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+			{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+			{0x3fffffff, 30}};
+
+		static const HuffmanTree tree = []()
+		{
+			HuffmanTree t;
+			t.children.push_back({0, 0});
+
+			for (int symbol = 0; symbol < 257; symbol++)
+			{
+				std::uint32_t code = codes[symbol].first;
+				unsigned int length = codes[symbol].second;
+				int node = 0;
+
+				for (unsigned int i = length; i > 1; i--)
+				{
+					unsigned int b = (code >> (i - 1)) & 1;
+
+					if (t.children[node][b] == 0)
+					{
+						t.children[node][b] = static_cast<int>(t.children.size());
+						t.children.push_back({0, 0});
+					}
+
+					node = t.children[node][b];
+				}
+
+				t.children[node][code & 1] = ~symbol;
+			}
+
+			return t;
+		}();
+
+		return tree;
+	}
+
+	HpackTable m_table;
+};
+
+// Encodes response header blocks. Fields whose values
+// repeat from one response to the next are added to the
+// dynamic table, so that later responses refer to them with
+// a byte or two; the others are sent as plain literals.
+class HpackEncoder
+{
+public:
+	HpackEncoder() : m_size_update_pending(false)
+	{
+	}
+
+	// Follows the peer's SETTINGS_HEADER_TABLE_SIZE, up to
+	// the default size.
+	void set_max_table_size(std::size_t size)
+	{
+		size = std::min(size, HpackTable::DEFAULT_MAX_SIZE);
+
+		if (size != m_table.max_size())
+		{
+			m_table.set_max_size(size);
+			m_size_update_pending = true;
+		}
+	}
+
+	// Starts a header block, which must announce a change
+	// of the table size first.
+	void begin_block(std::string &out)
+	{
+		if (m_size_update_pending)
+		{
+			encode_integer(out, 0x20, 5, m_table.max_size());
+			m_size_update_pending = false;
+		}
+	}
+
+	void encode(std::string_view name, std::string_view value, bool indexing, std::string &out)
+	{
+		bool exact = false;
+		std::size_t index = m_table.find(name, value, exact);
+
+		if (exact)
+		{
+			encode_integer(out, 0x80, 7, index);
+			return;
+		}
+
+		if (indexing)
+		{
+			encode_integer(out, 0x40, 6, index);
+			m_table.insert(name, value);
+		}
+		else
+		{
+			encode_integer(out, 0x00, 4, index);
+		}
+
+		if (index == 0)
+		{
+			encode_string(out, name);
+		}
+
+		encode_string(out, value);
+	}
+
+private:
+	static void encode_integer(std::string &out, unsigned char flags,
+							   unsigned int prefix_bits, std::uint64_t value)
+	{
+		std::uint64_t max_prefix = (1u << prefix_bits) - 1;
+
+		if (value < max_prefix)
+		{
+			out.push_back(static_cast<char>(flags | value));
+			return;
+		}
+
+		out.push_back(static_cast<char>(flags | max_prefix));
+		value -= max_prefix;
+
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+
+		out.push_back(static_cast<char>(value));
+	}
+
+	// Response header values are short, and Huffman coding
+	// them is not worth the cycles.
+	static void encode_string(std::string &out, std::string_view str)
+	{
+		encode_integer(out, 0x00, 7, str.size());
+		out.append(str);
+	}
+
+	HpackTable m_table;
+	bool m_size_update_pending;
+};
+
+// Request of an HTTP/2 stream, as decoded from its HEADERS.
+struct Http2Request
+{
+	std::uint32_t stream_id = 0;
+	std::string method;
+	std::string path;
+
+	// The regular fields, names in lower case.
+	std::vector<HpackField> headers;
+
+	// Value of the first field with the given name, or an
+	// empty view if there is none.
+	std::string_view header(std::string_view name) const
+	{
+		for (const auto &field : headers)
+		{
+			if (field.name == name)
+			{
+				return field.value;
+			}
+		}
+
+		return std::string_view();
+	}
+};
+
+// Response to an HTTP/2 stream. The body is made of the
+// byte ranges of either the cached resource or the file,
+// each preceded by its part headers if there are any, and
+// followed by the closing boundary, as for HTTP/1.1.
+struct Http2Response
+{
+	unsigned int status = 200;
+
+	// "name: value\r\n" lines, as for HTTP/1.1.
+	std::string headers;
+
+	std::shared_ptr<const CachedResource> cached_resource;
+	FileDescriptor file;
+	std::vector<ByteRange> ranges;
+	std::vector<std::string> part_headers;
+	std::uint64_t content_length = 0;
+};
+
+// What the access log needs of a completed stream.
+struct Http2Completion
+{
+	std::string method;
+	std::string path;
+	unsigned int status;
+	std::uint64_t bytes;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point response_start;
+};
+
+// The HTTP/2 (RFC 9113) framing layer of a connection. It is
+// handed the bytes received and turns them into requests,
+// takes the responses, and produces the bytes to send: the
+// frames it has queued, followed by DATA frames interleaved
+// round robin between the streams with a response body, as
+// far as both flow control windows allow. It does no I/O of
+// its own besides reading files into DATA frames.
+class Http2Connection
+{
+public:
+	// The client preface, of which the part left after the
+	// "PRI * HTTP/2.0" request line is expected on a prior
+	// knowledge connection.
+	static constexpr const char *CLIENT_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+	Http2Connection(const ServerConfig &config,
+					std::string_view expected_preface) : m_config(config),
+														 m_preface(expected_preface),
+														 m_settings_received(false),
+														 m_input(RECEIVE_BUFFER_SIZE),
+														 m_input_size(0),
+														 m_header_stream(0),
+														 m_last_stream_id(0),
+														 m_warming(0),
+														 m_peer_initial_window(DEFAULT_WINDOW_SIZE),
+														 m_peer_max_frame_size(DEFAULT_MAX_FRAME_SIZE),
+														 m_send_window(DEFAULT_WINDOW_SIZE),
+														 m_goaway_sent(false),
+														 m_peer_goaway(false),
+														 m_failed(false)
+	{
+	}
+
+	// Queues our SETTINGS, which must be the first frame we
+	// send, preceded by the given bytes if any.
+	void start(std::string_view prologue)
+	{
+		m_pending.append(prologue);
+
+		std::string settings;
+		append_setting(settings, Setting::max_concurrent_streams,
+					   m_config.http2_max_concurrent_streams);
+		append_setting(settings, Setting::max_header_list_size,
+					   MAX_HEADER_LIST_SIZE);
+
+		append_frame_header(m_pending, settings.size(), FrameType::settings, 0, 0);
+		m_pending.append(settings);
+	}
+
+	// Takes over the request of an HTTP/1.1 Upgrade as
+	// stream 1, along with the settings from its
+	// HTTP2-Settings header. Returns false if those are
+	// malformed, before changing anything.
+	bool upgrade(std::string_view settings_base64url, Http2Request request)
+	{
+		std::string settings;
+		if (!decode_base64url(settings_base64url, settings) ||
+			settings.size() % 6 != 0)
+		{
+			return false;
+		}
+
+		if (!apply_settings(reinterpret_cast<const unsigned char *>(settings.data()),
+							settings.size()))
+		{
+			return false;
+		}
+
+		request.stream_id = 1;
+		open_stream(std::move(request));
+
+		return true;
+	}
+
+	// Where to receive the next bytes, and how many fit.
+	char *receive_buffer(std::size_t &size)
+	{
+		size = m_input.size() - m_input_size;
+		return m_input.data() + m_input_size;
+	}
+
+	// Processes the bytes received into receive_buffer().
+	void received(std::size_t size)
+	{
+		m_input_size += size;
+
+		std::size_t position = 0;
+
+		if (!m_preface.empty())
+		{
+			std::size_t length = std::min(m_preface.size(), m_input_size);
+
+			if (std::memcmp(m_input.data(), m_preface.data(), length) != 0)
+			{
+				fail(Error::protocol_error);
+				return;
+			}
+
+			m_preface.erase(0, length);
+			position = length;
+		}
+
+		while (!m_failed && m_input_size - position >= FRAME_HEADER_SIZE)
+		{
+			const unsigned char *header =
+				reinterpret_cast<const unsigned char *>(m_input.data() + position);
+
+			std::size_t length = (std::size_t(header[0]) << 16) |
+								 (std::size_t(header[1]) << 8) |
+								 header[2];
+
+			if (length > DEFAULT_MAX_FRAME_SIZE)
+			{
+				fail(Error::frame_size_error);
+				return;
+			}
+
+			if (m_input_size - position < FRAME_HEADER_SIZE + length)
+			{
+				break;
+			}
+
+			on_frame(static_cast<FrameType>(header[3]),
+					 header[4],
+					 read_u32(header + 5) & 0x7fffffff,
+					 header + FRAME_HEADER_SIZE,
+					 length);
+
+			position += FRAME_HEADER_SIZE + length;
+		}
+
+		// Keep a partial frame for the next round.
+		std::memmove(m_input.data(), m_input.data() + position, m_input_size - position);
+		m_input_size -= position;
+	}
+
+	// The next request to be answered, or nullptr if there
+	// is none. Requests may be answered in any order, and
+	// each stays valid until its stream is answered, even
+	// if the client resets the stream meanwhile.
+	const Http2Request *next_request()
+	{
+		if (m_requests.empty())
+		{
+			return nullptr;
+		}
+
+		Stream *stream = m_requests.front();
+		m_requests.pop_front();
+		stream->handed_out = true;
+
+		return &stream->request;
+	}
+
+	// Request of a stream handed out by next_request() and
+	// not answered yet.
+	const Http2Request *request(std::uint32_t stream_id)
+	{
+		Stream *stream = find_stream(stream_id);
+		return stream == nullptr ? nullptr : &stream->request;
+	}
+
+	// Answers a request returned by next_request().
+	void respond(std::uint32_t stream_id, Http2Response response)
+	{
+		Stream *stream = find_stream(stream_id);
+		if (stream == nullptr || stream->answered)
+		{
+			return;
+		}
+
+		stream->answered = true;
+
+		if (stream->reset)
+		{
+			// Nobody is waiting for it any more.
+			retire(*stream);
+			return;
+		}
+
+		stream->response = std::move(response);
+		stream->response_start = std::chrono::steady_clock::now();
+		stream->segment_count =
+			stream->response.ranges.empty()
+				? 0
+				: (stream->response.part_headers.empty()
+					   ? 1
+					   : 2 * stream->response.ranges.size() + 1);
+
+		bool has_body = stream->segment_count > 0 &&
+						(stream->response.cached_resource ||
+						 stream->response.file.is_open());
+
+		queue_headers(*stream, !has_body);
+
+		if (!has_body)
+		{
+			complete(*stream);
+			return;
+		}
+
+		stream->queued = true;
+		m_ready.push_back(stream);
+	}
+
+	// Moves everything there is to send into buffers, which
+	// remain valid until output_written(). Returns false if
+	// there is nothing to send.
+	bool prepare_output(std::vector<asio::const_buffer> &buffers)
+	{
+		// Whatever the previous write referred to is no
+		// longer needed.
+		m_retired.clear();
+		m_segments.clear();
+
+		m_sending.swap(m_pending);
+		m_pending.clear();
+		add_segment(nullptr, 0, m_sending.size());
+
+		std::size_t budget = MAX_DATA_PER_WRITE;
+
+		// After an Upgrade, bodies wait for the client's
+		// preface, as some clients have little room for what
+		// follows the 101 until they have switched.
+		while (m_settings_received && budget > 0 && m_send_window > 0 && !m_ready.empty())
+		{
+			Stream *stream = m_ready.front();
+			m_ready.pop_front();
+
+			if (stream->send_window <= 0)
+			{
+				// Resumes on a WINDOW_UPDATE.
+				stream->queued = false;
+				continue;
+			}
+
+			if (!send_data(*stream, budget))
+			{
+				continue;
+			}
+
+			if (stream->blocked)
+			{
+				// Resumes on file_warmed().
+				stream->queued = false;
+				continue;
+			}
+
+			if (stream->segment == stream->segment_count)
+			{
+				stream->queued = false;
+				complete(*stream);
+			}
+			else
+			{
+				m_ready.push_back(stream);
+			}
+		}
+
+		m_completions_sent.swap(m_completed);
+		m_completed.clear();
+
+		buffers.clear();
+		for (const auto &segment : m_segments)
+		{
+			const char *data = segment.external != nullptr ? segment.external
+														   : m_sending.data() + segment.offset;
+			buffers.push_back(asio::buffer(data, segment.length));
+		}
+
+		return !buffers.empty();
+	}
+
+	// The output of prepare_output() has been sent. Returns
+	// the streams it completed.
+	const std::vector<Http2Completion> &output_written()
+	{
+		m_written.swap(m_completions_sent);
+		m_completions_sent.clear();
+
+		return m_written;
+	}
+
+	// Refuses new streams from now on, and lets the client
+	// know which ones will still be answered.
+	void go_away()
+	{
+		if (!m_goaway_sent)
+		{
+			queue_goaway(Error::no_error);
+		}
+	}
+
+	bool has_open_streams() const
+	{
+		return !m_streams.empty();
+	}
+
+	// With a file I/O pool, a stream whose file is not in
+	// the page cache waits for the pool to read it in rather
+	// than holding up the event loop. Returns the part of
+	// the file the next such stream waits for, which the
+	// caller reads in and reports through file_warmed(), or
+	// false if none is waiting.
+	bool file_wanted(int &fd, std::uint64_t &offset, std::size_t &size)
+	{
+		while (!m_blocked.empty())
+		{
+			Stream *stream = find_stream(m_blocked.front());
+			m_blocked.pop_front();
+
+			// Reset meanwhile.
+			if (stream == nullptr || !stream->blocked || stream->reset)
+			{
+				continue;
+			}
+
+			m_warming = stream->id;
+			fd = stream->response.file.get();
+			offset = stream->warm_begin;
+			size = static_cast<std::size_t>(stream->warm_end - stream->warm_begin);
+			return true;
+		}
+
+		return false;
+	}
+
+	void file_warmed(bool ok)
+	{
+		Stream *stream = find_stream(m_warming);
+		m_warming = 0;
+
+		if (stream == nullptr || !stream->blocked || stream->reset)
+		{
+			return;
+		}
+
+		stream->blocked = false;
+
+		if (!ok)
+		{
+			queue_rst_stream(stream->id, Error::internal_error);
+			close_stream(*stream);
+			return;
+		}
+
+		schedule(*stream);
+	}
+
+	// Whether the connection is done with, once what has
+	// been queued is sent.
+	bool finished() const
+	{
+		return m_failed ||
+			   ((m_goaway_sent || m_peer_goaway) && m_streams.empty());
+	}
+
+private:
+	enum class FrameType : std::uint8_t
+	{
+		data = 0x0,
+		headers = 0x1,
+		priority = 0x2,
+		rst_stream = 0x3,
+		settings = 0x4,
+		push_promise = 0x5,
+		ping = 0x6,
+		goaway = 0x7,
+		window_update = 0x8,
+		continuation = 0x9
+	};
+
+	enum class Error : std::uint32_t
+	{
+		no_error = 0x0,
+		protocol_error = 0x1,
+		internal_error = 0x2,
+		flow_control_error = 0x3,
+		stream_closed = 0x5,
+		frame_size_error = 0x6,
+		refused_stream = 0x7,
+		compression_error = 0x9
+	};
+
+	enum class Setting : std::uint16_t
+	{
+		header_table_size = 0x1,
+		enable_push = 0x2,
+		max_concurrent_streams = 0x3,
+		initial_window_size = 0x4,
+		max_frame_size = 0x5,
+		max_header_list_size = 0x6
+	};
+
+	static const std::uint8_t FLAG_END_STREAM = 0x1;
+	static const std::uint8_t FLAG_ACK = 0x1;
+	static const std::uint8_t FLAG_END_HEADERS = 0x4;
+	static const std::uint8_t FLAG_PADDED = 0x8;
+	static const std::uint8_t FLAG_PRIORITY = 0x20;
+
+	static const std::size_t FRAME_HEADER_SIZE = 9;
+	static const std::size_t DEFAULT_MAX_FRAME_SIZE = 16384;
+	static const std::int64_t DEFAULT_WINDOW_SIZE = 65535;
+	static const std::int64_t MAX_WINDOW_SIZE = 0x7fffffff;
+
+	// Room for two frames of the largest size we accept.
+	static const std::size_t RECEIVE_BUFFER_SIZE = 2 * (FRAME_HEADER_SIZE + DEFAULT_MAX_FRAME_SIZE);
+
+	// Bounds on a request's header fields, and on a header
+	// block spread over CONTINUATION frames.
+	static const std::size_t MAX_HEADER_LIST_SIZE = 16 * 1024;
+	static const std::size_t MAX_HEADER_BLOCK_SIZE = 64 * 1024;
+
+	// Response body bytes sent per write.
+	static const std::size_t MAX_DATA_PER_WRITE = 256 * 1024;
+
+	struct Stream
+	{
+		std::uint32_t id = 0;
+		std::int64_t send_window = 0;
+		Http2Request request;
+		Http2Response response;
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::time_point response_start;
+
+		// Position in the response body.
+		std::size_t segment_count = 0;
+		std::size_t segment = 0;
+		std::uint64_t segment_offset = 0;
+
+		// Waiting in m_ready for its turn to send.
+		bool queued = false;
+
+		// Waiting for the part of its file from warm_begin to
+		// warm_end to be read into the page cache, and once
+		// it has, the part that can be read without waiting.
+		bool blocked = false;
+		std::uint64_t warm_begin = 0;
+		std::uint64_t warm_end = 0;
+
+		// Handed out by next_request(), and answered.
+		bool handed_out = false;
+		bool answered = false;
+
+		// Reset before it was answered.
+		bool reset = false;
+	};
+
+	// A part of the output, either in m_sending or
+	// elsewhere, such as in a cached resource.
+	struct Segment
+	{
+		const char *external;
+		std::size_t offset;
+		std::size_t length;
+	};
+
+	void on_frame(FrameType type, std::uint8_t flags, std::uint32_t stream_id,
+				  const unsigned char *payload, std::size_t length)
+	{
+		// The client's SETTINGS come first, and nothing
+		// may come between the frames of a header block.
+		if (!m_settings_received && type != FrameType::settings)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		if (m_header_stream != 0 && type != FrameType::continuation)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		switch (type)
+		{
+		case FrameType::data:
+			on_data(flags, stream_id, payload, length);
+			break;
+
+		case FrameType::headers:
+			on_headers(flags, stream_id, payload, length);
+			break;
+
+		case FrameType::continuation:
+			if (stream_id != m_header_stream)
+			{
+				fail(Error::protocol_error);
+				return;
+			}
+
+			append_header_block(flags, payload, length);
+			break;
+
+		case FrameType::rst_stream:
+			if (stream_id == 0 || length != 4)
+			{
+				fail(stream_id == 0 ? Error::protocol_error : Error::frame_size_error);
+				return;
+			}
+
+			if (Stream *stream = find_stream(stream_id))
+			{
+				close_stream(*stream);
+			}
+			break;
+
+		case FrameType::settings:
+			on_settings(flags, stream_id, payload, length);
+			break;
+
+		case FrameType::ping:
+			if (stream_id != 0 || length != 8)
+			{
+				fail(stream_id != 0 ? Error::protocol_error : Error::frame_size_error);
+				return;
+			}
+
+			if (!(flags & FLAG_ACK))
+			{
+				append_frame_header(m_pending, 8, FrameType::ping, FLAG_ACK, 0);
+				m_pending.append(reinterpret_cast<const char *>(payload), 8);
+			}
+			break;
+
+		case FrameType::goaway:
+			if (stream_id != 0)
+			{
+				fail(Error::protocol_error);
+				return;
+			}
+
+			// The streams already open are still answered.
+			m_peer_goaway = true;
+			break;
+
+		case FrameType::window_update:
+			on_window_update(stream_id, payload, length);
+			break;
+
+		case FrameType::push_promise:
+			// Only servers push.
+			fail(Error::protocol_error);
+			break;
+
+		default:
+			// PRIORITY is advisory, and unknown frame
+			// types are to be ignored.
+			break;
+		}
+	}
+
+	void on_data(std::uint8_t flags, std::uint32_t stream_id,
+				 const unsigned char *payload, std::size_t length)
+	{
+		if (stream_id == 0 || stream_id > m_last_stream_id)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		if ((flags & FLAG_PADDED) && (length == 0 || payload[0] >= length))
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		// Request bodies are not used; whatever they take
+		// of the windows, padding included, is given back
+		// at once.
+		if (length > 0)
+		{
+			queue_window_update(0, length);
+
+			if (find_stream(stream_id) != nullptr && !(flags & FLAG_END_STREAM))
+			{
+				queue_window_update(stream_id, length);
+			}
+		}
+	}
+
+	void on_headers(std::uint8_t flags, std::uint32_t stream_id,
+					const unsigned char *payload, std::size_t length)
+	{
+		if (stream_id == 0 || stream_id % 2 == 0)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		std::size_t padding = 0;
+
+		if (flags & FLAG_PADDED)
+		{
+			if (length == 0)
+			{
+				fail(Error::protocol_error);
+				return;
+			}
+
+			padding = payload[0];
+			payload++;
+			length--;
+		}
+
+		if (flags & FLAG_PRIORITY)
+		{
+			if (length < 5)
+			{
+				fail(Error::protocol_error);
+				return;
+			}
+
+			payload += 5;
+			length -= 5;
+		}
+
+		if (padding > length)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		m_header_stream = stream_id;
+		m_header_block.clear();
+
+		append_header_block(flags, payload, length - padding);
+	}
+
+	void append_header_block(std::uint8_t flags, const unsigned char *payload, std::size_t length)
+	{
+		if (m_header_block.size() + length > MAX_HEADER_BLOCK_SIZE)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		m_header_block.append(reinterpret_cast<const char *>(payload), length);
+
+		if (flags & FLAG_END_HEADERS)
+		{
+			on_header_block();
+		}
+	}
+
+	// A complete header block has arrived. It must be
+	// decoded in any case, to keep the table in step.
+	void on_header_block()
+	{
+		std::uint32_t stream_id = m_header_stream;
+		m_header_stream = 0;
+
+		if (!m_decoder.decode(reinterpret_cast<const unsigned char *>(m_header_block.data()),
+							  m_header_block.size(),
+							  m_fields,
+							  MAX_HEADER_LIST_SIZE))
+		{
+			fail(Error::compression_error);
+			return;
+		}
+
+		// Trailers of a request, or a stream that is
+		// already closed; neither needs anything from us.
+		if (stream_id <= m_last_stream_id)
+		{
+			return;
+		}
+
+		m_last_stream_id = stream_id;
+
+		// After a GOAWAY new streams are ignored.
+		if (m_goaway_sent)
+		{
+			return;
+		}
+
+		if (m_streams.size() >= m_config.http2_max_concurrent_streams)
+		{
+			queue_rst_stream(stream_id, Error::refused_stream);
+			return;
+		}
+
+		Http2Request request;
+		request.stream_id = stream_id;
+
+		for (auto &field : m_fields)
+		{
+			if (field.name == ":method")
+			{
+				request.method = std::move(field.value);
+			}
+			else if (field.name == ":path")
+			{
+				request.path = std::move(field.value);
+			}
+			else if (!field.name.empty() && field.name[0] != ':')
+			{
+				// Field names must be in lower case.
+				if (std::any_of(field.name.begin(), field.name.end(),
+								[](char c)
+								{ return c >= 'A' && c <= 'Z'; }))
+				{
+					request.path.clear();
+					break;
+				}
+
+				request.headers.push_back(std::move(field));
+			}
+		}
+
+		if (request.method.empty() || request.path.empty())
+		{
+			// A malformed request.
+			queue_rst_stream(stream_id, Error::protocol_error);
+			return;
+		}
+
+		open_stream(std::move(request));
+	}
+
+	void open_stream(Http2Request request)
+	{
+		std::unique_ptr<Stream> stream(new Stream);
+		stream->id = request.stream_id;
+		stream->send_window = m_peer_initial_window;
+		stream->request = std::move(request);
+		stream->start = std::chrono::steady_clock::now();
+
+		m_last_stream_id = std::max(m_last_stream_id, stream->id);
+		m_requests.push_back(stream.get());
+		m_streams[stream->id] = std::move(stream);
+	}
+
+	void on_settings(std::uint8_t flags, std::uint32_t stream_id,
+					 const unsigned char *payload, std::size_t length)
+	{
+		if (stream_id != 0)
+		{
+			fail(Error::protocol_error);
+			return;
+		}
+
+		if (flags & FLAG_ACK)
+		{
+			if (length != 0)
+			{
+				fail(Error::frame_size_error);
+			}
+			return;
+		}
+
+		if (length % 6 != 0)
+		{
+			fail(Error::frame_size_error);
+			return;
+		}
+
+		if (!apply_settings(payload, length))
+		{
+			return;
+		}
+
+		m_settings_received = true;
+		append_frame_header(m_pending, 0, FrameType::settings, FLAG_ACK, 0);
+	}
+
+	// Returns false, failing the connection, if a setting
+	// has an invalid value.
+	bool apply_settings(const unsigned char *payload, std::size_t length)
+	{
+		for (std::size_t i = 0; i + 6 <= length; i += 6)
+		{
+			auto setting = static_cast<Setting>((payload[i] << 8) | payload[i + 1]);
+			std::uint32_t value = read_u32(payload + i + 2);
+
+			switch (setting)
+			{
+			case Setting::header_table_size:
+				m_encoder.set_max_table_size(value);
+				break;
+
+			case Setting::enable_push:
+				if (value > 1)
+				{
+					fail(Error::protocol_error);
+					return false;
+				}
+				break;
+
+			case Setting::initial_window_size:
+			{
+				if (value > MAX_WINDOW_SIZE)
+				{
+					fail(Error::flow_control_error);
+					return false;
+				}
+
+				// Applies to the open streams as well.
+				std::int64_t delta = static_cast<std::int64_t>(value) - m_peer_initial_window;
+				m_peer_initial_window = value;
+
+				for (auto &entry : m_streams)
+				{
+					Stream &stream = *entry.second;
+					stream.send_window += delta;
+
+					if (stream.send_window > MAX_WINDOW_SIZE)
+					{
+						fail(Error::flow_control_error);
+						return false;
+					}
+
+					schedule(stream);
+				}
+				break;
+			}
+
+			case Setting::max_frame_size:
+				if (value < DEFAULT_MAX_FRAME_SIZE || value > 0xffffff)
+				{
+					fail(Error::protocol_error);
+					return false;
+				}
+
+				m_peer_max_frame_size = value;
+				break;
+
+			default:
+				// Nothing to do for the maximum number of
+				// streams, as we do not push, and for the
+				// maximum header list size; unknown settings
+				// are to be ignored.
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	void on_window_update(std::uint32_t stream_id, const unsigned char *payload, std::size_t length)
+	{
+		if (length != 4)
+		{
+			fail(Error::frame_size_error);
+			return;
+		}
+
+		std::int64_t increment = read_u32(payload) & 0x7fffffff;
+
+		if (stream_id == 0)
+		{
+			m_send_window += increment;
+
+			if (increment == 0 || m_send_window > MAX_WINDOW_SIZE)
+			{
+				fail(increment == 0 ? Error::protocol_error : Error::flow_control_error);
+			}
+			return;
+		}
+
+		Stream *stream = find_stream(stream_id);
+		if (stream == nullptr)
+		{
+			return;
+		}
+
+		stream->send_window += increment;
+
+		if (increment == 0 || stream->send_window > MAX_WINDOW_SIZE)
+		{
+			queue_rst_stream(stream_id, increment == 0 ? Error::protocol_error
+													   : Error::flow_control_error);
+			close_stream(*stream);
+			return;
+		}
+
+		schedule(*stream);
+	}
+
+	// Puts a stream back in line to send, if it has been
+	// answered and is not in line already.
+	void schedule(Stream &stream)
+	{
+		if (!stream.queued && !stream.reset && !stream.blocked &&
+			stream.segment < stream.segment_count &&
+			stream.send_window > 0)
+		{
+			stream.queued = true;
+			m_ready.push_back(&stream);
+		}
+	}
+
+	// Sends the next DATA frame of the stream within the
+	// budget. Returns false if the stream has been reset for
+	// failing to read its file. A stream whose file has to
+	// be read from disk first is marked as blocked instead.
+	bool send_data(Stream &stream, std::size_t &budget)
+	{
+		const Http2Response &response = stream.response;
+		bool multipart = !response.part_headers.empty();
+
+		// The current segment: either part headers, or
+		// a byte range of the resource.
+		const char *memory = nullptr;
+		std::uint64_t file_offset = 0;
+		std::uint64_t segment_length = 0;
+
+		if (multipart && stream.segment % 2 == 0)
+		{
+			const std::string &part = response.part_headers[stream.segment / 2];
+			memory = part.data();
+			segment_length = part.size();
+		}
+		else
+		{
+			const ByteRange &range = response.ranges[multipart ? stream.segment / 2 : 0];
+			segment_length = range.length;
+
+			if (response.cached_resource)
+			{
+				memory = response.cached_resource->data() + range.first;
+			}
+			else
+			{
+				file_offset = range.first;
+			}
+		}
+
+		std::uint64_t length = segment_length - stream.segment_offset;
+		length = std::min<std::uint64_t>(length, m_peer_max_frame_size);
+		length = std::min<std::uint64_t>(length, static_cast<std::uint64_t>(stream.send_window));
+		length = std::min<std::uint64_t>(length, static_cast<std::uint64_t>(m_send_window));
+		length = std::min<std::uint64_t>(length, budget);
+
+		// Without a file I/O pool files are read here, as
+		// they come. Otherwise only what is in the page cache
+		// is, unless the pool has just read it in.
+		std::uint64_t position = file_offset + stream.segment_offset;
+		bool deferred = memory == nullptr && m_config.file_io_threads > 0;
+		bool warm = !deferred;
+
+		if (deferred && position >= stream.warm_begin && position < stream.warm_end)
+		{
+			length = std::min(length, stream.warm_end - position);
+			warm = true;
+		}
+
+		bool last = stream.segment + 1 == stream.segment_count &&
+					stream.segment_offset + length == segment_length;
+
+		std::size_t frame_start = m_sending.size();
+		append_frame_header(m_sending, static_cast<std::size_t>(length), FrameType::data,
+							last ? FLAG_END_STREAM : 0, stream.id);
+
+		if (memory != nullptr)
+		{
+			add_segment(nullptr, frame_start, FRAME_HEADER_SIZE);
+			add_segment(memory + stream.segment_offset, 0, static_cast<std::size_t>(length));
+		}
+		else
+		{
+			m_sending.resize(m_sending.size() + static_cast<std::size_t>(length));
+			char *data = &m_sending[frame_start + FRAME_HEADER_SIZE];
+
+			ssize_t n = static_cast<ssize_t>(length);
+			if (warm)
+			{
+				if (!read_file(response.file.get(), data, static_cast<std::size_t>(length),
+							   static_cast<off_t>(position)))
+				{
+					n = -1;
+				}
+			}
+			else
+			{
+				n = read_cached(response.file.get(), data, static_cast<std::size_t>(length),
+								static_cast<off_t>(position));
+			}
+
+			if (n < 0 && errno == EAGAIN)
+			{
+				// Left to the pool; see file_wanted().
+				m_sending.resize(frame_start);
+
+				std::size_t window = m_config.file_readahead_bytes > 0 ? m_config.file_readahead_bytes
+																	   : MAX_DATA_PER_WRITE;
+				stream.blocked = true;
+				stream.warm_begin = position;
+				stream.warm_end = std::min<std::uint64_t>(file_offset + segment_length, position + window);
+				m_blocked.push_back(stream.id);
+				return true;
+			}
+
+			if (n > 0 && static_cast<std::uint64_t>(n) < length)
+			{
+				// Only so much is in the page cache; shorten
+				// the frame, which is then not the last.
+				length = static_cast<std::uint64_t>(n);
+				m_sending.resize(frame_start + FRAME_HEADER_SIZE + static_cast<std::size_t>(length));
+				m_sending[frame_start] = static_cast<char>((length >> 16) & 0xff);
+				m_sending[frame_start + 1] = static_cast<char>((length >> 8) & 0xff);
+				m_sending[frame_start + 2] = static_cast<char>(length & 0xff);
+				m_sending[frame_start + 4] = 0;
+			}
+
+			if (n <= 0)
+			{
+				// The file has shrunk or failed under us;
+				// the promised length cannot be honored.
+				m_sending.resize(frame_start);
+				queue_rst_stream(stream.id, Error::internal_error);
+				close_stream(stream);
+				return false;
+			}
+
+			add_segment(nullptr, frame_start, FRAME_HEADER_SIZE + static_cast<std::size_t>(length));
+		}
+
+		stream.send_window -= static_cast<std::int64_t>(length);
+		m_send_window -= static_cast<std::int64_t>(length);
+		budget -= static_cast<std::size_t>(length);
+
+		stream.segment_offset += length;
+		if (stream.segment_offset == segment_length)
+		{
+			stream.segment++;
+			stream.segment_offset = 0;
+		}
+
+		return true;
+	}
+
+	static bool read_file(int fd, char *data, std::size_t size, off_t offset)
+	{
+		while (size > 0)
+		{
+			ssize_t n = ::pread(fd, data, size, offset);
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (n <= 0)
+			{
+				return false;
+			}
+
+			data += n;
+			size -= static_cast<std::size_t>(n);
+			offset += n;
+		}
+
+		return true;
+	}
+
+	void add_segment(const char *external, std::size_t offset, std::size_t length)
+	{
+		if (length == 0)
+		{
+			return;
+		}
+
+		// Consecutive parts of m_sending go out as one.
+		if (external == nullptr && !m_segments.empty() &&
+			m_segments.back().external == nullptr &&
+			m_segments.back().offset + m_segments.back().length == offset)
+		{
+			m_segments.back().length += length;
+			return;
+		}
+
+		m_segments.push_back(Segment{external, offset, length});
+	}
+
+	// Encodes the response headers into HEADERS and, if
+	// they do not fit in one frame, CONTINUATION frames.
+	void queue_headers(Stream &stream, bool end_stream)
+	{
+		std::string &block = m_header_block_out;
+		block.clear();
+
+		m_encoder.begin_block(block);
+
+		char status[8];
+		auto result = std::to_chars(status, status + sizeof(status), stream.response.status);
+		m_encoder.encode(":status", std::string_view(status, result.ptr - status), false, block);
+
+		std::string_view lines = stream.response.headers;
+
+		while (!lines.empty())
+		{
+			std::size_t end = lines.find("\r\n");
+			std::string_view line = lines.substr(0, end);
+			lines = end == std::string_view::npos ? std::string_view() : lines.substr(end + 2);
+
+			std::size_t colon = line.find(':');
+			if (colon == std::string_view::npos)
+			{
+				continue;
+			}
+
+			std::string_view name = line.substr(0, colon);
+			std::string_view value = line.substr(colon + 1);
+			while (!value.empty() && value.front() == ' ')
+			{
+				value.remove_prefix(1);
+			}
+
+			// Connection specific fields have no place
+			// in HTTP/2.
+			if (name == "connection" || name == "keep-alive" ||
+				name == "transfer-encoding" || name == "upgrade")
+			{
+				continue;
+			}
+
+			m_encoder.encode(name, value, is_repeated_field(name), block);
+		}
+
+		std::size_t position = 0;
+		bool first = true;
+
+		do
+		{
+			std::size_t length = std::min(block.size() - position, m_peer_max_frame_size);
+			bool last = position + length == block.size();
+
+			std::uint8_t flags = last ? FLAG_END_HEADERS : 0;
+			if (first && end_stream)
+			{
+				flags |= FLAG_END_STREAM;
+			}
+
+			append_frame_header(m_pending, length,
+								first ? FrameType::headers : FrameType::continuation,
+								flags, stream.id);
+			m_pending.append(block, position, length);
+
+			position += length;
+			first = false;
+		} while (position < block.size());
+	}
+
+	// Fields whose values tend to repeat between responses,
+	// and are worth a place in the dynamic table.
+	static bool is_repeated_field(std::string_view name)
+	{
+		return name == "server" ||
+			   name == "content-type" ||
+			   name == "content-encoding" ||
+			   name == "accept-ranges" ||
+			   name == "vary" ||
+			   name == "cache-control";
+	}
+
+	// The stream has sent its last frame.
+	void complete(Stream &stream)
+	{
+		m_completed.push_back(Http2Completion{stream.request.method,
+											  stream.request.path,
+											  stream.response.status,
+											  stream.response.content_length,
+											  stream.start,
+											  stream.response_start});
+		retire(stream);
+	}
+
+	// The client has reset the stream, or we have. A stream
+	// being answered is kept until the answer arrives, as
+	// its request is still in use.
+	void close_stream(Stream &stream)
+	{
+		stream.reset = true;
+
+		if (stream.handed_out && !stream.answered)
+		{
+			return;
+		}
+
+		if (stream.queued)
+		{
+			m_ready.erase(std::find(m_ready.begin(), m_ready.end(), &stream));
+			stream.queued = false;
+		}
+
+		// A request not handed out yet never will be.
+		auto request = std::find(m_requests.begin(), m_requests.end(), &stream);
+		if (request != m_requests.end())
+		{
+			m_requests.erase(request);
+		}
+
+		retire(stream);
+	}
+
+	// Removes the stream, keeping it alive until the next
+	// prepare_output(), as the write in flight may refer
+	// to its body.
+	void retire(Stream &stream)
+	{
+		auto it = m_streams.find(stream.id);
+		m_retired.push_back(std::move(it->second));
+		m_streams.erase(it);
+	}
+
+	Stream *find_stream(std::uint32_t stream_id)
+	{
+		auto it = m_streams.find(stream_id);
+		return it == m_streams.end() ? nullptr : it->second.get();
+	}
+
+	void queue_rst_stream(std::uint32_t stream_id, Error error)
+	{
+		append_frame_header(m_pending, 4, FrameType::rst_stream, 0, stream_id);
+		append_u32(m_pending, static_cast<std::uint32_t>(error));
+	}
+
+	void queue_window_update(std::uint32_t stream_id, std::size_t increment)
+	{
+		append_frame_header(m_pending, 4, FrameType::window_update, 0, stream_id);
+		append_u32(m_pending, static_cast<std::uint32_t>(increment));
+	}
+
+	void queue_goaway(Error error)
+	{
+		append_frame_header(m_pending, 8, FrameType::goaway, 0, 0);
+		append_u32(m_pending, m_last_stream_id);
+		append_u32(m_pending, static_cast<std::uint32_t>(error));
+		m_goaway_sent = true;
+	}
+
+	// A connection error: the client is told why with a
+	// GOAWAY, and the connection is closed once it is sent.
+	void fail(Error error)
+	{
+		if (m_failed)
+		{
+			return;
+		}
+
+		queue_goaway(error);
+		m_failed = true;
+
+		m_requests.clear();
+		m_ready.clear();
+
+		for (auto it = m_streams.begin(); it != m_streams.end();)
+		{
+			Stream &stream = *it->second;
+			++it;
+
+			stream.reset = true;
+			if (!stream.handed_out || stream.answered)
+			{
+				retire(stream);
+			}
+		}
+	}
+
+	static void append_frame_header(std::string &out, std::size_t length, FrameType type,
+									 std::uint8_t flags, std::uint32_t stream_id)
+	{
+		out.push_back(static_cast<char>((length >> 16) & 0xff));
+		out.push_back(static_cast<char>((length >> 8) & 0xff));
+		out.push_back(static_cast<char>(length & 0xff));
+		out.push_back(static_cast<char>(type));
+		out.push_back(static_cast<char>(flags));
+		append_u32(out, stream_id);
+	}
+
+	static void append_setting(std::string &out, Setting setting, std::uint32_t value)
+	{
+		out.push_back(static_cast<char>(static_cast<std::uint16_t>(setting) >> 8));
+		out.push_back(static_cast<char>(static_cast<std::uint16_t>(setting) & 0xff));
+		append_u32(out, value);
+	}
+
+	static void append_u32(std::string &out, std::uint32_t value)
+	{
+		out.push_back(static_cast<char>(value >> 24));
+		out.push_back(static_cast<char>((value >> 16) & 0xff));
+		out.push_back(static_cast<char>((value >> 8) & 0xff));
+		out.push_back(static_cast<char>(value & 0xff));
+	}
+
+	static std::uint32_t read_u32(const unsigned char *data)
+	{
+		return (std::uint32_t(data[0]) << 24) |
+			   (std::uint32_t(data[1]) << 16) |
+			   (std::uint32_t(data[2]) << 8) |
+			   data[3];
+	}
+
+	// Decodes unpadded base64url, as HTTP2-Settings uses.
+	static bool decode_base64url(std::string_view in, std::string &out)
+	{
+		unsigned int bits = 0;
+		unsigned int bit_count = 0;
+
+		out.clear();
+
+		for (char c : in)
+		{
+			unsigned int value;
+
+			if (c >= 'A' && c <= 'Z')
+				value = c - 'A';
+			else if (c >= 'a' && c <= 'z')
+				value = c - 'a' + 26;
+			else if (c >= '0' && c <= '9')
+				value = c - '0' + 52;
+			else if (c == '-')
+				value = 62;
+			else if (c == '_')
+				value = 63;
+			else if (c == '=')
+				break;
+			else
+				return false;
+
+			bits = (bits << 6) | value;
+			bit_count += 6;
+
+			if (bit_count >= 8)
+			{
+				bit_count -= 8;
+				out.push_back(static_cast<char>((bits >> bit_count) & 0xff));
+			}
+		}
+
+		return true;
+	}
+
+private:
+	const ServerConfig &m_config;
+
+	// Part of the client preface yet to be received.
+	std::string m_preface;
+	bool m_settings_received;
+
+	// Received bytes not yet processed.
+	std::vector<char> m_input;
+	std::size_t m_input_size;
+
+	HpackDecoder m_decoder;
+	HpackEncoder m_encoder;
+	std::vector<HpackField> m_fields;
+
+	// Header block being received, possibly spread over
+	// CONTINUATION frames.
+	std::string m_header_block;
+	std::uint32_t m_header_stream;
+	std::string m_header_block_out;
+
+	std::uint32_t m_last_stream_id;
+	std::unordered_map<std::uint32_t, std::unique_ptr<Stream>> m_streams;
+
+	// Streams waiting for a response, and answered ones
+	// taking turns to send their bodies.
+	std::deque<Stream *> m_requests;
+	std::deque<Stream *> m_ready;
+
+	// Streams waiting for their file to be read into the
+	// page cache, and the one it is being read for.
+	std::deque<std::uint32_t> m_blocked;
+	std::uint32_t m_warming;
+
+	// The peer's settings, and what the connection window
+	// lets us send.
+	std::int64_t m_peer_initial_window;
+	std::size_t m_peer_max_frame_size;
+	std::int64_t m_send_window;
+
+	// Frames queued for the next write, and the output of
+	// the write in flight along with the streams it may
+	// refer to.
+	std::string m_pending;
+	std::string m_sending;
+	std::vector<Segment> m_segments;
+	std::vector<std::unique_ptr<Stream>> m_retired;
+
+	// Streams completed by the frames queued, by those of
+	// the write in flight, and by the last write done.
+	std::vector<Http2Completion> m_completed;
+	std::vector<Http2Completion> m_completions_sent;
+	std::vector<Http2Completion> m_written;
+
+	bool m_goaway_sent;
+	bool m_peer_goaway;
+	bool m_failed;
+};
+
+// Log-linear histogram of latencies in microseconds, in the
+// style of HdrHistogram: every power of two is split into
+// SUB_BUCKETS linear buckets, so a value lands in a bucket
+// no wider than 1/SUB_BUCKETS of itself. It has a single
+// writer; readers may merge it at any time, and relaxed
+// atomics keep either side from ever waiting.
+class LatencyHistogram
+{
+public:
+	static const unsigned int SUB_BUCKET_BITS = 4;
+	static const unsigned int SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+
+	// Powers of two covered, up to 2^40 us (about 12 days).
+	static const unsigned int MAX_MAGNITUDE = 40;
+	static const std::size_t BUCKETS = SUB_BUCKETS * (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2);
+
+	void record(std::uint64_t us)
+	{
+		m_counts[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	// Adds this histogram's buckets, count and sum to
+	// the given ones.
+	void merge_into(std::vector<std::uint64_t> &counts,
+					std::uint64_t &count,
+					std::uint64_t &sum_us) const
+	{
+		counts.resize(BUCKETS);
+		for (std::size_t i = 0; i < BUCKETS; i++)
+		{
+			counts[i] += m_counts[i].load(std::memory_order_relaxed);
+		}
+
+		count += m_count.load(std::memory_order_relaxed);
+		sum_us += m_sum_us.load(std::memory_order_relaxed);
+	}
+
+	static std::size_t bucket_index(std::uint64_t us)
+	{
+		if (us < SUB_BUCKETS)
+		{
+			return static_cast<std::size_t>(us);
+		}
+
+		unsigned int magnitude = 63 - static_cast<unsigned int>(__builtin_clzll(us));
+		if (magnitude > MAX_MAGNITUDE)
+		{
+			return BUCKETS - 1;
+		}
+
+		unsigned int shift = magnitude - SUB_BUCKET_BITS;
+		std::size_t sub_bucket = static_cast<std::size_t>(us >> shift) - SUB_BUCKETS;
+
+		return SUB_BUCKETS * (shift + 1) + sub_bucket;
+	}
+
+	// Smallest value above everything in the bucket.
+	static std::uint64_t bucket_upper_bound(std::size_t index)
+	{
+		if (index < SUB_BUCKETS)
+		{
+			return index + 1;
+		}
+
+		unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKETS) - 1;
+		std::uint64_t sub_bucket = index % SUB_BUCKETS;
+
+		return (SUB_BUCKETS + sub_bucket + 1) << shift;
+	}
+
+private:
+	std::array<std::atomic<std::uint64_t>, BUCKETS> m_counts{};
+	std::atomic<std::uint64_t> m_count{0};
+	std::atomic<std::uint64_t> m_sum_us{0};
+};
+
+// Process wide request metrics. Every thread records into
+// its own set of histograms and counters, registered on
+// first use and kept after the thread exits; a scrape sums
+// them all up while the threads carry on recording.
+class Metrics
+{
+public:
+	// Stages of serving a request.
+	enum class Stage
+	{
+		request_line, // From accept, or the first byte of a
+					  // later request, to the request line.
+		headers,	  // From the request line to the end of the headers.
+		process,	  // Finding the resource: cache, file system.
+		write,		  // Sending the response.
+		count
+	};
+
+	static void record(Stage stage, std::chrono::steady_clock::duration elapsed)
+	{
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+		local().stages[static_cast<std::size_t>(stage)].record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+	}
+
+	static void count_response(unsigned int status_code, std::uint64_t bytes)
+	{
+		ThreadMetrics &metrics = local();
+
+		if (status_code >= MIN_STATUS && status_code <= MAX_STATUS)
+		{
+			metrics.responses[status_code - MIN_STATUS].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		metrics.bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	// A connection may be opened on one thread and closed
+	// on another; only the sum over all threads counts.
+	static void connection_opened()
+	{
+		local().connections.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static void connection_closed()
+	{
+		local().connections.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Jobs entering and leaving the file I/O queue, and
+	// those turned away because it was full.
+	static void file_io_queued(std::int64_t jobs)
+	{
+		registry().file_io_queue_depth.fetch_add(jobs, std::memory_order_relaxed);
+	}
+
+	static void file_io_rejected()
+	{
+		registry().file_io_rejected.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Appends everything recorded so far in the Prometheus
+	// text exposition format.
+	static void render(std::string &out)
+	{
+		static const std::size_t STAGES = static_cast<std::size_t>(Stage::count);
+		static const char *const STAGE_NAMES[STAGES] = {"request_line", "headers", "process", "write"};
+		static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+		std::vector<std::uint64_t> counts[STAGES];
+		std::uint64_t count[STAGES] = {};
+		std::uint64_t sum_us[STAGES] = {};
+		std::array<std::uint64_t, MAX_STATUS - MIN_STATUS + 1> responses{};
+		std::uint64_t bytes_out = 0;
+		std::int64_t active_connections = 0;
+
+		{
+			Registry &registry = Metrics::registry();
+			std::lock_guard<std::mutex> lock(registry.guard);
+
+			for (const auto &metrics : registry.threads)
+			{
+				for (std::size_t i = 0; i < STAGES; i++)
+				{
+					metrics->stages[i].merge_into(counts[i], count[i], sum_us[i]);
+				}
+
+				for (std::size_t i = 0; i < responses.size(); i++)
+				{
+					responses[i] += metrics->responses[i].load(std::memory_order_relaxed);
+				}
+
+				bytes_out += metrics->bytes_out.load(std::memory_order_relaxed);
+				active_connections += metrics->connections.load(std::memory_order_relaxed);
+			}
+		}
+
+		out += "# HELP http_stage_duration_seconds Time spent in each stage of serving a request.\n"
+			   "# TYPE http_stage_duration_seconds summary\n";
+
+		for (std::size_t i = 0; i < STAGES; i++)
+		{
+			std::string labels = std::string("stage=\"") + STAGE_NAMES[i] + "\"";
+
+			for (double quantile : QUANTILES)
+			{
+				out += "http_stage_duration_seconds{" + labels +
+					   ",quantile=\"" + format_number(quantile) + "\"} " +
+					   format_number(value_at_quantile(counts[i], count[i], quantile) / 1e6) + "\n";
+			}
+
+			out += "http_stage_duration_seconds_sum{" + labels + "} " +
+				   format_number(sum_us[i] / 1e6) + "\n";
+			out += "http_stage_duration_seconds_count{" + labels + "} " +
+				   std::to_string(count[i]) + "\n";
+		}
+
+		out += "# HELP http_responses_total Responses sent, by status code.\n"
+			   "# TYPE http_responses_total counter\n";
+
+		for (std::size_t i = 0; i < responses.size(); i++)
+		{
+			if (responses[i] != 0)
+			{
+				out += "http_responses_total{code=\"" + std::to_string(i + MIN_STATUS) + "\"} " +
+					   std::to_string(responses[i]) + "\n";
+			}
+		}
+
+		out += "# HELP http_response_bytes_total Bytes of responses sent, headers included.\n"
+			   "# TYPE http_response_bytes_total counter\n"
+			   "http_response_bytes_total " +
+			   std::to_string(bytes_out) + "\n";
+
+		out += "# HELP http_active_connections Connections being served.\n"
+			   "# TYPE http_active_connections gauge\n"
+			   "http_active_connections " +
+			   std::to_string(std::max<std::int64_t>(active_connections, 0)) + "\n";
+
+		Registry &registry = Metrics::registry();
+
+		out += "# HELP http_file_io_queue_depth File lookups waiting for a file I/O thread.\n"
+			   "# TYPE http_file_io_queue_depth gauge\n"
+			   "http_file_io_queue_depth " +
+			   std::to_string(std::max<std::int64_t>(registry.file_io_queue_depth.load(std::memory_order_relaxed), 0)) + "\n";
+
+		out += "# HELP http_file_io_rejected_total File lookups turned away with the queue full.\n"
+			   "# TYPE http_file_io_rejected_total counter\n"
+			   "http_file_io_rejected_total " +
+			   std::to_string(registry.file_io_rejected.load(std::memory_order_relaxed)) + "\n";
+	}
+
+private:
+	static const unsigned int MIN_STATUS = 100;
+	static const unsigned int MAX_STATUS = 599;
+
+	struct ThreadMetrics
+	{
+		LatencyHistogram stages[static_cast<std::size_t>(Stage::count)];
+		std::array<std::atomic<std::uint64_t>, MAX_STATUS - MIN_STATUS + 1> responses{};
+		std::atomic<std::uint64_t> bytes_out{0};
+		std::atomic<std::int64_t> connections{0};
+	};
+
+	struct Registry
+	{
+		std::mutex guard;
+		std::vector<std::unique_ptr<ThreadMetrics>> threads;
+
+		// Shared by all threads, there being one queue.
+		std::atomic<std::int64_t> file_io_queue_depth{0};
+		std::atomic<std::uint64_t> file_io_rejected{0};
+	};
+
+	static Registry &registry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	static ThreadMetrics &local()
+	{
+		thread_local ThreadMetrics *metrics = nullptr;
+
+		if (metrics == nullptr)
+		{
+			Registry &registry = Metrics::registry();
+			std::lock_guard<std::mutex> lock(registry.guard);
+
+			registry.threads.emplace_back(new ThreadMetrics());
+			metrics = registry.threads.back().get();
+		}
+
+		return *metrics;
+	}
+
+	// Upper bound of the bucket holding the value at the
+	// given quantile, or zero if nothing was recorded.
+	static double value_at_quantile(const std::vector<std::uint64_t> &counts,
+									std::uint64_t count,
+									double quantile)
+	{
+		if (count == 0)
+		{
+			return 0;
+		}
+
+		std::uint64_t rank = static_cast<std::uint64_t>(std::ceil(quantile * count));
+		rank = std::max<std::uint64_t>(rank, 1);
+
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < counts.size(); i++)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+			{
+				return static_cast<double>(LatencyHistogram::bucket_upper_bound(i));
+			}
+		}
+
+		return static_cast<double>(LatencyHistogram::bucket_upper_bound(counts.size() - 1));
+	}
+
+	static std::string format_number(double value)
+	{
+		char buffer[32];
+		std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+		return buffer;
+	}
+};
+
+// Access and error log, formatted and written out by a
+// background thread. Workers only fill in fixed size binary
+// records in rings of their own, which the thread drains;
+// neither side ever waits for the other, and a record that
+// finds its ring full is dropped and counted instead.
+class Log
+{
+public:
+	// Starts the log thread. Lines are appended to the file
+	// at path, or written to the standard output if empty.
+	static void start(const std::string &path,
+					  bool access_log,
+					  std::size_t ring_records,
+					  std::chrono::milliseconds flush_interval)
+	{
+		State &state = Log::state();
+
+		state.fd = STDOUT_FILENO;
+		if (!path.empty())
+		{
+			int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+			if (fd < 0)
+			{
+				std::cout << "Could not open log file " << path
+						  << ". Error code = " << errno
+						  << ". Logging to standard output." << std::endl;
+			}
+			else
+			{
+				state.fd = fd;
+			}
+		}
+
+		state.access_log = access_log;
+		state.ring_records = ring_records;
+		state.flush_interval = flush_interval;
+		state.stopping = false;
+		state.running.store(true);
+		state.thread = std::thread(&Log::run);
+	}
+
+	// Writes out what is left and stops the log thread.
+	static void stop()
+	{
+		State &state = Log::state();
+
+		if (!state.running.load())
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(state.guard);
+			state.stopping = true;
+		}
+		state.wakeup.notify_one();
+		state.thread.join();
+
+		state.running.store(false);
+
+		if (state.fd != STDOUT_FILENO)
+		{
+			::close(state.fd);
+		}
+	}
+
+	// Records a response that has been sent in full.
+	static void access(const asio::ip::tcp::endpoint &peer,
+					   std::string_view method,
+					   std::string_view path,
+					   unsigned int status,
+					   std::uint64_t bytes,
+					   std::chrono::steady_clock::duration duration)
+	{
+		State &state = Log::state();
+
+		if (!state.access_log || !state.running.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		Record *record = local().claim();
+		if (record == nullptr)
+		{
+			return;
+		}
+
+		record->kind = Record::Kind::access;
+		record->time_ns = now_ns();
+		record->peer = peer;
+		record->has_peer = true;
+		record->method_length = copy_truncated(method, record->method, sizeof(record->method));
+		record->path_length = copy_truncated(path, record->path, sizeof(record->path));
+		record->path_truncated = path.size() > sizeof(record->path);
+		record->status = static_cast<std::uint16_t>(status);
+		record->bytes = bytes;
+		record->duration_us = static_cast<std::uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+		local().commit();
+	}
+
+	// Records a failure. The event must be a string literal;
+	// the error code is only turned into a message by the
+	// log thread.
+	static void error(const char *event,
+					  const boost::system::error_code &ec,
+					  const asio::ip::tcp::endpoint *peer = nullptr)
+	{
+		if (!state().running.load(std::memory_order_relaxed))
+		{
+			// Nobody to hand it to.
+			std::cout << "Error occured! Error code = "
+					  << ec.value()
+					  << ". Message: " << ec.message() << std::endl;
+			return;
+		}
+
+		Record *record = local().claim();
+		if (record == nullptr)
+		{
+			return;
+		}
+
+		record->kind = Record::Kind::error;
+		record->time_ns = now_ns();
+		record->has_peer = peer != nullptr;
+		if (peer != nullptr)
+		{
+			record->peer = *peer;
+		}
+		record->event = event;
+		record->category = &ec.category();
+		record->code = ec.value();
+
+		local().commit();
+	}
+
+private:
+	struct Record
+	{
+		enum class Kind : std::uint8_t
+		{
+			access,
+			error
+		};
+
+		Kind kind;
+		bool has_peer;
+		bool path_truncated;
+		std::uint8_t method_length;
+		std::uint16_t path_length;
+		std::uint16_t status;
+		std::int64_t time_ns; // Since the epoch.
+		asio::ip::tcp::endpoint peer;
+
+		// Access records.
+		std::uint64_t bytes;
+		std::uint64_t duration_us;
+		char method[16];
+		char path[192];
+
+		// Error records.
+		const char *event;
+		const boost::system::error_category *category;
+		int code;
+	};
+
+	// Single producer, single consumer ring of records.
+	class Ring
+	{
+	public:
+		explicit Ring(std::size_t capacity) : m_capacity(round_up_to_power_of_two(capacity)),
+											  m_records(new Record[m_capacity]),
+											  m_head(0),
+											  m_tail(0),
+											  m_dropped(0)
+		{
+		}
+
+		// The slot for the next record, or nullptr if the
+		// ring is full.
+		Record *claim()
+		{
+			std::uint64_t tail = m_tail.load(std::memory_order_relaxed);
+
+			if (tail - m_head.load(std::memory_order_acquire) == m_capacity)
+			{
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			return &m_records[tail & (m_capacity - 1)];
+		}
+
+		// Publishes the record claimed last.
+		void commit()
+		{
+			m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+						 std::memory_order_release);
+		}
+
+		// Hands every published record to the consumer,
+		// then frees their slots.
+		template <typename Consumer>
+		void drain(Consumer consume)
+		{
+			std::uint64_t head = m_head.load(std::memory_order_relaxed);
+			std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+
+			for (; head != tail; head++)
+			{
+				consume(m_records[head & (m_capacity - 1)]);
+			}
+
+			m_head.store(head, std::memory_order_release);
+		}
+
+		std::uint64_t take_dropped()
+		{
+			return m_dropped.exchange(0, std::memory_order_relaxed);
+		}
+
+	private:
+		static std::size_t round_up_to_power_of_two(std::size_t n)
+		{
+			std::size_t capacity = 1;
+			while (capacity < n)
+			{
+				capacity <<= 1;
+			}
+			return capacity;
+		}
+
+		const std::size_t m_capacity;
+		std::unique_ptr<Record[]> m_records;
+
+		// On separate cache lines, as each is written by
+		// a different thread.
+		alignas(64) std::atomic<std::uint64_t> m_head;
+		alignas(64) std::atomic<std::uint64_t> m_tail;
+		std::atomic<std::uint64_t> m_dropped;
+	};
+
+	struct State
+	{
+		std::atomic<bool> running{false};
+		bool access_log = false;
+		std::size_t ring_records = 0;
+		std::chrono::milliseconds flush_interval{0};
+		int fd = STDOUT_FILENO;
+		std::thread thread;
+
+		// Only wakes the log thread up to stop it.
+		std::mutex guard;
+		std::condition_variable wakeup;
+		bool stopping = false;
+
+		// Every thread's ring, kept after the thread exits
+		// until the process does.
+		std::mutex rings_guard;
+		std::vector<std::unique_ptr<Ring>> rings;
+
+		// In case the server never got to stop the log,
+		// say because starting it failed half way.
+		~State()
+		{
+			if (thread.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> lock(guard);
+					stopping = true;
+				}
+				wakeup.notify_one();
+				thread.join();
+			}
+		}
+	};
+
+	static State &state()
+	{
+		static State state;
+		return state;
+	}
+
+	static Ring &local()
+	{
+		thread_local Ring *ring = nullptr;
+
+		if (ring == nullptr)
+		{
+			State &state = Log::state();
+			std::lock_guard<std::mutex> lock(state.rings_guard);
+
+			state.rings.emplace_back(new Ring(state.ring_records));
+			ring = state.rings.back().get();
+		}
+
+		return *ring;
+	}
+
+	static std::int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+			.count();
+	}
+
+	static std::uint16_t copy_truncated(std::string_view from, char *to, std::size_t capacity)
+	{
+		std::size_t length = std::min(from.size(), capacity);
+		std::memcpy(to, from.data(), length);
+		return static_cast<std::uint16_t>(length);
+	}
+
+	// Body of the log thread.
+	static void run()
+	{
+		State &state = Log::state();
+		std::string out;
+		std::vector<Ring *> rings;
+		bool stopping = false;
+
+		while (!stopping)
+		{
+			{
+				std::unique_lock<std::mutex> lock(state.guard);
+				state.wakeup.wait_for(lock, state.flush_interval,
+									  [&state]()
+									  { return state.stopping; });
+				stopping = state.stopping;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(state.rings_guard);
+				rings.clear();
+				for (const auto &ring : state.rings)
+				{
+					rings.push_back(ring.get());
+				}
+			}
+
+			std::uint64_t dropped = 0;
+			for (Ring *ring : rings)
+			{
+				ring->drain([&out](const Record &record)
+							{ format(record, out); });
+				dropped += ring->take_dropped();
+			}
+
+			if (dropped > 0)
+			{
+				append_time(now_ns(), out);
+				out += ",\"level\":\"warning\",\"event\":\"log_records_dropped\",\"count\":" +
+					   std::to_string(dropped) + "}\n";
+			}
+
+			write_all(state.fd, out);
+			out.clear();
+		}
+	}
+
+	// One JSON object per line.
+	static void format(const Record &record, std::string &out)
+	{
+		append_time(record.time_ns, out);
+
+		if (record.kind == Record::Kind::access)
+		{
+			out += ",\"level\":\"access\"";
+		}
+		else
+		{
+			out += ",\"level\":\"error\",\"event\":\"";
+			out += record.event;
+			out += "\"";
+		}
+
+		if (record.has_peer)
+		{
+			out += ",\"peer\":\"";
+			out += record.peer.address().to_string();
+			out += ":" + std::to_string(record.peer.port()) + "\"";
+		}
+
+		if (record.kind == Record::Kind::access)
+		{
+			out += ",\"method\":\"";
+			append_escaped(std::string_view(record.method, record.method_length), out);
+			out += "\",\"path\":\"";
+			append_escaped(std::string_view(record.path, record.path_length), out);
+			out += record.path_truncated ? "...\"" : "\"";
+			out += ",\"status\":" + std::to_string(record.status) +
+				   ",\"bytes\":" + std::to_string(record.bytes) +
+				   ",\"duration_us\":" + std::to_string(record.duration_us) + "}\n";
+		}
+		else
+		{
+			out += ",\"code\":" + std::to_string(record.code) + ",\"message\":\"";
+			append_escaped(record.category->message(record.code), out);
+			out += "\"}\n";
+		}
+	}
+
+	static void append_time(std::int64_t time_ns, std::string &out)
+	{
+		std::time_t seconds = static_cast<std::time_t>(time_ns / 1000000000);
+		std::tm tm;
+		::gmtime_r(&seconds, &tm);
+
+		char buffer[96];
+		std::snprintf(buffer, sizeof(buffer), "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\"",
+					  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+					  tm.tm_hour, tm.tm_min, tm.tm_sec,
+					  static_cast<int>(time_ns % 1000000000 / 1000));
+		out += buffer;
+	}
+
+	// Request targets come straight from the client.
+	static void append_escaped(std::string_view str, std::string &out)
+	{
+		for (char c : str)
+		{
+			if (c == '"' || c == '\\')
+			{
+				out += '\\';
+				out += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f)
+			{
+				char buffer[8];
+				std::snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned char>(c));
+				out += buffer;
+			}
+			else
+			{
+				out += c;
+			}
+		}
+	}
+
+	static void write_all(int fd, const std::string &out)
+	{
+		std::size_t written = 0;
+
+		while (written < out.size())
+		{
+			ssize_t n = ::write(fd, out.data() + written, out.size() - written);
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n <= 0)
+			{
+				// Nowhere left to report this.
+				return;
+			}
+			written += static_cast<std::size_t>(n);
+		}
+	}
+};
+
+// Hashed timing wheel running the deadlines of all the
+// connections of one event loop off a single steady_timer.
+// Deadlines are kept in per slot intrusive lists, so arming,
+// re-arming and cancelling one is O(1) however many there
+// are; on every tick only the slot of that tick is looked at.
+class TimingWheel
+{
+public:
+	// A deadline, embedded in whoever arms it. Its callback
+	// is invoked on the wheel's event loop when it expires,
+	// with the wheel locked, so it must not call back into
+	// the wheel.
+	class Timer
+	{
+	public:
+		explicit Timer(std::function<void()> on_expiry) : m_on_expiry(std::move(on_expiry)) {}
+
+		Timer(const Timer &) = delete;
+		Timer &operator=(const Timer &) = delete;
+
+	private:
+		friend class TimingWheel;
+
+		enum class State
+		{
+			idle,
+			armed,
+			expired
+		};
+
+		State m_state = State::idle;
+		std::uint64_t m_deadline = 0; // In ticks.
+		Timer *m_prev = nullptr;
+		Timer *m_next = nullptr;
+		std::function<void()> m_on_expiry;
+	};
+
+	TimingWheel(asio::io_service &ios,
+				std::chrono::milliseconds tick,
+				std::size_t slots) : m_timer(ios),
+									 m_tick(std::max(tick, std::chrono::milliseconds(1))),
+									 m_slots(std::max<std::size_t>(slots, 1), nullptr),
+									 m_now(0),
+									 m_stopped(false)
+	{
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		m_timer.expires_after(m_tick);
+		wait_for_tick();
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		m_stopped = true;
+		m_timer.cancel();
+	}
+
+	// Arms the timer, or moves its deadline if already
+	// armed. Returns false, leaving it alone, if it has
+	// expired and not been reset since.
+	bool arm(Timer &timer, std::chrono::milliseconds timeout)
+	{
+		std::uint64_t ticks = (timeout.count() + m_tick.count() - 1) / m_tick.count();
+
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		if (timer.m_state == Timer::State::expired)
+		{
+			return false;
+		}
+
+		if (timer.m_state == Timer::State::armed)
+		{
+			unlink(timer);
+		}
+
+		timer.m_deadline = m_now + std::max<std::uint64_t>(ticks, 1);
+		timer.m_state = Timer::State::armed;
+		link(timer);
+
+		return true;
+	}
+
+	// Disarms the timer. Returns false if it has already
+	// expired, in which case its callback has been invoked.
+	bool cancel(Timer &timer)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		if (timer.m_state == Timer::State::expired)
+		{
+			return false;
+		}
+
+		if (timer.m_state == Timer::State::armed)
+		{
+			unlink(timer);
+			timer.m_state = Timer::State::idle;
+		}
+
+		return true;
+	}
+
+	// Expires every armed timer at once.
+	void expire_all()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		for (Timer *&head : m_slots)
+		{
+			while (head != nullptr)
+			{
+				Timer *timer = head;
+				unlink(*timer);
+				timer->m_state = Timer::State::expired;
+				timer->m_on_expiry();
+			}
+		}
+	}
+
+	// Makes an expired timer usable again.
+	void reset(Timer &timer)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		if (timer.m_state == Timer::State::armed)
+		{
+			unlink(timer);
+		}
+
+		timer.m_state = Timer::State::idle;
+	}
+
+private:
+	void wait_for_tick()
+	{
+		m_timer.async_wait([this](const boost::system::error_code &ec)
+						   { on_tick(ec); });
+	}
+
+	void on_tick(const boost::system::error_code &ec)
+	{
+		if (ec == asio::error::operation_aborted)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		if (m_stopped)
+		{
+			return;
+		}
+
+		m_now++;
+
+		// The slot also holds deadlines one or more turns
+		// of the wheel away; those stay where they are.
+		Timer *timer = m_slots[m_now % m_slots.size()];
+		while (timer != nullptr)
+		{
+			Timer *next = timer->m_next;
+
+			if (timer->m_deadline <= m_now)
+			{
+				unlink(*timer);
+				timer->m_state = Timer::State::expired;
+				timer->m_on_expiry();
+			}
+
+			timer = next;
+		}
+
+		// Relative to the previous expiry, so that ticks
+		// do not drift however late this handler runs.
+		m_timer.expires_at(m_timer.expiry() + m_tick);
+		wait_for_tick();
+	}
+
+	void link(Timer &timer)
+	{
+		Timer *&head = m_slots[timer.m_deadline % m_slots.size()];
+
+		timer.m_prev = nullptr;
+		timer.m_next = head;
+		if (head != nullptr)
+		{
+			head->m_prev = &timer;
+		}
+		head = &timer;
+	}
+
+	void unlink(Timer &timer)
+	{
+		if (timer.m_prev != nullptr)
+		{
+			timer.m_prev->m_next = timer.m_next;
+		}
+		else
+		{
+			m_slots[timer.m_deadline % m_slots.size()] = timer.m_next;
+		}
+
+		if (timer.m_next != nullptr)
+		{
+			timer.m_next->m_prev = timer.m_prev;
+		}
+
+		timer.m_prev = timer.m_next = nullptr;
+	}
+
+	std::mutex m_guard;
+	asio::steady_timer m_timer;
+	const std::chrono::milliseconds m_tick;
+	std::vector<Timer *> m_slots;
+	std::uint64_t m_now; // Ticks since start().
+	bool m_stopped;
+};
+
+// Caps the number of connections being served at once,
+// across all the acceptors of the server. An acceptor that
+// finds no free slot waits to be called back when one is
+// freed instead of polling.
+class ConnectionLimiter
+{
+public:
+	explicit ConnectionLimiter(std::size_t max_connections) : m_max(max_connections),
+															  m_active(0),
+															  m_connections(0),
+															  m_draining(false),
+															  m_drained(0)
+	{
+	}
+
+	ConnectionLimiter(const ConnectionLimiter &) = delete;
+	ConnectionLimiter &operator=(const ConnectionLimiter &) = delete;
+
+	// Takes a slot for a new connection, unless all are
+	// taken.
+	bool try_acquire()
+	{
+		std::size_t active = m_active.load(std::memory_order_relaxed);
+
+		do
+		{
+			if (active >= m_max)
+			{
+				return false;
+			}
+		} while (!m_active.compare_exchange_weak(active, active + 1,
+												 std::memory_order_relaxed));
+
+		return true;
+	}
+
+	// Frees the slot of a finished connection, and hands
+	// it to a waiter if there is one.
+	void release()
+	{
+		m_active.fetch_sub(1, std::memory_order_relaxed);
+
+		std::function<void()> waiter;
+		{
+			std::lock_guard<std::mutex> lock(m_guard);
+
+			if (m_waiters.empty())
+			{
+				return;
+			}
+
+			waiter = std::move(m_waiters.front());
+			m_waiters.pop_front();
+		}
+
+		waiter();
+	}
+
+	// Connections being served, as opposed to the slots,
+	// which also cover accepts in progress.
+	void connection_opened()
+	{
+		m_connections.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void connection_closed()
+	{
+		m_connections.fetch_sub(1, std::memory_order_acq_rel);
+
+		if (m_draining.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(m_guard);
+			m_drained++;
+			m_all_closed.notify_all();
+		}
+	}
+
+	// From now on connections are to be closed after
+	// their current response.
+	void start_draining()
+	{
+		m_draining.store(true);
+	}
+
+	bool draining() const
+	{
+		return m_draining.load(std::memory_order_relaxed);
+	}
+
+	// Waits until every connection has been closed or the
+	// deadline has passed. Returns the number still open.
+	std::size_t wait_for_connections(std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock(m_guard);
+
+		m_all_closed.wait_until(lock, deadline, [this]()
+								{ return m_connections.load() == 0; });
+
+		return m_connections.load();
+	}
+
+	// Connections closed since start_draining().
+	std::size_t drained()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+		return m_drained;
+	}
+
+	// Calls back once a slot may be free, which might be
+	// right away if one was freed since try_acquire() failed.
+	void wait(std::function<void()> on_available)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_guard);
+
+			if (m_active.load(std::memory_order_relaxed) >= m_max)
+			{
+				m_waiters.push_back(std::move(on_available));
+				return;
+			}
+		}
+
+		on_available();
+	}
+
+private:
+	const std::size_t m_max;
+	std::atomic<std::size_t> m_active;
+	std::atomic<std::size_t> m_connections;
+	std::atomic<bool> m_draining;
+
+	std::mutex m_guard;
+	std::deque<std::function<void()>> m_waiters;
+	std::condition_variable m_all_closed;
+	std::size_t m_drained;
+};
+
+// Threads for the blocking file system work of serving
+// files, so that a file missing from the page cache holds
+// up the one request that needs it rather than every
+// connection of an event loop. Jobs wait in a bounded
+// queue and run in the order they came. A job is told
+// whether it has been cancelled, as the queued ones are
+// when the pool stops; it is to post its completion all
+// the same, without doing the work.
+class FileIoPool
+{
+public:
+	using Job = std::function<void(bool cancelled)>;
+
+	FileIoPool(unsigned int threads, std::size_t queue_limit) : m_queue_limit(queue_limit),
+																m_stopping(false)
+	{
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			m_threads.emplace_back([this]()
+								   { run(); });
+		}
+	}
+
+	~FileIoPool()
+	{
+		stop();
+	}
+
+	// Queues a job for one of the threads. Returns false
+	// if the queue is full, or the pool stopped.
+	bool submit(Job job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_guard);
+
+			if (m_stopping || m_jobs.size() >= m_queue_limit)
+			{
+				Metrics::file_io_rejected();
+				return false;
+			}
+
+			m_jobs.push_back(std::move(job));
+		}
+
+		Metrics::file_io_queued(1);
+		m_wakeup.notify_one();
+		return true;
+	}
+
+	// Takes no more jobs, waits for the running ones and
+	// runs the queued ones cancelled. The event loops are
+	// to be still running for the completions they post.
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_guard);
+			m_stopping = true;
+		}
+
+		m_wakeup.notify_all();
+
+		for (auto &th : m_threads)
+		{
+			if (th.joinable())
+			{
+				th.join();
+			}
+		}
+	}
+
+private:
+	void run()
+	{
+		for (;;)
+		{
+			Job job;
+			bool cancelled;
+			{
+				std::unique_lock<std::mutex> lock(m_guard);
+				m_wakeup.wait(lock, [this]()
+							  { return m_stopping || !m_jobs.empty(); });
+
+				if (m_jobs.empty())
+				{
+					return;
+				}
+
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+				cancelled = m_stopping;
+			}
+
+			Metrics::file_io_queued(-1);
+			job(cancelled);
+		}
+	}
+
+	const std::size_t m_queue_limit;
+	std::mutex m_guard;
+	std::condition_variable m_wakeup;
+	std::deque<Job> m_jobs;
+	bool m_stopping;
+	std::vector<std::thread> m_threads;
+};
+
+// A native io_uring instance driven by an Asio event loop.
+// Operations started by the handlers of one turn of the loop
+// are queued on the submission ring and handed to the kernel
+// by a single io_uring_enter(2) posted behind them. The kernel
+// signals completions through an eventfd the loop reads, and
+// every completion found then is dispatched in one go.
+//
+// A region of memory is registered with the ring and lent out
+// as stream buffers, so that reading a file into one does not
+// pin its pages on every call.
+class IoUring
+{
+public:
+	// An operation in flight; its address identifies it to
+	// the kernel. The callback is invoked on the loop, off
+	// any strand, with the result (a negated errno on
+	// failure) and the completion flags. Multishot operations
+	// invoke it once per result.
+	class Operation
+	{
+	public:
+		explicit Operation(std::function<void(int, unsigned int)> on_completion)
+			: m_on_completion(std::move(on_completion))
+		{
+		}
+
+	private:
+		friend class IoUring;
+
+		std::function<void(int, unsigned int)> m_on_completion;
+	};
+
+	// Throws if the kernel does not provide io_uring.
+	IoUring(asio::io_service &ios,
+			unsigned int entries,
+			std::size_t buffer_count,
+			std::size_t buffer_size) : m_ios(ios),
+									   m_event_fd(ios),
+									   m_event_count(0),
+									   m_sq_tail(0),
+									   m_unsubmitted(0),
+									   m_submit_posted(false),
+									   m_buffer_size(buffer_size),
+									   m_buffers_registered(false)
+	{
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CLAMP;
+
+		m_ring_fd.reset(static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params)));
+		if (!m_ring_fd.is_open())
+		{
+			throw_errno("io_uring_setup");
+		}
+
+		// Both came with Linux 5.5.
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(params.features & IORING_FEAT_NODROP))
+		{
+			throw system::system_error(asio::error::operation_not_supported,
+									   "io_uring");
+		}
+
+		// The operations used here were only all there with
+		// Linux 5.6, which is also when probing for them came.
+		// Multishot accepts need 5.19, but are not probed for;
+		// older kernels fail them with EINVAL, and the
+		// acceptor falls back to the reactor.
+		probe_operations({IORING_OP_RECV, IORING_OP_SENDMSG,
+						  IORING_OP_READ, IORING_OP_READ_FIXED,
+						  IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL});
+
+		std::size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		std::size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		m_rings.map(std::max(sq_size, cq_size), m_ring_fd.get(), IORING_OFF_SQ_RING);
+		m_sqe_memory.map(params.sq_entries * sizeof(io_uring_sqe), m_ring_fd.get(), IORING_OFF_SQES);
+
+		char *rings = static_cast<char *>(m_rings.address);
+
+		m_sq_head = reinterpret_cast<unsigned *>(rings + params.sq_off.head);
+		m_sq_tail_shared = reinterpret_cast<unsigned *>(rings + params.sq_off.tail);
+		m_sq_flags = reinterpret_cast<unsigned *>(rings + params.sq_off.flags);
+		m_sq_mask = *reinterpret_cast<unsigned *>(rings + params.sq_off.ring_mask);
+		m_sq_entries = params.sq_entries;
+		m_sqes = static_cast<io_uring_sqe *>(m_sqe_memory.address);
+
+		m_cq_head = reinterpret_cast<unsigned *>(rings + params.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned *>(rings + params.cq_off.tail);
+		m_cq_mask = *reinterpret_cast<unsigned *>(rings + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe *>(rings + params.cq_off.cqes);
+
+		// Entries are always submitted in the order they
+		// were queued, so the indirection array is fixed.
+		unsigned *sq_array = reinterpret_cast<unsigned *>(rings + params.sq_off.array);
+		for (unsigned i = 0; i < m_sq_entries; i++)
+		{
+			sq_array[i] = i;
+		}
+
+		m_sq_tail = *m_sq_tail_shared;
+
+		int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (event_fd < 0)
+		{
+			throw_errno("eventfd");
+		}
+
+		m_event_fd.assign(event_fd);
+
+		if (::syscall(__NR_io_uring_register, m_ring_fd.get(),
+					  IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+		{
+			throw_errno("io_uring_register");
+		}
+
+		if (buffer_count > 0 && m_buffer_size > 0)
+		{
+			register_buffers(buffer_count);
+		}
+	}
+
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	// Starts dispatching completions.
+	void start()
+	{
+		wait_for_completions();
+	}
+
+	void recv(int fd, void *data, std::size_t size, Operation &op)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		io_uring_sqe *sqe = next_sqe(&op);
+		if (sqe == nullptr)
+		{
+			return;
+		}
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<std::uintptr_t>(data);
+		sqe->len = static_cast<unsigned>(size);
+		sqe->user_data = reinterpret_cast<std::uintptr_t>(&op);
+		queue();
+	}
+
+	// The message must stay put until the completion.
+	void sendmsg(int fd, const msghdr *message, Operation &op)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		io_uring_sqe *sqe = next_sqe(&op);
+		if (sqe == nullptr)
+		{
+			return;
+		}
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<std::uintptr_t>(message);
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = reinterpret_cast<std::uintptr_t>(&op);
+		queue();
+	}
+
+	// Reads from a file at the given offset, from the
+	// registered buffers if data lies within them.
+	void read(int fd, void *data, std::size_t size, off_t offset, Operation &op)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		io_uring_sqe *sqe = next_sqe(&op);
+		if (sqe == nullptr)
+		{
+			return;
+		}
+
+		char *begin = static_cast<char *>(data);
+		char *buffers = static_cast<char *>(m_buffer_memory.address);
+		bool registered = m_buffers_registered &&
+						  begin >= buffers &&
+						  begin + size <= buffers + m_buffer_memory.size;
+
+		sqe->opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<std::uintptr_t>(data);
+		sqe->len = static_cast<unsigned>(size);
+		sqe->off = static_cast<std::uint64_t>(offset);
+		sqe->buf_index = 0;
+		sqe->user_data = reinterpret_cast<std::uintptr_t>(&op);
+		queue();
+	}
+
+	// Accepts connections until cancelled or until it
+	// fails, one completion each; completions flagged with
+	// IORING_CQE_F_MORE are followed by more.
+	void accept_multishot(int fd, Operation &op)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		io_uring_sqe *sqe = next_sqe(&op);
+		if (sqe == nullptr)
+		{
+			return;
+		}
+
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = reinterpret_cast<std::uintptr_t>(&op);
+		queue();
+	}
+
+	// Asks the kernel to cancel the operation, which then
+	// completes with -ECANCELED unless it completes first.
+	// Submitted at once, so that the operation is known to
+	// the kernel by the time its descriptor is closed.
+	void cancel(Operation &op)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		io_uring_sqe *sqe = next_sqe(nullptr);
+		if (sqe == nullptr)
+		{
+			return;
+		}
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = reinterpret_cast<std::uintptr_t>(&op);
+		sqe->user_data = 0;
+		queue();
+
+		enter();
+	}
+
+	// Lends out a registered buffer of buffer_size() bytes,
+	// or returns nullptr if all are in use.
+	char *acquire_buffer()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		if (m_free_buffers.empty())
+		{
+			return nullptr;
+		}
+
+		char *buffer = m_free_buffers.back();
+		m_free_buffers.pop_back();
+
+		return buffer;
+	}
+
+	void release_buffer(char *buffer)
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		m_free_buffers.push_back(buffer);
+	}
+
+	std::size_t buffer_size() const
+	{
+		return m_buffer_size;
+	}
+
+private:
+	// A shared memory mapping, unmapped on destruction.
+	struct Mapping
+	{
+		~Mapping()
+		{
+			unmap();
+		}
+
+		void map(std::size_t length, int fd, off_t offset)
+		{
+			address = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+							 fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED | MAP_POPULATE,
+							 fd, offset);
+			if (address == MAP_FAILED)
+			{
+				throw_errno("mmap");
+			}
+
+			size = length;
+		}
+
+		void unmap()
+		{
+			if (address != MAP_FAILED)
+			{
+				::munmap(address, size);
+				address = MAP_FAILED;
+			}
+		}
+
+		void *address = MAP_FAILED;
+		std::size_t size = 0;
+	};
+
+	[[noreturn]] static void throw_errno(const char *what)
+	{
+		throw system::system_error(
+			boost::system::error_code(errno, boost::system::system_category()), what);
+	}
+
+	// Throws unless the kernel supports all of the given
+	// operations.
+	void probe_operations(std::initializer_list<unsigned int> opcodes)
+	{
+		const unsigned int OPS = 256;
+
+		std::vector<char> memory(sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op));
+		io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(memory.data());
+
+		if (::syscall(__NR_io_uring_register, m_ring_fd.get(),
+					  IORING_REGISTER_PROBE, probe, OPS) < 0)
+		{
+			throw_errno("io_uring_register");
+		}
+
+		for (unsigned int opcode : opcodes)
+		{
+			if (opcode >= probe->ops_len ||
+				!(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+			{
+				throw system::system_error(asio::error::operation_not_supported,
+										   "io_uring");
+			}
+		}
+	}
+
+	void register_buffers(std::size_t count)
+	{
+		m_buffer_memory.map(count * m_buffer_size, -1, 0);
+
+		iovec region;
+		region.iov_base = m_buffer_memory.address;
+		region.iov_len = m_buffer_memory.size;
+
+		if (::syscall(__NR_io_uring_register, m_ring_fd.get(),
+					  IORING_REGISTER_BUFFERS, &region, 1) < 0)
+		{
+			// Typically over the locked memory limit. Not
+			// fatal, the streams use buffers of their own.
+			Log::error("io_uring_register",
+					   boost::system::error_code(errno, boost::system::system_category()));
+			m_buffer_memory.unmap();
+			return;
+		}
+
+		char *buffers = static_cast<char *>(m_buffer_memory.address);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			m_free_buffers.push_back(buffers + i * m_buffer_size);
+		}
+
+		m_buffers_registered = true;
+	}
+
+	// Returns the next free submission entry, cleared. If
+	// the ring is full and cannot be emptied, the operation
+	// fails with -EBUSY and nullptr is returned.
+	io_uring_sqe *next_sqe(Operation *op)
+	{
+		if (m_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+		{
+			enter();
+
+			if (m_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+			{
+				if (op != nullptr)
+				{
+					asio::post(m_ios, [op]()
+							   { op->m_on_completion(-EBUSY, 0); });
+				}
+
+				return nullptr;
+			}
+		}
+
+		io_uring_sqe *sqe = &m_sqes[m_sq_tail & m_sq_mask];
+		std::memset(sqe, 0, sizeof(*sqe));
+
+		return sqe;
+	}
+
+	// Publishes the entry filled in last, and makes sure a
+	// submission follows the handlers queued so far.
+	void queue()
+	{
+		m_sq_tail++;
+		__atomic_store_n(m_sq_tail_shared, m_sq_tail, __ATOMIC_RELEASE);
+		m_unsubmitted++;
+
+		if (!m_submit_posted)
+		{
+			m_submit_posted = true;
+			asio::post(m_ios, [this]()
+					   { submit(); });
+		}
+	}
+
+	void submit()
+	{
+		std::lock_guard<std::mutex> lock(m_guard);
+
+		m_submit_posted = false;
+		enter();
+	}
+
+	// Hands the queued entries to the kernel.
+	void enter()
+	{
+		while (m_unsubmitted > 0)
+		{
+			int submitted = static_cast<int>(::syscall(__NR_io_uring_enter, m_ring_fd.get(),
+													   m_unsubmitted, 0, 0, nullptr, 0));
+			if (submitted < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (submitted <= 0)
+			{
+				// Short of memory for now, or completions
+				// backing up; retry on the next turn.
+				if (submitted < 0 && errno != EAGAIN && errno != EBUSY)
+				{
+					Log::error("io_uring_enter",
+							   boost::system::error_code(errno, boost::system::system_category()));
+				}
+
+				if (!m_submit_posted)
+				{
+					m_submit_posted = true;
+					asio::post(m_ios, [this]()
+							   { submit(); });
+				}
+
+				return;
+			}
+
+			m_unsubmitted -= static_cast<unsigned>(submitted);
+		}
+	}
+
+	void wait_for_completions()
+	{
+		m_event_fd.async_read_some(asio::buffer(&m_event_count, sizeof(m_event_count)),
+								   [this](const boost::system::error_code &ec, std::size_t)
+								   {
+									   if (ec == asio::error::operation_aborted)
+									   {
+										   return;
+									   }
+
+									   complete_operations();
+									   wait_for_completions();
+								   });
+	}
+
+	// Only ever runs on one thread at a time, since there
+	// is a single read of the eventfd in flight.
+	void complete_operations()
+	{
+		for (;;)
+		{
+			unsigned head = *m_cq_head;
+			unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+			for (; head != tail; head++)
+			{
+				const io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+				Operation *op = reinterpret_cast<Operation *>(cqe.user_data);
+
+				if (op != nullptr)
+				{
+					op->m_on_completion(cqe.res, cqe.flags);
+				}
+			}
+
+			__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+			// Completions the ring had no room for wait in
+			// the kernel until they are asked for.
+			if (!(__atomic_load_n(m_sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+			{
+				return;
+			}
+
+			::syscall(__NR_io_uring_enter, m_ring_fd.get(), 0, 0,
+					  IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+	}
+
+private:
+	asio::io_service &m_ios;
+	FileDescriptor m_ring_fd;
+	Mapping m_rings;
+	Mapping m_sqe_memory;
+
+	asio::posix::stream_descriptor m_event_fd;
+	std::uint64_t m_event_count;
+
+	// Submission side, guarded since a shared event loop
+	// runs handlers on several threads.
+	std::mutex m_guard;
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail_shared;
+	unsigned *m_sq_flags;
+	unsigned m_sq_mask;
+	unsigned m_sq_entries;
+	io_uring_sqe *m_sqes;
+	unsigned m_sq_tail;
+	unsigned m_unsubmitted;
+	bool m_submit_posted;
+
+	// Completion side.
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned m_cq_mask;
+	io_uring_cqe *m_cqes;
+
+	// The registered buffers.
+	Mapping m_buffer_memory;
+	std::size_t m_buffer_size;
+	bool m_buffers_registered;
+	std::vector<char *> m_free_buffers;
+};
+
+// Memory for the handlers of the asynchronous operations
+// of one connection. A connection has only a few
+// operations in flight at any time, so a handful of fixed
+// slots, reused over and over, cover all of them without
+// going to the heap.
+class HandlerMemory
+{
+public:
+	HandlerMemory()
+	{
+		for (auto &in_use : m_in_use)
+		{
+			in_use.store(false);
+		}
+	}
+
+	HandlerMemory(const HandlerMemory &) = delete;
+	HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+	void *allocate(std::size_t size)
+	{
+		if (size <= SLOT_SIZE)
+		{
+			for (std::size_t i = 0; i < SLOTS; i++)
+			{
+				// Operations may complete, and release their
+				// memory, on any thread of the pool.
+				bool expected = false;
+				if (m_in_use[i].compare_exchange_strong(expected, true,
+														 std::memory_order_acquire))
+				{
+					return &m_storage[i];
+				}
+			}
+		}
+
+		// All slots taken or too large; rare enough.
+		return ::operator new(size);
+	}
+
+	void deallocate(void *pointer)
+	{
+		for (std::size_t i = 0; i < SLOTS; i++)
+		{
+			if (pointer == &m_storage[i])
+			{
+				m_in_use[i].store(false, std::memory_order_release);
+				return;
+			}
+		}
+
+		::operator delete(pointer);
+	}
+
+private:
+	static const std::size_t SLOTS = 4;
+	static const std::size_t SLOT_SIZE = 1024;
+
+	typename std::aligned_storage<SLOT_SIZE>::type m_storage[SLOTS];
+	std::atomic<bool> m_in_use[SLOTS];
+};
+
+// Allocator handing out HandlerMemory, to be associated
+// with completion handlers so that Asio uses it for the
+// state of the operations they complete.
+template <typename T>
+class HandlerAllocator
+{
+public:
+	using value_type = T;
+
+	explicit HandlerAllocator(HandlerMemory &memory) : m_memory(memory) {}
+
+	template <typename U>
+	HandlerAllocator(const HandlerAllocator<U> &other) noexcept : m_memory(other.m_memory) {}
+
+	bool operator==(const HandlerAllocator &other) const noexcept
+	{
+		return &m_memory == &other.m_memory;
+	}
+
+	bool operator!=(const HandlerAllocator &other) const noexcept
+	{
+		return &m_memory != &other.m_memory;
+	}
+
+	T *allocate(std::size_t n) const
+	{
+		return static_cast<T *>(m_memory.allocate(sizeof(T) * n));
+	}
+
+	void deallocate(T *p, std::size_t /*n*/) const
+	{
+		return m_memory.deallocate(p);
+	}
+
+private:
+	template <typename>
+	friend class HandlerAllocator;
+
+	HandlerMemory &m_memory;
+};
+
+// Wraps a completion handler and associates it with a
+// HandlerAllocator.
+template <typename Handler>
+class CustomAllocHandler
+{
+public:
+	using allocator_type = HandlerAllocator<Handler>;
+
+	CustomAllocHandler(HandlerMemory &memory, Handler handler) : m_memory(memory),
+																 m_handler(std::move(handler))
+	{
+	}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(m_memory);
+	}
+
+	template <typename... Args>
+	void operator()(Args &&...args)
+	{
+		m_handler(std::forward<Args>(args)...);
+	}
+
+private:
+	HandlerMemory &m_memory;
+	Handler m_handler;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> make_custom_alloc_handler(HandlerMemory &memory,
+															 Handler handler)
+{
+	return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
+
+class Service;
+class Router;
+class FileLookup;
+
+// Buffer sequence referring to buffers owned by someone
+// else, so that a write operation does not copy them.
+class BufferSequenceView
+{
+public:
+	using value_type = asio::const_buffer;
+	using const_iterator = const asio::const_buffer *;
+
+	explicit BufferSequenceView(const std::vector<asio::const_buffer> &buffers)
+		: m_begin(buffers.data()),
+		  m_end(buffers.data() + buffers.size())
+	{
+	}
+
+	const_iterator begin() const { return m_begin; }
+	const_iterator end() const { return m_end; }
+
+private:
+	const_iterator m_begin;
+	const_iterator m_end;
+};
+
+// Per thread free list of finished Service objects, so
+// that accepting a connection does not allocate a Service,
+// its socket, strand and timer, or the buffers they have
+// grown. A thread only ever runs one event loop, which is
+// what every Service on its free list belongs to.
+class ServicePool
+{
+public:
+	static Service *acquire(asio::io_service &ios,
+							const ServerConfig &config,
+							ResourceCache &cache,
+							TimingWheel &wheel,
+							ConnectionLimiter &limiter,
+							const Router &router,
+							FileIoPool *file_io,
+							IoUring *ring);
+
+	static void release(Service *service, std::size_t max_pooled);
+
+private:
+	struct FreeList
+	{
+		~FreeList();
+
+		std::vector<Service *> services;
+	};
+
+	static FreeList &free_list()
+	{
+		thread_local FreeList list;
+		return list;
+	}
+};
+
+// A request as handlers see it. Everything in it refers to
+// the connection's own buffers, so it is only valid during
+// RequestHandler::handle(); a handler answering later must
+// copy what it still needs.
+class RequestView
+{
+public:
+	// Most parameters a route may capture.
+	static const std::size_t MAX_PARAMS = 8;
+
+	RequestView() : m_parser(nullptr),
+					m_h2_request(nullptr),
+					m_param_count(0)
+	{
+	}
+
+	std::string_view method() const
+	{
+		return m_method;
+	}
+
+	// The request target, and its path and query parts.
+	std::string_view target() const
+	{
+		return m_target;
+	}
+
+	std::string_view path() const
+	{
+		return m_path;
+	}
+
+	std::string_view query() const
+	{
+		return m_query;
+	}
+
+	// Value of a header, whose name must be given in lower
+	// case, or an empty view if there is no such header.
+	std::string_view header(std::string_view name) const
+	{
+		if (m_h2_request != nullptr)
+		{
+			return m_h2_request->header(name);
+		}
+
+		return m_parser->header(name);
+	}
+
+	// Path segment captured by a ":name" in the route, or
+	// an empty view if there is none.
+	std::string_view param(std::string_view name) const
+	{
+		for (std::size_t i = 0; i < m_param_count; i++)
+		{
+			if (m_params[i].first == name)
+			{
+				return m_params[i].second;
+			}
+		}
+
+		return std::string_view();
+	}
+
+private:
+	friend class Service;
+	friend class Router;
+
+	void reset(const HttpRequestParser *parser, const Http2Request *h2_request,
+			   std::string_view method, std::string_view target)
+	{
+		m_parser = parser;
+		m_h2_request = h2_request;
+		m_method = method;
+		m_target = target;
+
+		std::size_t question = target.find('?');
+		m_path = target.substr(0, question);
+		m_query = question == std::string_view::npos ? std::string_view()
+													 : target.substr(question + 1);
+		m_param_count = 0;
+	}
+
+	const HttpRequestParser *m_parser;
+	const Http2Request *m_h2_request;
+	std::string_view m_method;
+	std::string_view m_target;
+	std::string_view m_path;
+	std::string_view m_query;
+	std::array<std::pair<std::string_view, std::string_view>, MAX_PARAMS> m_params;
+	std::size_t m_param_count;
+};
+
+// The one answer to a request. It can be moved out of the
+// handler and used later, from any thread; the connection
+// waits for it. A writer dropped without answering sends a
+// 500.
+class ResponseWriter
+{
+public:
+	ResponseWriter(ResponseWriter &&other) noexcept : m_service(other.m_service),
+													  m_stream_id(other.m_stream_id),
+													  m_headers(std::move(other.m_headers))
+	{
+		other.m_service = nullptr;
+	}
+
+	ResponseWriter(const ResponseWriter &) = delete;
+	ResponseWriter &operator=(const ResponseWriter &) = delete;
+	ResponseWriter &operator=(ResponseWriter &&) = delete;
+
+	~ResponseWriter();
+
+	// Adds a header to the response, before it is sent.
+	void add_header(std::string_view name, std::string_view value)
+	{
+		m_headers.append(name).append(": ").append(value).append("\r\n");
+	}
+
+	// Sends a response with the given body.
+	void send(unsigned int status, std::string_view content_type, std::string body);
+
+	// Sends the file at root followed by path, the way static
+	// files are sent: from the cache if it is there, with
+	// validators, byte ranges and content encodings. The path
+	// is a request path, percent-encoded and starting with
+	// '/'; one that is malformed or leads out of root is
+	// answered with 400.
+	void send_file(std::string_view root, std::string_view path);
+
+	// Sends a resource prepared ahead, such as a file of an
+	// asset pack, with validators and byte ranges.
+	void send_resource(std::shared_ptr<const CachedResource> resource);
+
+private:
+	friend class Service;
+
+	ResponseWriter(Service *service, std::uint32_t stream_id) : m_service(service),
+															   m_stream_id(stream_id)
+	{
+	}
+
+	Service *m_service;
+	std::uint32_t m_stream_id;
+	std::string m_headers;
+};
+
+// Answers the requests routed to it. handle() is called on
+// the connection's strand and must not block: work that
+// would is to be done elsewhere, answering from there.
+class RequestHandler
+{
+public:
+	virtual ~RequestHandler() = default;
+
+	virtual void handle(const RequestView &request, ResponseWriter response) = 0;
+};
+
+// A handler with no state of its own.
+class FunctionHandler : public RequestHandler
+{
+public:
+	typedef std::function<void(const RequestView &, ResponseWriter)> Function;
+
+	explicit FunctionHandler(Function function) : m_function(std::move(function))
+	{
+	}
+
+	void handle(const RequestView &request, ResponseWriter response) override
+	{
+		m_function(request, std::move(response));
+	}
+
+private:
+	Function m_function;
+};
+
+// Serves the files below a directory.
+class StaticFileHandler : public RequestHandler
+{
+public:
+	explicit StaticFileHandler(std::string root) : m_root(std::move(root))
+	{
+	}
+
+	void handle(const RequestView &request, ResponseWriter response) override
+	{
+		response.send_file(m_root, request.path());
+	}
+
+private:
+	std::string m_root;
+};
+
+// Serves the files of an asset pack.
+class AssetPackHandler : public RequestHandler
+{
+public:
+	explicit AssetPackHandler(const std::string &path) : m_pack(path)
+	{
+	}
+
+	void handle(const RequestView &request, ResponseWriter response) override
+	{
+		auto resource = m_pack.find(request.path());
+
+		if (!resource)
+		{
+			response.send(404, std::string_view(), std::string());
+			return;
+		}
+
+		response.send_resource(std::move(resource));
+	}
+
+private:
+	AssetPack m_pack;
+};
+
+// Serves the metrics in the Prometheus text format.
+class MetricsHandler : public RequestHandler
+{
+public:
+	void handle(const RequestView & /*request*/, ResponseWriter response) override
+	{
+		std::string body;
+		Metrics::render(body);
+
+		response.add_header("cache-control", "no-store");
+		response.send(200, "text/plain; version=0.0.4", std::move(body));
+	}
+};
+
+// Maps request paths onto handlers. A route is either an
+// exact path ("/health"), a prefix ending in "/*" that takes
+// everything below it ("/static/*"), or has parameters,
+// each standing for one path segment ("/users/:id/orders").
+//
+// Routes are kept in a radix tree whose edges are labelled
+// with the static parts of the paths, so that matching
+// compares every byte of the path about once and allocates
+// nothing. Static segments win over parameters, which win
+// over prefixes, and longer prefixes over shorter ones.
+// Routes are added before the server starts, and the tree
+// is only read from then on.
+class Router
+{
+public:
+	Router() : m_root(new Node)
+	{
+	}
+
+	// Returns false if the pattern is malformed, or
+	// already taken.
+	bool add(std::string_view pattern, std::shared_ptr<RequestHandler> handler)
+	{
+		if (pattern.empty() || pattern.front() != '/' || !handler)
+		{
+			return false;
+		}
+
+		bool prefix = pattern.size() >= 2 && pattern.substr(pattern.size() - 2) == "/*";
+		if (prefix)
+		{
+			// Keep the slash, so that "/static/*" does not
+			// take "/staticfoo".
+			pattern.remove_suffix(1);
+		}
+
+		Node *node = m_root.get();
+
+		while (!pattern.empty())
+		{
+			std::size_t colon = pattern.find(':');
+			node = insert(node, pattern.substr(0, colon));
+
+			if (colon == std::string_view::npos)
+			{
+				break;
+			}
+
+			// A parameter takes a whole segment.
+			std::size_t end = pattern.find('/', colon);
+			std::string_view name = pattern.substr(colon + 1, end == std::string_view::npos
+																 ? std::string_view::npos
+																 : end - colon - 1);
+
+			if (colon == 0 || pattern[colon - 1] != '/' || name.empty())
+			{
+				return false;
+			}
+
+			if (!node->param_child)
+			{
+				node->param_child.reset(new Node);
+				node->param_name.assign(name);
+			}
+			else if (node->param_name != name)
+			{
+				return false;
+			}
+
+			node = node->param_child.get();
+			pattern = end == std::string_view::npos ? std::string_view() : pattern.substr(end);
+		}
+
+		auto &slot = prefix ? node->prefix_handler : node->handler;
+		if (slot)
+		{
+			return false;
+		}
+
+		slot = std::move(handler);
+		return true;
+	}
+
+	// Handler of the request's path, or nullptr if no
+	// route matches; the parameters go into the request.
+	RequestHandler *match(RequestView &request) const
+	{
+		request.m_param_count = 0;
+		return match(*m_root, request.path(), request);
+	}
+
+private:
+	struct Node
+	{
+		// Static text leading from the parent to this node.
+		std::string label;
+
+		// Children by the first byte of their labels, which
+		// differ from one child to the next.
+		std::string first_bytes;
+		std::vector<std::unique_ptr<Node>> children;
+
+		// The child matching a parameter, with an empty
+		// label, and the parameter's name.
+		std::unique_ptr<Node> param_child;
+		std::string param_name;
+
+		// Handlers of the path ending here, and of the
+		// paths continuing past here.
+		std::shared_ptr<RequestHandler> handler;
+		std::shared_ptr<RequestHandler> prefix_handler;
+	};
+
+	// Returns the node reached from node by the given text,
+	// splitting and adding nodes as needed.
+	static Node *insert(Node *node, std::string_view text)
+	{
+		while (!text.empty())
+		{
+			std::size_t index = node->first_bytes.find(text.front());
+
+			if (index == std::string::npos)
+			{
+				std::unique_ptr<Node> child(new Node);
+				child->label.assign(text);
+
+				node->first_bytes.push_back(text.front());
+				node->children.push_back(std::move(child));
+				return node->children.back().get();
+			}
+
+			Node *child = node->children[index].get();
+
+			std::size_t common = 0;
+			while (common < child->label.size() && common < text.size() &&
+				   child->label[common] == text[common])
+			{
+				common++;
+			}
+
+			if (common < child->label.size())
+			{
+				// The text leaves the label midway; the
+				// shared part becomes a node of its own.
+				std::unique_ptr<Node> middle(new Node);
+				middle->label = child->label.substr(0, common);
+				child->label.erase(0, common);
+
+				middle->first_bytes.push_back(child->label.front());
+				middle->children.push_back(std::move(node->children[index]));
+				node->children[index] = std::move(middle);
+
+				child = node->children[index].get();
+			}
+
+			node = child;
+			text.remove_prefix(common);
+		}
+
+		return node;
+	}
+
+	// Matches the rest of the path below node, whose label
+	// has been matched already.
+	static RequestHandler *match(const Node &node, std::string_view rest, RequestView &request)
+	{
+		if (rest.empty() && node.handler)
+		{
+			return node.handler.get();
+		}
+
+		if (!rest.empty())
+		{
+			std::size_t index = node.first_bytes.find(rest.front());
+
+			if (index != std::string::npos)
+			{
+				const Node &child = *node.children[index];
+
+				if (rest.compare(0, child.label.size(), child.label) == 0)
+				{
+					if (RequestHandler *handler = match(child, rest.substr(child.label.size()), request))
+					{
+						return handler;
+					}
+				}
+			}
+
+			if (node.param_child && request.m_param_count < RequestView::MAX_PARAMS)
+			{
+				std::string_view segment = rest.substr(0, rest.find('/'));
+
+				if (!segment.empty())
+				{
+					request.m_params[request.m_param_count++] = {node.param_name, segment};
+
+					if (RequestHandler *handler = match(*node.param_child, rest.substr(segment.size()), request))
+					{
+						return handler;
+					}
+
+					request.m_param_count--;
+				}
+			}
+		}
+
+		return node.prefix_handler.get();
+	}
+
+	std::unique_ptr<Node> m_root;
+};
+
+// Finds the file answering a request, and whatever about
+// the response follows from it: a cached snapshot or an open
+// file, the encoding, the validators and the status. This is
+// where serving a file blocks, on the file system and on
+// reading files into the cache, so it runs on the file I/O
+// pool while the connection carries on. The request headers
+// it looks at are copied for that.
+class FileLookup
+{
+public:
+	FileLookup(const ServerConfig &config,
+			   ResourceCache &cache) : m_config(config),
+									   m_cache(cache),
+									   m_readahead_bytes(0),
+									   m_resume(nullptr),
+											 m_waiting(false),
+											 m_has_landed(false),
+											 m_landed_variant(ContentEncoding::identity),
+											 m_handoff(false),
+											 m_response_status_code(200),
+											 m_vary(false),
+											 m_resource_size_bytes(0),
+											 m_content_encoding(ContentEncoding::identity),
+											 m_warm_end(0)
+	{
+	}
+
+	// Sets the lookup up for the file at path, asked for
+	// by request. Lookups are reused, so this reuses the
+	// memory of the previous one.
+	void reset(std::string_view path, const RequestView &request)
+	{
+		m_path.assign(path);
+		m_accept_encoding.assign(request.header("accept-encoding"));
+		m_if_none_match.assign(request.header("if-none-match"));
+		m_if_modified_since.assign(request.header("if-modified-since"));
+		m_readahead_bytes = request.header("range").empty()
+								? m_config.file_readahead_bytes
+								: 0;
+		m_waiting = false;
+		m_has_landed = false;
+		m_landed.reset();
+
+		clear_outcome();
+	}
+
+	using Resume = std::function<void()>;
+
+	// Serves the file at the path. Returns false if another
+	// lookup is loading the file into the cache; resume is
+	// then called, on any thread, once it is done, for this
+	// one to be run again and take over what it loaded.
+	bool run(const Resume &resume)
+	{
+		m_has_landed = m_waiting;
+		m_waiting = false;
+		m_handoff = false;
+		m_resume = &resume;
+
+		clear_outcome();
+
+		// Compressible resources may be sent in a
+		// Content-Encoding the client accepts.
+		if (m_config.negotiate_content_encoding &&
+			is_compressible(m_path))
+		{
+			m_vary = true;
+
+			if (serve_encoded(m_path))
+			{
+				return resumed_later(resume);
+			}
+		}
+
+		if (!serve_file(m_path, ContentEncoding::identity))
+		{
+			// Resource not found, or a directory
+			// and the like which cannot be served.
+			m_response_status_code = 404;
+		}
+
+		return resumed_later(resume);
+	}
+
+	// Serves the resource from the cache in the variant
+	// run() would pick, if it is there and need not be
+	// revalidated. Never touches the file system, so that
+	// hits are answered on the event loop. Returns false
+	// if run() is needed.
+	bool run_cached()
+	{
+		clear_outcome();
+
+		if (!m_cache.enabled())
+		{
+			return false;
+		}
+
+		bool stale = false;
+
+		if (m_config.negotiate_content_encoding &&
+			is_compressible(m_path))
+		{
+			m_vary = true;
+
+			unsigned int accepted =
+				accepted_encodings(m_accept_encoding);
+
+			if (accepted != 0)
+			{
+				for (ContentEncoding encoding : ENCODING_PREFERENCE)
+				{
+					if (accepted & (1u << static_cast<unsigned int>(encoding)))
+					{
+						auto resource = m_cache.peek(m_path, encoding, stale);
+						if (resource)
+						{
+							serve_cached(resource);
+							return true;
+						}
+
+						if (stale)
+						{
+							return false;
+						}
+					}
+				}
+
+				// Left to the siblings on disk, or to be
+				// compressed.
+				return false;
+			}
+		}
+
+		auto resource = m_cache.peek(m_path, ContentEncoding::identity, stale);
+		if (!resource)
+		{
+			return false;
+		}
+
+		serve_cached(resource);
+		return true;
+	}
+
+	// Serves a resource already in memory, found in the
+	// cache or prepared ahead.
+	void serve_cached(std::shared_ptr<const CachedResource> resource)
+	{
+		m_cached_resource = resource;
+		m_resource_size_bytes = m_cached_resource->size;
+		m_content_encoding = m_cached_resource->encoding;
+		m_etag = m_cached_resource->etag;
+		m_last_modified = m_cached_resource->last_modified;
+
+		if (is_not_modified(m_cached_resource->mtime_ns / 1000000000))
+		{
+			m_cached_resource.reset();
+			m_response_status_code = 304;
+		}
+	}
+
+	// Gives up on the file, answering with status instead.
+	void fail(unsigned int status)
+	{
+		m_response_status_code = status;
+		m_cached_resource.reset();
+		m_resource_fd.reset();
+		m_etag.clear();
+		m_last_modified.clear();
+	}
+
+private:
+	friend class Service;
+
+	// Encodings tried, best first.
+	static constexpr ContentEncoding ENCODING_PREFERENCE[] = {
+		ContentEncoding::br,
+		ContentEncoding::gzip};
+
+	void clear_outcome()
+	{
+		m_response_status_code = 200;
+		m_vary = false;
+		m_cached_resource.reset();
+		m_resource_fd.reset();
+		m_resource_size_bytes = 0;
+		m_content_encoding = ContentEncoding::identity;
+		m_warm_end = 0;
+		m_etag.clear();
+		m_last_modified.clear();
+	}
+
+	// Ends a run; see run().
+	bool resumed_later(const Resume &resume)
+	{
+		m_resume = nullptr;
+		m_has_landed = false;
+
+		if (!m_waiting)
+		{
+			m_landed.reset();
+			return true;
+		}
+
+		// The load may have landed already, on another
+		// thread. Whichever of the two comes last has the
+		// lookup run again.
+		if (m_handoff.exchange(true))
+		{
+			resume();
+		}
+
+		return false;
+	}
+
+	// Makes the given variant of the file described by st
+	// through load, which is handed the waiter and waiting
+	// flag of ResourceCache::load_once(). What another
+	// lookup loaded while this one waited is taken over
+	// instead, if it is of this version of the file.
+	template <typename Load>
+	std::shared_ptr<const CachedResource> load_once(const std::string &path,
+													ContentEncoding variant,
+													const struct stat &st,
+													Load load)
+	{
+		if (m_has_landed && m_landed_variant == variant && m_landed_path == path)
+		{
+			m_has_landed = false;
+
+			if (!m_landed ||
+				(m_landed->file_size == static_cast<std::size_t>(st.st_size) &&
+				 m_landed->mtime_ns == mtime_ns(st)))
+			{
+				return std::move(m_landed);
+			}
+		}
+
+		auto waiter = [this, resume = *m_resume](std::shared_ptr<const CachedResource> resource)
+		{
+			m_landed = std::move(resource);
+
+			if (m_handoff.exchange(true))
+			{
+				resume();
+			}
+		};
+
+		bool waiting = false;
+		auto resource = load(std::move(waiter), waiting);
+
+		if (waiting)
+		{
+			m_waiting = true;
+			m_landed_path = path;
+			m_landed_variant = variant;
+		}
+
+		return resource;
+	}
+
+	// Tries the variants of the resource in the encodings
+	// accepted by the client, best first: those already in
+	// memory, then precompressed siblings on disk, and as a
+	// last resort compressing the resource ourselves, once.
+	// Returns false if the resource is to be sent as is.
+	bool serve_encoded(const std::string &path)
+	{
+		unsigned int accepted =
+			accepted_encodings(m_accept_encoding);
+
+		if (accepted == 0)
+		{
+			return false;
+		}
+
+		for (ContentEncoding encoding : ENCODING_PREFERENCE)
+		{
+			if (accepted & (1u << static_cast<unsigned int>(encoding)) &&
+				m_cache.enabled())
+			{
+				auto resource = m_cache.lookup(path, encoding);
+				if (resource)
+				{
+					serve_cached(resource);
+					return true;
+				}
+			}
+		}
+
+		for (ContentEncoding encoding : ENCODING_PREFERENCE)
+		{
+			if (accepted & (1u << static_cast<unsigned int>(encoding)) &&
+				serve_file(path + encoding_suffix(encoding), encoding))
+			{
+				return true;
+			}
+		}
+
+		for (ContentEncoding encoding : ENCODING_PREFERENCE)
+		{
+			if (accepted & (1u << static_cast<unsigned int>(encoding)))
+			{
+				return serve_compressed(path, encoding);
+			}
+		}
+
+		return false;
+	}
+
+	// Compresses the resource and caches the result, so
+	// that it is only ever compressed once per version.
+	bool serve_compressed(const std::string &path, ContentEncoding encoding)
+	{
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0 ||
+			!S_ISREG(st.st_mode) ||
+			!m_cache.accepts(static_cast<std::size_t>(st.st_size)))
+		{
+			return false;
+		}
+
+		m_etag = make_etag(st, encoding);
+		m_last_modified = format_http_date(st.st_mtim.tv_sec);
+
+		if (is_not_modified(st.st_mtim.tv_sec))
+		{
+			m_response_status_code = 304;
+
+			return true;
+		}
+
+		FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+
+		if (!fd.is_open() ||
+			::fstat(fd.get(), &st) != 0 ||
+			!m_cache.accepts(static_cast<std::size_t>(st.st_size)))
+		{
+			return false;
+		}
+
+		auto make = [&]() -> std::shared_ptr<const CachedResource>
+		{
+			std::vector<char> body(static_cast<std::size_t>(st.st_size));
+			std::vector<char> compressed;
+
+			if (!read_file(fd.get(), body.data(), body.size()) ||
+				!compress(encoding, body, compressed))
+			{
+				return nullptr;
+			}
+
+			// When compressing does not pay off the plain body
+			// is cached in place of the variant, so that the
+			// attempt is not repeated on every request.
+			if (compressed.size() < body.size())
+			{
+				return m_cache.store(path, encoding, st,
+									 encoding, std::move(compressed));
+			}
+
+			return m_cache.store(path, encoding, st,
+								 ContentEncoding::identity, std::move(body));
+		};
+
+		// Requests for a resource gone cold all arrive here
+		// at once; only one of them compresses it.
+		auto resource = load_once(path, encoding, st,
+								  [&](ResourceCache::Landed waiter, bool &waiting)
+								  {
+									  return m_cache.load_once(path, encoding, make,
+															   std::move(waiter), waiting);
+								  });
+
+		if (m_waiting)
+		{
+			return true;
+		}
+
+		if (!resource)
+		{
+			return false;
+		}
+
+		serve_cached(resource);
+		return true;
+	}
+
+	// Parses Accept-Encoding into a bit set of the encodings
+	// the client accepts, excluding those with a q of zero.
+	static unsigned int accepted_encodings(std::string_view header)
+	{
+		unsigned int accepted = 0;
+		unsigned int refused = 0;
+		bool any = false;
+
+		while (!header.empty())
+		{
+			std::size_t comma = header.find(',');
+			std::string_view item = header.substr(0, comma);
+			header = comma == std::string_view::npos ? std::string_view()
+													 : header.substr(comma + 1);
+
+			std::size_t semicolon = item.find(';');
+			std::string_view coding = trim(item.substr(0, semicolon));
+			bool zero_q = false;
+
+			if (semicolon != std::string_view::npos)
+			{
+				std::string_view q = trim(item.substr(semicolon + 1));
+				if (q.size() >= 3 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+				{
+					q.remove_prefix(2);
+					zero_q = q.find_first_not_of("0.") == std::string_view::npos;
+				}
+			}
+
+			unsigned int bit = 0;
+			if (iequals(coding, "gzip"))
+			{
+				bit = 1u << static_cast<unsigned int>(ContentEncoding::gzip);
+			}
+			else if (iequals(coding, "br"))
+			{
+				bit = 1u << static_cast<unsigned int>(ContentEncoding::br);
+			}
+			else if (coding == "*")
+			{
+				any = !zero_q;
+				continue;
+			}
+
+			(zero_q ? refused : accepted) |= bit;
+		}
+
+		if (any)
+		{
+			accepted |= (1u << static_cast<unsigned int>(ContentEncoding::gzip)) |
+						(1u << static_cast<unsigned int>(ContentEncoding::br));
+		}
+
+		return accepted & ~refused;
+	}
+
+	// Serves the resource from file, whose contents are
+	// encoded with encoding: the resource's own file, or a
+	// precompressed sibling, which is cached as the
+	// resource's variant in that encoding.
+	// Returns false if there is no such file.
+	bool serve_file(const std::string &file, ContentEncoding encoding)
+	{
+		// Hot resources are served from memory without
+		// touching the file system.
+		if (m_cache.enabled())
+		{
+			auto resource = m_cache.lookup(m_path, encoding);
+			if (resource)
+			{
+				serve_cached(resource);
+
+				return true;
+			}
+		}
+
+		// The metadata alone tells whether the client's
+		// copy is still current, in which case the file is
+		// not even opened.
+		struct stat st;
+		if (::stat(file.c_str(), &st) != 0 ||
+			!S_ISREG(st.st_mode))
+		{
+			return false;
+		}
+
+		m_content_encoding = encoding;
+		m_etag = make_etag(st, encoding);
+		m_last_modified = format_http_date(st.st_mtim.tv_sec);
+
+		if (is_not_modified(st.st_mtim.tv_sec))
+		{
+			m_response_status_code = 304;
+
+			return true;
+		}
+
+		// Only open the file here. Its contents are either
+		// loaded into the cache or sent once the headers are
+		// out, by send_file_body() without ever being copied
+		// to us, or by stream_file_body() in bounded chunks.
+		m_resource_fd.reset(::open(file.c_str(),
+								   O_RDONLY | O_CLOEXEC));
+
+		if (!m_resource_fd.is_open() ||
+			::fstat(m_resource_fd.get(), &st) != 0 ||
+			!S_ISREG(st.st_mode))
+		{
+			// Could not open file.
+			// Something bad has happened.
+			m_resource_fd.reset();
+			m_response_status_code = 500;
+
+			return true;
+		}
+
+		// The file may have changed since it was stat()ed.
+		m_etag = make_etag(st, encoding);
+		m_last_modified = format_http_date(st.st_mtim.tv_sec);
+
+		if (m_cache.accepts(static_cast<std::size_t>(st.st_size)))
+		{
+			auto resource = load_once(m_path, encoding, st,
+									  [&](ResourceCache::Landed waiter, bool &waiting)
+									  {
+										  return m_cache.load(m_path, file, m_resource_fd.get(), st, encoding,
+															  std::move(waiter), waiting);
+									  });
+			m_resource_fd.reset();
+
+			if (m_waiting)
+			{
+				return true;
+			}
+
+			if (!resource)
+			{
+				m_response_status_code = 500;
+
+				return true;
+			}
+
+			m_cached_resource = resource;
+			m_resource_size_bytes = m_cached_resource->size;
+
+			return true;
+		}
+
+		m_resource_size_bytes = static_cast<std::size_t>(st.st_size);
+
+		// Sent later, from the event loop. On the file I/O
+		// pool the start of the body is read into the page
+		// cache now, so that the loop does not wait for it;
+		// otherwise the kernel is only asked to start on it.
+		::posix_fadvise(m_resource_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		std::size_t window = std::min(m_readahead_bytes, m_resource_size_bytes);
+
+		if (window == 0)
+		{
+			return true;
+		}
+
+		if (m_config.file_io_threads == 0)
+		{
+			::posix_fadvise(m_resource_fd.get(), 0,
+							static_cast<off_t>(window), POSIX_FADV_WILLNEED);
+		}
+		else if (warm_file(m_resource_fd.get(), 0, window))
+		{
+			m_warm_end = static_cast<off_t>(window);
+		}
+
+		return true;
+	}
+
+	// Evaluates If-None-Match, or failing that
+	// If-Modified-Since, against the current validators.
+	bool is_not_modified(std::time_t mtime) const
+	{
+		std::string_view if_none_match = m_if_none_match;
+		if (!if_none_match.empty())
+		{
+			return etag_list_contains(if_none_match, m_etag);
+		}
+
+		std::string_view if_modified_since = m_if_modified_since;
+		std::time_t since = 0;
+
+		return !if_modified_since.empty() &&
+			   parse_http_date(if_modified_since, since) &&
+			   mtime <= since;
+	}
+
+	// Weak comparison of an entity tag against a comma
+	// separated list of them, as If-None-Match requires.
+	static bool etag_list_contains(std::string_view list, std::string_view etag)
+	{
+		auto opaque = [](std::string_view tag)
+		{
+			if (tag.size() >= 2 && tag.substr(0, 2) == "W/")
+			{
+				tag.remove_prefix(2);
+			}
+			return tag;
+		};
+
+		while (!list.empty())
+		{
+			std::size_t comma = list.find(',');
+			std::string_view item = trim(list.substr(0, comma));
+			list = comma == std::string_view::npos ? std::string_view()
+												   : list.substr(comma + 1);
+
+			if (item == "*" || opaque(item) == opaque(etag))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	const ServerConfig &m_config;
+	ResourceCache &m_cache;
+	std::string m_path;
+
+	// The request headers looked at.
+	std::string m_accept_encoding;
+	std::string m_if_none_match;
+	std::string m_if_modified_since;
+
+	// How much of an uncached body to read ahead; none
+	// when only ranges of it are asked for.
+	std::size_t m_readahead_bytes;
+
+	// Waiting for another lookup to load the file, and what
+	// it loaded, for which variant of which path. The run
+	// and the load landing hand the lookup over through
+	// m_handoff.
+	const Resume *m_resume;
+	bool m_waiting;
+	bool m_has_landed;
+	std::shared_ptr<const CachedResource> m_landed;
+	std::string m_landed_path;
+	ContentEncoding m_landed_variant;
+	std::atomic<bool> m_handoff;
+
+	// The outcome, named as in Service.
+	unsigned int m_response_status_code;
+	bool m_vary;
+	std::shared_ptr<const CachedResource> m_cached_resource;
+	FileDescriptor m_resource_fd;
+	std::size_t m_resource_size_bytes;
+	ContentEncoding m_content_encoding;
+	off_t m_warm_end;
+	std::string m_etag;
+	std::string m_last_modified;
+};
+
+class Service
+{
+	// Sent with every response.
+	static constexpr const char *SERVER_HEADER = "server: Async-HTTP\r\n";
+
+	// Most byte ranges a single request may ask for.
+	static const std::size_t MAX_RANGES = 16;
+
+	// Separates the parts of multipart/byteranges bodies.
+	static constexpr const char *MULTIPART_BOUNDARY = "3d6b6a416f9b5b7c";
+
+	// What the connection is waiting for while reading.
+	enum class ReadPhase
+	{
+		idle, // The next request on a persistent connection.
+		request_line,
+		headers
+	};
+
+public:
+	Service(asio::io_service &ios,
+			const ServerConfig &config,
+			ResourceCache &cache,
+			TimingWheel &wheel,
+			ConnectionLimiter &limiter,
+			const Router &router,
+			FileIoPool *file_io,
+			IoUring *ring) : m_sock(ios),
+							 m_config(config),
+							 m_cache(cache),
+							 m_limiter(limiter),
+							 m_router(router),
+							 m_file_io(file_io),
+							 m_ring(ring),
+							 m_ring_read_op([this](int result, unsigned int)
+											{ asio::post(strand_handler([this, result]()
+																		{ on_ring_received(result); })); }),
+							 m_ring_write_op([this](int result, unsigned int)
+											 { asio::post(strand_handler([this, result]()
+																		 { on_ring_sent(result); })); }),
+							 m_ring_file_op([this](int result, unsigned int)
+											{ asio::post(strand_handler([this, result]()
+																		{ on_chunk_read(result); })); }),
+							 m_ring_on_received(nullptr),
+							 m_ring_iovec_index(0),
+							 m_ring_written(0),
+							 m_ring_on_written(nullptr),
+							 m_strand(asio::make_strand(ios)),
+							 m_wheel(wheel),
+							 m_deadline([this]()
+										{ asio::post(strand_handler([this]()
+																	{ on_deadline_expired(); })); }),
+							 m_read_phase(ReadPhase::request_line),
+							 m_timed_out(false),
+							 m_finishing(false),
+							 m_request_bytes(0),
+							 m_handlers_pending(0),
+							 m_in_handler(false),
+							 m_handler_answered(false),
+							 m_request_line_timed(false),
+							 m_response_head_bytes(0),
+							 m_content_encoding(ContentEncoding::identity),
+							 m_vary(false),
+							 m_requests_served(0),
+							 m_keep_alive(true),
+							 m_resource_offset(0),
+							 m_resource_end(0),
+							 m_range_index(0),
+							 m_content_length(0),
+							 m_stream_base(nullptr),
+							 m_registered_buffer(nullptr),
+							 m_stream_chunk_size(0),
+							 m_stream_current(0),
+							 m_stream_ready(0),
+							 m_stream_wanted(0),
+							 m_stream_pending(0),
+							 m_warm_begin(0),
+							 m_warm_end(0),
+							 m_response_status_code(200), // Assume success.
+							 m_resource_size_bytes(0),
+							 m_h2_reading(false),
+							 m_h2_writing(false),
+							 m_h2_closing(false),
+							 m_h2_warming(false) {};
+
+	// The socket the Acceptor accepts the connection into,
+	// and the client's address it gets along with it.
+	asio::ip::tcp::socket &socket()
+	{
+		return m_sock;
+	}
+
+	asio::ip::tcp::endpoint &peer()
+	{
+		return m_peer;
+	}
+
+	void start_handling()
+	{
+		if (m_request_bytes > 0)
+		{
+			// The client has pipelined its next request,
+			// which is already (at least partly) buffered.
+			m_request_start = std::chrono::steady_clock::now();
+			enter_read_phase(ReadPhase::request_line);
+			on_request_received(boost::system::error_code(), 0);
+			return;
+		}
+
+		// A persistent connection waiting for its next
+		// request is only allowed to idle for so long.
+		enter_read_phase(m_requests_served > 0 ? ReadPhase::idle
+											   : ReadPhase::request_line);
+
+		// The first request is timed from the accept.
+		if (m_requests_served == 0)
+		{
+			m_request_start = std::chrono::steady_clock::now();
+			Metrics::connection_opened();
+			m_limiter.connection_opened();
+		}
+
+		read_request();
+	}
+
+private:
+	void read_request()
+	{
+		receive(m_request_buffer.data() + m_request_bytes,
+				m_request_buffer.size() - m_request_bytes,
+				&Service::on_request_received);
+	}
+
+	void on_request_received(
+		const boost::system::error_code &ec,
+		std::size_t bytes_transferred)
+	{
+		if (ec.value() != 0)
+		{
+			// A client closing an idle persistent
+			// connection is not an error.
+			if (ec != asio::error::eof || m_requests_served == 0)
+			{
+				Log::error("read", ec, &m_peer);
+			}
+
+			// In case of any error - close the
+			// socket and clean up.
+			on_finish();
+			return;
+		}
+
+		m_request_bytes += bytes_transferred;
+
+		// The first byte of a request ends the idle period
+		// of a persistent connection.
+		if (m_read_phase == ReadPhase::idle)
+		{
+			m_request_start = std::chrono::steady_clock::now();
+			enter_read_phase(ReadPhase::request_line);
+		}
+
+		// The parser picks up where it stopped on the
+		// previous read, so no byte is looked at twice.
+		HttpRequestParser::Result result =
+			m_parser.parse(m_request_buffer.data(), m_request_bytes);
+
+		if (m_parser.request_line_complete() && !m_request_line_timed)
+		{
+			m_request_line_at = std::chrono::steady_clock::now();
+			m_request_line_timed = true;
+			Metrics::record(Metrics::Stage::request_line, m_request_line_at - m_request_start);
+		}
+
+		switch (result)
+		{
+		case HttpRequestParser::Result::incomplete:
+			if (m_request_bytes == m_request_buffer.size())
+			{
+				// The request line and headers do not
+				// fit in the request buffer.
+				m_response_status_code = 431;
+				m_keep_alive = false;
+				send_response();
+
+				return;
+			}
+
+			if (m_read_phase == ReadPhase::request_line &&
+				m_parser.request_line_complete())
+			{
+				enter_read_phase(ReadPhase::headers);
+			}
+
+			read_request();
+			return;
+
+		case HttpRequestParser::Result::bad_request:
+			m_response_status_code = 400;
+			m_keep_alive = false;
+			send_response();
+
+			return;
+
+		case HttpRequestParser::Result::too_many_headers:
+			m_response_status_code = 431;
+			m_keep_alive = false;
+			send_response();
+
+			return;
+
+		case HttpRequestParser::Result::complete:
+			break;
+		}
+
+		// A client with prior knowledge of HTTP/2 starts
+		// with a preface that reads as a PRI request.
+		if (m_config.enable_http2 &&
+			m_parser.method() == "PRI" &&
+			m_parser.target() == "*" &&
+			m_parser.version() == "HTTP/2.0" &&
+			m_parser.header_count() == 0)
+		{
+			start_http2(std::unique_ptr<Http2Connection>(
+							new Http2Connection(m_config,
+												std::string_view(Http2Connection::CLIENT_PREFACE).substr(18))),
+						std::string_view());
+			return;
+		}
+
+		// We only support GET method.
+		if (m_parser.method() != "GET")
+		{
+			// Unsupported method.
+			m_response_status_code = 501;
+			m_keep_alive = false;
+			send_response();
+
+			return;
+		}
+
+		if (m_parser.version() != "HTTP/1.1")
+		{
+			// Unsupported HTTP version or bad request.
+			m_response_status_code = 505;
+			m_keep_alive = false;
+			send_response();
+
+			return;
+		}
+
+		m_headers_at = std::chrono::steady_clock::now();
+		Metrics::record(Metrics::Stage::headers, m_headers_at - m_request_line_at);
+
+		if (m_config.enable_http2 &&
+			!m_limiter.draining() &&
+			upgrade_to_http2())
+		{
+			return;
+		}
+
+		// HTTP/1.1 connections are persistent unless the
+		// client asks otherwise or has used up its quota.
+		if (iequals(m_parser.header("connection"), "close"))
+		{
+			m_keep_alive = false;
+		}
+
+		if (m_requests_served + 1 >= m_config.max_keep_alive_requests)
+		{
+			m_keep_alive = false;
+		}
+
+		// The server is shutting down.
+		if (m_limiter.draining())
+		{
+			m_keep_alive = false;
+		}
+
+		// Now we have all we need to process the request.
+		m_request_view.reset(&m_parser, nullptr, m_parser.method(), m_parser.target());
+
+		if (dispatch_request(0))
+		{
+			finish_request();
+		}
+	}
+
+	// The request has been answered.
+	void finish_request()
+	{
+		Metrics::record(Metrics::Stage::process,
+						std::chrono::steady_clock::now() - m_headers_at);
+
+		send_response();
+	}
+
+	// Hands the request in m_request_view to the handler of
+	// its route. Returns true if it has been answered by
+	// the time the handler returns; otherwise the answer
+	// arrives later through on_handler_answered(). Streams
+	// are identified by their HTTP/2 ids, zero for HTTP/1.1.
+	bool dispatch_request(std::uint32_t stream_id)
+	{
+		RequestHandler *handler = m_router.match(m_request_view);
+
+		if (handler == nullptr)
+		{
+			m_response_status_code = 404;
+			return true;
+		}
+
+		m_handlers_pending++;
+		m_handler_answered = false;
+
+		m_in_handler = true;
+		handler->handle(m_request_view, ResponseWriter(this, stream_id));
+		m_in_handler = false;
+
+		return m_handler_answered;
+	}
+
+public:
+	// Called by the ResponseWriter of a stream, on any
+	// thread. The answer is put in place at once if it comes
+	// from within the handler, and posted to the strand
+	// otherwise. A file answer is given as root and path,
+	// a resource prepared ahead as resource.
+	void answer(std::uint32_t stream_id,
+				unsigned int status,
+				std::string headers,
+				std::string_view content_type,
+				std::string body,
+				std::string_view file_root,
+				std::string_view file_path,
+				std::shared_ptr<const CachedResource> resource)
+	{
+		// Only looked at on our strand, so the check of the
+		// strand comes first.
+		if (m_strand.running_in_this_thread() && m_in_handler)
+		{
+			m_handlers_pending--;
+
+			if (!resolve_file_path(file_root, file_path, m_resource_file_path))
+			{
+				status = 400;
+			}
+
+			m_handler_answered = apply_answer(stream_id, status, headers, content_type, body,
+											  std::move(resource));
+			return;
+		}
+
+		Answer answer{status,
+					  std::move(headers),
+					  std::string(content_type),
+					  std::move(body),
+					  std::string(),
+					  std::move(resource)};
+
+		if (!resolve_file_path(file_root, file_path, answer.file_path))
+		{
+			answer.status = 400;
+		}
+
+		asio::post(m_strand, [this, stream_id, answer = std::move(answer)]() mutable
+				   { on_handler_answered(stream_id, answer); });
+	}
+
+private:
+	// An answer that arrived after its handler returned.
+	struct Answer
+	{
+		unsigned int status;
+		std::string headers;
+		std::string content_type;
+		std::string body;
+		std::string file_path;
+		std::shared_ptr<const CachedResource> resource;
+	};
+
+	void on_handler_answered(std::uint32_t stream_id, Answer &answer)
+	{
+		m_handlers_pending--;
+
+		if (m_h2)
+		{
+			if (m_h2_closing)
+			{
+				// h2_close() has been waiting for us.
+				h2_close();
+				return;
+			}
+
+			// The stream's request is kept for us, even if
+			// the stream has been reset meanwhile.
+			const Http2Request *request = m_h2->request(stream_id);
+			if (request != nullptr)
+			{
+				m_request_view.reset(nullptr, request, request->method, request->path);
+				m_resource_file_path = std::move(answer.file_path);
+
+				if (apply_answer(stream_id, answer.status, answer.headers, answer.content_type, answer.body,
+								 std::move(answer.resource)))
+				{
+					h2_respond(stream_id);
+				}
+			}
+
+			h2_process();
+			return;
+		}
+
+		m_resource_file_path = std::move(answer.file_path);
+
+		if (apply_answer(stream_id, answer.status, answer.headers, answer.content_type, answer.body,
+								 std::move(answer.resource)))
+		{
+			finish_request();
+		}
+	}
+
+	// Sets up the response from a handler's answer: the
+	// file at m_resource_file_path if there is one, the
+	// prepared resource if there is one, the given body
+	// otherwise. Returns false if the file is still being
+	// looked up.
+	bool apply_answer(std::uint32_t stream_id,
+					  unsigned int status,
+					  std::string &headers,
+					  std::string_view content_type,
+					  std::string &body,
+					  std::shared_ptr<const CachedResource> prepared)
+	{
+		if (!m_resource_file_path.empty())
+		{
+			return serve_path(stream_id, headers);
+		}
+
+		if (prepared)
+		{
+			// Nothing to look up, only the validators to
+			// check, which is done here and now.
+			PendingLookup *pending = acquire_lookup();
+			pending->lookup.reset(std::string_view(), m_request_view);
+			pending->lookup.serve_cached(std::move(prepared));
+
+			m_response_headers += headers;
+			apply_lookup(pending->lookup);
+			release_lookup(pending);
+			return true;
+		}
+
+		m_response_headers += headers;
+
+		// Statuses we have no status line for.
+		if (!known_status(status))
+		{
+			status = 500;
+		}
+
+		m_response_status_code = status;
+
+		if (!content_type.empty())
+		{
+			m_response_headers.append("content-type: ").append(content_type).append("\r\n");
+		}
+
+		if (body.empty() || status == 204 || status == 304)
+		{
+			return true;
+		}
+
+		// Sent like a cached resource, without copying the
+		// body again.
+		auto resource = std::make_shared<CachedResource>();
+		resource->size = body.size();
+		resource->encoding = ContentEncoding::identity;
+		resource->mtime_ns = 0;
+		resource->file_size = body.size();
+		resource->body.assign(body.begin(), body.end());
+		resource->headers = "content-length: ";
+		append_uint(resource->headers, body.size());
+		resource->headers += "\r\n";
+
+		m_cached_resource = std::move(resource);
+		m_resource_size_bytes = body.size();
+		m_ranges.push_back(ByteRange{0, body.size()});
+		m_content_length = body.size();
+
+		return true;
+	}
+
+	// Answers an Upgrade to h2c with 101 Switching Protocols
+	// and carries on over HTTP/2, the request becoming its
+	// first stream. Returns false if the client has not
+	// asked for it, or has sent malformed settings, and the
+	// request is then answered over HTTP/1.1.
+	bool upgrade_to_http2()
+	{
+		std::string_view settings = m_parser.header("http2-settings");
+		std::string_view upgrade = m_parser.header("upgrade");
+		bool h2c = false;
+
+		while (!upgrade.empty())
+		{
+			std::size_t comma = upgrade.find(',');
+			h2c = h2c || iequals(trim(upgrade.substr(0, comma)), "h2c");
+			upgrade = comma == std::string_view::npos ? std::string_view()
+													  : upgrade.substr(comma + 1);
+		}
+
+		if (!h2c || settings.empty())
+		{
+			return false;
+		}
+
+		Http2Request request;
+		request.method.assign(m_parser.method());
+		request.path.assign(m_parser.target());
+
+		for (std::size_t i = 0; i < m_parser.header_count(); i++)
+		{
+			const auto &header = m_parser.header_at(i);
+
+			std::string name(header.name);
+			for (char &c : name)
+			{
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			}
+
+			// Fields about this hop, and the upgrade itself.
+			if (name == "connection" || name == "upgrade" ||
+				name == "http2-settings" || name == "keep-alive" ||
+				name == "transfer-encoding")
+			{
+				continue;
+			}
+
+			request.headers.push_back(HpackField{std::move(name), std::string(header.value)});
+		}
+
+		std::unique_ptr<Http2Connection> h2(
+			new Http2Connection(m_config, Http2Connection::CLIENT_PREFACE));
+
+		if (!h2->upgrade(settings, std::move(request)))
+		{
+			return false;
+		}
+
+		start_http2(std::move(h2),
+					"HTTP/1.1 101 Switching Protocols\r\n"
+					"connection: Upgrade\r\n"
+					"upgrade: h2c\r\n"
+					"\r\n");
+		return true;
+	}
+
+	// From now on the connection speaks HTTP/2, starting
+	// with the given bytes and our SETTINGS.
+	void start_http2(std::unique_ptr<Http2Connection> h2, std::string_view prologue)
+	{
+		m_h2 = std::move(h2);
+		m_h2->start(prologue);
+
+		// Whatever the client has sent after the request
+		// head already belongs to HTTP/2.
+		std::size_t consumed = m_parser.consumed();
+		std::size_t available = 0;
+		char *buffer = m_h2->receive_buffer(available);
+		std::size_t length = std::min(available, m_request_bytes - consumed);
+
+		std::memcpy(buffer, m_request_buffer.data() + consumed, length);
+		m_request_bytes = 0;
+		m_parser.reset();
+
+		m_h2->received(length);
+		h2_process();
+	}
+
+	// Serves the requests received so far, and keeps a read
+	// and, whenever there is something to send, a write in
+	// flight until the connection is done with.
+	void h2_process()
+	{
+		// The server is shutting down.
+		if (m_limiter.draining())
+		{
+			m_h2->go_away();
+		}
+
+		h2_serve_requests();
+
+		if (!m_h2_writing)
+		{
+			h2_write();
+		}
+
+		h2_warm_file();
+
+		if (m_h2->finished() && !m_h2_writing)
+		{
+			h2_close();
+			return;
+		}
+
+		if (!m_h2_reading)
+		{
+			h2_read();
+		}
+
+		// Streams in progress are held to the write
+		// timeout, an idle connection to the keep-alive one.
+		arm_deadline(m_h2_writing || m_h2->has_open_streams()
+						 ? m_config.response_write_timeout
+						 : m_config.keep_alive_idle_timeout);
+	}
+
+	// Every stream goes through the same routing as an
+	// HTTP/1.1 request, and its response is handed over to
+	// the connection, which sends it as its turn comes.
+	void h2_serve_requests()
+	{
+		while (const Http2Request *request = m_h2->next_request())
+		{
+			auto start = std::chrono::steady_clock::now();
+			m_request_view.reset(nullptr, request, request->method, request->path);
+
+			if (request->method != "GET")
+			{
+				m_response_status_code = 501;
+			}
+			else if (!dispatch_request(request->stream_id))
+			{
+				// Answered later.
+				continue;
+			}
+
+			h2_respond(request->stream_id);
+
+			Metrics::record(Metrics::Stage::process,
+							std::chrono::steady_clock::now() - start);
+		}
+	}
+
+	// Hands the response set up for the stream over to the
+	// connection.
+	void h2_respond(std::uint32_t stream_id)
+	{
+		bool whole_cached_resource =
+			m_cached_resource && m_response_status_code == 200;
+
+		append_response_headers(whole_cached_resource);
+
+		Http2Response response;
+		response.status = m_response_status_code;
+		response.headers.append(date_header()).append(SERVER_HEADER);
+
+		if (whole_cached_resource)
+		{
+			response.headers += m_cached_resource->headers;
+		}
+
+		response.headers += m_response_headers;
+		response.cached_resource = std::move(m_cached_resource);
+		response.file = std::move(m_resource_fd);
+		response.ranges = std::move(m_ranges);
+		response.part_headers = std::move(m_part_headers);
+		response.content_length = m_content_length;
+
+		m_h2->respond(stream_id, std::move(response));
+
+		reset_response_state();
+	}
+
+	void h2_read()
+	{
+		std::size_t size = 0;
+		char *data = m_h2->receive_buffer(size);
+
+		m_h2_reading = true;
+		receive(data, size, &Service::on_h2_received);
+	}
+
+	void on_h2_received(const boost::system::error_code &ec,
+						std::size_t bytes_transferred)
+	{
+		m_h2_reading = false;
+
+		if (m_h2_closing)
+		{
+			h2_close();
+			return;
+		}
+
+		if (ec.value() != 0)
+		{
+			// A client closing its connection is not an
+			// error.
+			if (ec != asio::error::eof)
+			{
+				Log::error("read", ec, &m_peer);
+			}
+
+			h2_close();
+			return;
+		}
+
+		m_h2->received(bytes_transferred);
+		h2_process();
+	}
+
+	void h2_write()
+	{
+		if (!m_h2->prepare_output(m_h2_buffers))
+		{
+			return;
+		}
+
+		m_h2_writing = true;
+		write(BufferSequenceView(m_h2_buffers), &Service::on_h2_written);
+	}
+
+	void on_h2_written(const boost::system::error_code &ec,
+					   std::size_t /*bytes_transferred*/)
+	{
+		m_h2_writing = false;
+
+		if (m_h2_closing)
+		{
+			h2_close();
+			return;
+		}
+
+		if (ec.value() != 0)
+		{
+			Log::error("write", ec, &m_peer);
+
+			h2_close();
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+
+		for (const auto &completion : m_h2->output_written())
+		{
+			m_requests_served++;
+
+			Metrics::record(Metrics::Stage::write, now - completion.response_start);
+			Metrics::count_response(completion.status, completion.bytes);
+			Log::access(m_peer,
+						completion.method,
+						completion.path,
+						completion.status,
+						completion.bytes,
+						now - completion.start);
+		}
+
+		h2_process();
+	}
+
+	// Closes the connection once neither the read nor the
+	// write is in flight any more.
+	void h2_close()
+	{
+		if (!m_h2_closing)
+		{
+			m_h2_closing = true;
+
+			boost::system::error_code ignored_ec;
+			m_sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			m_sock.cancel(ignored_ec);
+
+			if (m_ring != nullptr)
+			{
+				m_ring->cancel(m_ring_read_op);
+				m_ring->cancel(m_ring_write_op);
+			}
+		}
+
+		// Handlers still to answer, and the file I/O pool,
+		// refer to us as well.
+		if (m_h2_reading || m_h2_writing || m_h2_warming || m_handlers_pending > 0)
+		{
+			return;
+		}
+
+		on_finish();
+	}
+
+	// Has the file I/O pool read in the part of a file that
+	// a stream waits for, one at a time.
+	void h2_warm_file()
+	{
+		int fd = -1;
+		std::uint64_t offset = 0;
+		std::size_t size = 0;
+
+		if (m_h2_warming || m_file_io == nullptr ||
+			!m_h2->file_wanted(fd, offset, size))
+		{
+			return;
+		}
+
+		// The stream, and with it the file, may be reset
+		// while the pool reads it.
+		m_file_read.file.reset(::dup(fd));
+		m_file_read.fd = m_file_read.file.get();
+		m_file_read.data = nullptr;
+		m_file_read.size = size;
+		m_file_read.offset = static_cast<off_t>(offset);
+		m_file_read.done = &Service::on_h2_file_warmed;
+		m_h2_warming = true;
+
+		if (!submit_file_read())
+		{
+			// Read on the loop after all.
+			asio::post(m_strand, [this]()
+					   { on_h2_file_warmed(0); });
+		}
+	}
+
+	void on_h2_file_warmed(int result)
+	{
+		m_h2_warming = false;
+		m_file_read.file.reset();
+
+		if (m_h2_closing)
+		{
+			h2_close();
+			return;
+		}
+
+		m_h2->file_warmed(result >= 0);
+		h2_process();
+	}
+
+	// Value of a header of the request being processed,
+	// over either protocol.
+	std::string_view request_header(std::string_view name) const
+	{
+		return m_request_view.header(name);
+	}
+
+	// Looks up the file at m_resource_file_path for the
+	// stream, which the handler has added headers to.
+	// Resources in the cache are served here and now.
+	// Returns false if the lookup has gone to the file I/O
+	// pool, or waits for another to load the file, the
+	// answer then following through on_file_looked_up().
+	bool serve_path(std::uint32_t stream_id, std::string &headers)
+	{
+		PendingLookup *pending = acquire_lookup();
+		pending->lookup.reset(m_resource_file_path, m_request_view);
+		m_resource_file_path.clear();
+
+		// Without a pool the lookup is run here in full.
+		if (pending->lookup.run_cached() ||
+			(m_file_io == nullptr && pending->lookup.run(resume_lookup(pending))))
+		{
+			m_response_headers += headers;
+			apply_lookup(pending->lookup);
+			release_lookup(pending);
+			return true;
+		}
+
+		pending->stream_id = stream_id;
+		pending->headers.assign(headers);
+		m_handlers_pending++;
+
+		if (m_file_io == nullptr)
+		{
+			// Another request is loading the file; the
+			// strand does not wait for it.
+			return false;
+		}
+
+		if (!submit_lookup(pending))
+		{
+			// Too many lookups waiting already.
+			m_handlers_pending--;
+			release_lookup(pending);
+			m_response_status_code = 503;
+			return true;
+		}
+
+		return false;
+	}
+
+	// A file being looked up for a stream, along with the
+	// headers its handler added. Kept for reuse by the
+	// connection, so that a lookup allocates nothing once
+	// warmed up.
+	struct PendingLookup
+	{
+		PendingLookup(const ServerConfig &config,
+					  ResourceCache &cache) : lookup(config, cache),
+											  stream_id(0)
+		{
+		}
+
+		FileLookup lookup;
+		std::uint32_t stream_id;
+		std::string headers;
+	};
+
+	PendingLookup *acquire_lookup()
+	{
+		if (m_free_lookups.empty())
+		{
+			m_lookups.push_back(std::make_unique<PendingLookup>(m_config, m_cache));
+			return m_lookups.back().get();
+		}
+
+		PendingLookup *pending = m_free_lookups.back();
+		m_free_lookups.pop_back();
+		return pending;
+	}
+
+	void release_lookup(PendingLookup *pending)
+	{
+		m_free_lookups.push_back(pending);
+	}
+
+	// Runs the lookup on the file I/O pool, the response
+	// carrying on back on the strand.
+	bool submit_lookup(PendingLookup *pending)
+	{
+		return m_file_io->submit([this, pending](bool cancelled)
+								 {
+									 if (cancelled)
+									 {
+										 // The server is stopping.
+										 pending->lookup.fail(503);
+									 }
+
+									 if (cancelled || pending->lookup.run(resume_lookup(pending)))
+									 {
+										 asio::post(m_strand, [this, pending]()
+													{ on_file_looked_up(pending); });
+									 }
+								 });
+	}
+
+	// Runs a lookup that waited for another to load the
+	// file again, where it ran before.
+	FileLookup::Resume resume_lookup(PendingLookup *pending)
+	{
+		return [this, pending]()
+		{
+			if (m_file_io == nullptr)
+			{
+				asio::post(m_strand, [this, pending]()
+						   {
+							   if (pending->lookup.run(resume_lookup(pending)))
+							   {
+								   on_file_looked_up(pending);
+							   }
+						   });
+			}
+			else if (!submit_lookup(pending))
+			{
+				asio::post(m_strand, [this, pending]()
+						   {
+							   pending->lookup.fail(503);
+							   on_file_looked_up(pending);
+						   });
+			}
+		};
+	}
+
+	void on_file_looked_up(PendingLookup *pending)
+	{
+		m_handlers_pending--;
+
+		if (m_h2)
+		{
+			if (m_h2_closing)
+			{
+				// h2_close() has been waiting for us.
+				release_lookup(pending);
+				h2_close();
+				return;
+			}
+
+			const Http2Request *request = m_h2->request(pending->stream_id);
+			if (request != nullptr)
+			{
+				m_request_view.reset(nullptr, request, request->method, request->path);
+				m_response_headers += pending->headers;
+				apply_lookup(pending->lookup);
+				h2_respond(pending->stream_id);
+			}
+
+			release_lookup(pending);
+			h2_process();
+			return;
+		}
+
+		m_response_headers += pending->headers;
+		apply_lookup(pending->lookup);
+		release_lookup(pending);
+		finish_request();
+	}
+
+	// Takes over what the lookup found, and picks the byte
+	// ranges to send of it.
+	void apply_lookup(FileLookup &lookup)
+	{
+		m_response_status_code = lookup.m_response_status_code;
+		m_vary = lookup.m_vary;
+		m_cached_resource = std::move(lookup.m_cached_resource);
+		m_resource_fd = std::move(lookup.m_resource_fd);
+		m_resource_size_bytes = lookup.m_resource_size_bytes;
+		m_content_encoding = lookup.m_content_encoding;
+
+		// What the lookup read into the page cache.
+		m_warm_begin = 0;
+		m_warm_end = lookup.m_warm_end;
+		// Swapped, so that both keep their memory.
+		m_etag.swap(lookup.m_etag);
+		m_last_modified.swap(lookup.m_last_modified);
+
+		if (m_response_status_code == 200)
+		{
+			select_ranges();
+		}
+	}
+
+	// Works out which part of the resource to send. A
+	// satisfiable Range header turns the response into a
+	// 206 carrying only the requested byte ranges, several
+	// of them as a multipart/byteranges body.
+	void select_ranges()
+	{
+		m_ranges.clear();
+		m_part_headers.clear();
+		m_range_index = 0;
+
+		std::string_view range_header = request_header("range");
+
+		// If-Range only lets the ranges through if the
+		// client's copy is still the current one.
+		std::string_view if_range = request_header("if-range");
+		if (!if_range.empty() && if_range != m_etag && if_range != m_last_modified)
+		{
+			range_header = std::string_view();
+		}
+
+		if (range_header.empty() ||
+			!parse_byte_ranges(range_header, m_resource_size_bytes, m_ranges))
+		{
+			// No (usable) Range header, send everything.
+			m_ranges.clear();
+			m_ranges.push_back(ByteRange{0, m_resource_size_bytes});
+			m_content_length = m_resource_size_bytes;
+
+			return;
+		}
+
+		if (m_ranges.empty())
+		{
+			// None of the ranges overlaps the resource.
+			m_response_status_code = 416;
+			m_response_headers += "content-range: bytes */";
+			append_uint(m_response_headers, m_resource_size_bytes);
+			m_response_headers += "\r\n";
+			m_cached_resource.reset();
+			m_resource_fd.reset();
+			m_content_length = 0;
+
+			return;
+		}
+
+		m_response_status_code = 206;
+
+		if (m_ranges.size() == 1)
+		{
+			m_response_headers += "content-range: ";
+			append_content_range(m_response_headers, m_ranges.front());
+			m_response_headers += "\r\n";
+			m_content_length = m_ranges.front().length;
+
+			return;
+		}
+
+		// Every part is preceded by its own boundary and
+		// headers, and the body ends with a final boundary.
+		m_response_headers += std::string("content-type: multipart/byteranges; boundary=") +
+							  MULTIPART_BOUNDARY +
+							  "\r\n";
+		m_content_length = 0;
+
+		for (const auto &range : m_ranges)
+		{
+			m_part_headers.emplace_back("\r\n--");
+
+			std::string &part = m_part_headers.back();
+			part.append(MULTIPART_BOUNDARY).append("\r\ncontent-range: ");
+			append_content_range(part, range);
+			part.append("\r\n\r\n");
+
+			m_content_length += part.size() + range.length;
+		}
+
+		m_part_headers.push_back(std::string("\r\n--") +
+								 MULTIPART_BOUNDARY +
+								 "--\r\n");
+		m_content_length += m_part_headers.back().size();
+	}
+
+	void append_content_range(std::string &out, const ByteRange &range) const
+	{
+		out += "bytes ";
+		append_uint(out, range.first);
+		out += '-';
+		append_uint(out, range.first + range.length - 1);
+		out += '/';
+		append_uint(out, m_resource_size_bytes);
+	}
+
+	// Parses the value of a Range header against a resource
+	// of the given size. Returns false if the header should
+	// be ignored, otherwise fills ranges with the ranges that
+	// can be satisfied, which leaves it empty if none can.
+	static bool parse_byte_ranges(std::string_view spec,
+								  std::uint64_t size,
+								  std::vector<ByteRange> &ranges)
+	{
+		ranges.clear();
+
+		if (spec.size() < 6 || !iequals(spec.substr(0, 6), "bytes="))
+		{
+			return false;
+		}
+		spec.remove_prefix(6);
+
+		std::size_t count = 0;
+
+		while (!spec.empty())
+		{
+			std::size_t comma = spec.find(',');
+			std::string_view item = trim(spec.substr(0, comma));
+			spec = comma == std::string_view::npos ? std::string_view()
+												   : spec.substr(comma + 1);
+
+			if (item.empty())
+			{
+				continue;
+			}
+
+			// Guard against requests for thousands of
+			// tiny ranges.
+			if (++count > MAX_RANGES)
+			{
+				return false;
+			}
+
+			std::size_t dash = item.find('-');
+			if (dash == std::string_view::npos)
+			{
+				return false;
+			}
+
+			std::string_view first_str = trim(item.substr(0, dash));
+			std::string_view last_str = trim(item.substr(dash + 1));
+			std::uint64_t first = 0, last = 0;
+
+			if (first_str.empty())
+			{
+				// Suffix range: the last N bytes.
+				if (!parse_uint(last_str, last))
+				{
+					return false;
+				}
+
+				if (last == 0 || size == 0)
+				{
+					continue;
+				}
+
+				first = size > last ? size - last : 0;
+				last = size - 1;
+			}
+			else
+			{
+				if (!parse_uint(first_str, first))
+				{
+					return false;
+				}
+
+				if (last_str.empty())
+				{
+					last = size - 1;
+				}
+				else if (!parse_uint(last_str, last) || last < first)
+				{
+					return false;
+				}
+
+				if (first >= size)
+				{
+					continue;
+				}
+
+				last = std::min(last, size - 1);
+			}
+
+			ranges.push_back(ByteRange{first, last - first + 1});
+		}
+
+		return count > 0;
+	}
+
+	static bool parse_uint(std::string_view str, std::uint64_t &value)
+	{
+		auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+		return !str.empty() &&
+			   result.ec == std::errc() &&
+			   result.ptr == str.data() + str.size();
+	}
+
+	// Status line of every status the server sends,
+	// formatted at compile time; empty for any other status.
+	static constexpr std::string_view known_status_line(unsigned int status_code)
+	{
+		switch (status_code)
+		{
+		case 200:
+			return "HTTP/1.1 200 OK\r\n";
+		case 201:
+			return "HTTP/1.1 201 Created\r\n";
+		case 202:
+			return "HTTP/1.1 202 Accepted\r\n";
+		case 204:
+			return "HTTP/1.1 204 No Content\r\n";
+		case 206:
+			return "HTTP/1.1 206 Partial Content\r\n";
+		case 301:
+			return "HTTP/1.1 301 Moved Permanently\r\n";
+		case 302:
+			return "HTTP/1.1 302 Found\r\n";
+		case 304:
+			return "HTTP/1.1 304 Not Modified\r\n";
+		case 307:
+			return "HTTP/1.1 307 Temporary Redirect\r\n";
+		case 400:
+			return "HTTP/1.1 400 Bad Request\r\n";
+		case 401:
+			return "HTTP/1.1 401 Unauthorized\r\n";
+		case 403:
+			return "HTTP/1.1 403 Forbidden\r\n";
+		case 404:
+			return "HTTP/1.1 404 Not Found\r\n";
+		case 409:
+			return "HTTP/1.1 409 Conflict\r\n";
+		case 413:
+			return "HTTP/1.1 413 Request Entity Too Large\r\n";
+		case 416:
+			return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+		case 429:
+			return "HTTP/1.1 429 Too Many Requests\r\n";
+		case 431:
+			return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+		case 500:
+			return "HTTP/1.1 500 Server Error\r\n";
+		case 501:
+			return "HTTP/1.1 501 Not Implemented\r\n";
+		case 503:
+			return "HTTP/1.1 503 Service Unavailable\r\n";
+		case 505:
+			return "HTTP/1.1 505 HTTP Version Not Supported\r\n";
+		default:
+			return std::string_view();
+		}
+	}
+
+	static constexpr bool known_status(unsigned int status_code)
+	{
+		return !known_status_line(status_code).empty();
+	}
+
+	// Status line to send, a 500 for unknown statuses.
+	static constexpr std::string_view status_line(unsigned int status_code)
+	{
+		return known_status(status_code) ? known_status_line(status_code)
+										 : known_status_line(500);
+	}
+
+	void send_response()
+	{
+		m_response_start = std::chrono::steady_clock::now();
+		arm_deadline(m_config.response_write_timeout);
+
+		if (!m_keep_alive)
+		{
+			// The socket may already have been closed by
+			// a deadline; the write will report that.
+			system::error_code ignored_ec;
+			m_sock.shutdown(
+				asio::ip::tcp::socket::shutdown_receive, ignored_ec);
+
+			m_response_headers += "connection: close\r\n";
+		}
+
+		// Cached resources carry their own headers, which
+		// only fit a response with the whole resource.
+		bool whole_cached_resource =
+			m_cached_resource && m_response_status_code == 200;
+
+		append_response_headers(whole_cached_resource);
+
+		// The whole head goes out of one buffer, kept from one
+		// response to the next: the status line and the
+		// common headers are copied preformatted, and the
+		// headers of a cached resource in a single block.
+		std::string &head = m_response_head;
+		head.clear();
+		head.append(status_line(m_response_status_code))
+			.append(date_header())
+			.append(SERVER_HEADER);
+
+		if (whole_cached_resource)
+		{
+			head.append(m_cached_resource->headers);
+		}
+
+		head.append(m_response_headers).append("\r\n");
+
+		m_response_head_bytes = head.size();
+
+		// Reused from one response to the next, and handed
+		// to the write operations by reference.
+		auto &response_buffers = m_response_buffers;
+		response_buffers.clear();
+		response_buffers.push_back(asio::buffer(head));
+
+		if (m_resource_fd.is_open())
+		{
+			// Hold back partial frames until the body
+			// follows the headers, so that small responses
+			// still leave in as few segments as possible.
+			set_tcp_cork(true);
+
+			write(BufferSequenceView(response_buffers), &Service::on_headers_sent);
+			return;
+		}
+
+		if (m_cached_resource)
+		{
+			// The requested ranges are sent straight out
+			// of the cached body, interleaved with the
+			// multipart boundaries if there are any.
+			for (std::size_t i = 0; i < m_ranges.size(); i++)
+			{
+				if (!m_part_headers.empty())
+				{
+					response_buffers.push_back(
+						asio::buffer(m_part_headers[i]));
+				}
+
+				response_buffers.push_back(
+					asio::buffer(m_cached_resource->data() + m_ranges[i].first,
+								 m_ranges[i].length));
+			}
+
+			if (!m_part_headers.empty())
+			{
+				response_buffers.push_back(
+					asio::buffer(m_part_headers.back()));
+			}
+		}
+
+		// Initiate asynchronous write operation.
+		write(BufferSequenceView(response_buffers), &Service::on_response_sent);
+	}
+
+	// Headers describing the body, the same over HTTP/1.1
+	// and HTTP/2.
+	void append_response_headers(bool whole_cached_resource)
+	{
+		// Validators and encoding of the resource, unless
+		// already part of the cached headers.
+		if (!m_etag.empty() && !whole_cached_resource)
+		{
+			m_response_headers.append("etag: ").append(m_etag).append("\r\n");
+			m_response_headers.append("last-modified: ").append(m_last_modified).append("\r\n");
+
+			if (m_content_encoding != ContentEncoding::identity &&
+				m_response_status_code != 304)
+			{
+				m_response_headers.append("content-encoding: ")
+					.append(encoding_name(m_content_encoding))
+					.append("\r\n");
+			}
+
+			if (m_vary)
+			{
+				m_response_headers += "vary: accept-encoding\r\n";
+			}
+		}
+
+		// The client relies on the length to find the end
+		// of the response on a persistent connection. A 304
+		// or a 204 has no body and no length of its own.
+		if (!whole_cached_resource &&
+			m_response_status_code != 304 &&
+			m_response_status_code != 204)
+		{
+			m_response_headers += "content-length: ";
+			append_uint(m_response_headers, m_content_length);
+			m_response_headers += "\r\n";
+		}
+
+		if (m_response_status_code == 200 && !whole_cached_resource)
+		{
+			m_response_headers += "accept-ranges: bytes\r\n";
+		}
+	}
+
+	typedef void (Service::*IoHandler)(const boost::system::error_code &,
+									   std::size_t);
+
+	// Reads what the socket has, at most size bytes, then
+	// calls back with the number of bytes read.
+	void receive(char *data, std::size_t size, IoHandler on_received)
+	{
+		if (m_ring != nullptr)
+		{
+			m_ring_on_received = on_received;
+			m_ring->recv(m_sock.native_handle(), data, size, m_ring_read_op);
+			return;
+		}
+
+		m_sock.async_read_some(
+			asio::buffer(data, size),
+			strand_handler([this, on_received](
+							   const boost::system::error_code &ec,
+							   std::size_t bytes_transferred)
+						   {
+							   (this->*on_received)(ec,
+													bytes_transferred);
+						   }));
+	}
+
+	// Writes all of the buffers to the socket, then calls
+	// back with the number of bytes written.
+	template <typename ConstBufferSequence>
+	void write(const ConstBufferSequence &buffers, IoHandler on_written)
+	{
+		if (m_ring == nullptr)
+		{
+			asio::async_write(m_sock,
+							  buffers,
+							  strand_handler([this, on_written](
+												 const boost::system::error_code &ec,
+												 std::size_t bytes_transferred)
+											 {
+												 (this->*on_written)(ec,
+																	 bytes_transferred);
+											 }));
+			return;
+		}
+
+		m_ring_iovecs.clear();
+
+		for (auto it = asio::buffer_sequence_begin(buffers);
+			 it != asio::buffer_sequence_end(buffers);
+			 ++it)
+		{
+			asio::const_buffer buffer(*it);
+
+			if (buffer.size() > 0)
+			{
+				iovec iov;
+				iov.iov_base = const_cast<void *>(buffer.data());
+				iov.iov_len = buffer.size();
+				m_ring_iovecs.push_back(iov);
+			}
+		}
+
+		m_ring_iovec_index = 0;
+		m_ring_written = 0;
+		m_ring_on_written = on_written;
+
+		send_iovecs();
+	}
+
+	// Sends what is left of m_ring_iovecs through the ring.
+	void send_iovecs()
+	{
+		if (m_ring_iovec_index == m_ring_iovecs.size())
+		{
+			asio::post(strand_handler([this]()
+									  { (this->*m_ring_on_written)(boost::system::error_code(),
+																   m_ring_written); }));
+			return;
+		}
+
+		std::memset(&m_ring_message, 0, sizeof(m_ring_message));
+		m_ring_message.msg_iov = &m_ring_iovecs[m_ring_iovec_index];
+		m_ring_message.msg_iovlen = m_ring_iovecs.size() - m_ring_iovec_index;
+
+		m_ring->sendmsg(m_sock.native_handle(), &m_ring_message, m_ring_write_op);
+	}
+
+	void on_ring_received(int result)
+	{
+		boost::system::error_code ec;
+		if (result < 0)
+		{
+			ec = boost::system::error_code(-result, boost::system::system_category());
+		}
+		else if (result == 0)
+		{
+			ec = asio::error::eof;
+		}
+
+		(this->*m_ring_on_received)(ec, result > 0 ? static_cast<std::size_t>(result) : 0);
+	}
+
+	void on_ring_sent(int result)
+	{
+		boost::system::error_code ec;
+		if (result < 0)
+		{
+			ec = boost::system::error_code(-result, boost::system::system_category());
+		}
+		else if (result == 0)
+		{
+			ec = asio::error::eof;
+		}
+
+		if (ec.value() != 0)
+		{
+			(this->*m_ring_on_written)(ec, m_ring_written);
+			return;
+		}
+
+		// Skip what has been sent, which may end in the
+		// middle of a buffer.
+		std::size_t sent = static_cast<std::size_t>(result);
+		m_ring_written += sent;
+
+		while (sent > 0)
+		{
+			iovec &iov = m_ring_iovecs[m_ring_iovec_index];
+
+			if (sent < iov.iov_len)
+			{
+				iov.iov_base = static_cast<char *>(iov.iov_base) + sent;
+				iov.iov_len -= sent;
+				break;
+			}
+
+			sent -= iov.iov_len;
+			m_ring_iovec_index++;
+		}
+
+		send_iovecs();
+	}
+
+	void on_headers_sent(const boost::system::error_code &ec,
+						 std::size_t bytes_transferred)
+	{
+		if (ec.value() != 0)
+		{
+			on_response_sent(ec, bytes_transferred);
+			return;
+		}
+
+		send_next_range();
+	}
+
+	// Sends the file body one byte range at a time. Only
+	// the requested ranges are ever read from the file.
+	void send_next_range()
+	{
+		bool multipart = !m_part_headers.empty();
+
+		if (m_range_index == m_ranges.size() && !multipart)
+		{
+			set_tcp_cork(false);
+			on_response_sent(boost::system::error_code(), m_content_length);
+			return;
+		}
+
+		if (m_range_index < m_ranges.size())
+		{
+			m_resource_offset = static_cast<off_t>(m_ranges[m_range_index].first);
+			m_resource_end = m_resource_offset +
+							 static_cast<off_t>(m_ranges[m_range_index].length);
+		}
+
+		if (!multipart)
+		{
+			send_range_body();
+			return;
+		}
+
+		// Boundary and headers of the next part, or the
+		// closing boundary after the last one.
+		write(asio::buffer(m_part_headers[m_range_index]), &Service::on_part_headers_sent);
+	}
+
+	void on_part_headers_sent(const boost::system::error_code &ec,
+							  std::size_t bytes_transferred)
+	{
+		if (ec.value() != 0)
+		{
+			on_response_sent(ec, bytes_transferred);
+			return;
+		}
+
+		if (m_range_index == m_ranges.size())
+		{
+			set_tcp_cork(false);
+			on_response_sent(ec, m_content_length);
+			return;
+		}
+
+		send_range_body();
+	}
+
+	void send_range_body()
+	{
+		if (m_config.use_sendfile)
+		{
+			send_file_body();
+		}
+		else
+		{
+			stream_file_body();
+		}
+	}
+
+	void on_range_sent()
+	{
+		m_range_index++;
+		send_next_range();
+	}
+
+	// Pushes the current byte range of the file to the
+	// socket with sendfile(2). Whenever the socket buffer
+	// is full we wait for the socket to become writable
+	// again and carry on.
+	void send_file_body()
+	{
+		// Bytes sent per handler invocation before yielding
+		// the thread to other connections.
+		static const std::size_t MAX_BYTES_PER_TURN = 4 * 1024 * 1024;
+
+		if (!m_sock.is_open())
+		{
+			// Closed by an expired deadline while we were
+			// waiting for our turn.
+			on_response_sent(asio::error::operation_aborted, 0);
+			return;
+		}
+
+		// Every call follows some progress, or the socket
+		// becoming writable again.
+		arm_deadline(m_config.response_write_timeout);
+
+		if (!m_sock.native_non_blocking())
+		{
+			m_sock.native_non_blocking(true);
+		}
+
+		std::size_t sent_this_turn = 0;
+
+		while (m_resource_offset < m_resource_end)
+		{
+			if (sent_this_turn >= MAX_BYTES_PER_TURN)
+			{
+				asio::post(strand_handler([this]()
+										  { send_file_body(); }));
+				return;
+			}
+
+			// Past what has been read ahead, the file I/O
+			// pool reads the next stretch into the page cache
+			// first, so that sendfile(2) does not wait for the
+			// disk.
+			if ((m_resource_offset < m_warm_begin || m_resource_offset >= m_warm_end) &&
+				warm_file_body(MAX_BYTES_PER_TURN))
+			{
+				return;
+			}
+
+			std::size_t remaining =
+				static_cast<std::size_t>(std::min(m_resource_end, m_warm_end) - m_resource_offset);
+
+			ssize_t n = ::sendfile(m_sock.native_handle(),
+								   m_resource_fd.get(),
+								   &m_resource_offset,
+								   remaining);
+			if (n > 0)
+			{
+				sent_this_turn += static_cast<std::size_t>(n);
+				continue;
+			}
+
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				m_sock.async_wait(asio::ip::tcp::socket::wait_write,
+								   strand_handler([this](const boost::system::error_code &ec)
+												  {
+													  if (ec.value() != 0)
+													  {
+														  on_response_sent(ec, 0);
+														  return;
+													  }
+
+													  send_file_body();
+												  }));
+				return;
+			}
+
+			// Either a real error or the file has been
+			// truncated under us. The promised content
+			// length cannot be honored, so give up on
+			// the connection.
+			m_keep_alive = false;
+			on_response_sent(n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+								   : boost::system::error_code(asio::error::eof),
+							 0);
+			return;
+		}
+
+		on_range_sent();
+	}
+
+	// Has the file I/O pool read the body from the current
+	// offset on into the page cache, send_file_body() then
+	// carrying on. Returns false if sendfile(2) is to read
+	// it itself, without a pool or with a full one.
+	bool warm_file_body(std::size_t default_window)
+	{
+		std::size_t window = m_config.file_readahead_bytes > 0 ? m_config.file_readahead_bytes
+															   : default_window;
+		m_warm_begin = m_resource_offset;
+		m_warm_end = m_file_io == nullptr
+						 ? m_resource_end
+						 : std::min<off_t>(m_resource_end, m_resource_offset + static_cast<off_t>(window));
+
+		if (m_file_io == nullptr)
+		{
+			return false;
+		}
+
+		m_file_read.fd = m_resource_fd.get();
+		m_file_read.data = nullptr;
+		m_file_read.size = static_cast<std::size_t>(m_warm_end - m_warm_begin);
+		m_file_read.offset = m_warm_begin;
+		m_file_read.done = &Service::on_file_body_warmed;
+
+		return submit_file_read();
+	}
+
+	void on_file_body_warmed(int result)
+	{
+		if (result < 0)
+		{
+			// The promised content length cannot be
+			// honored, so give up on the connection.
+			m_keep_alive = false;
+			on_response_sent(boost::system::error_code(-result, boost::system::system_category()), 0);
+			return;
+		}
+
+		send_file_body();
+	}
+
+	// Reads, or with no data warms, what m_file_read
+	// describes on the file I/O pool. Its done handler is
+	// called on the strand with the number of bytes read,
+	// or minus errno. Returns false if the pool takes no
+	// more jobs.
+	bool submit_file_read()
+	{
+		return m_file_io->submit([this](bool cancelled)
+								 {
+									 FileRead &read = m_file_read;
+
+									 if (cancelled)
+									 {
+										 read.result = -ECANCELED;
+									 }
+									 else if (read.data == nullptr)
+									 {
+										 read.result = warm_file(read.fd, read.offset, read.size) ? 0 : -errno;
+									 }
+									 else
+									 {
+										 ssize_t n;
+										 do
+										 {
+											 n = ::pread(read.fd, read.data, read.size, read.offset);
+										 } while (n < 0 && errno == EINTR);
+
+										 read.result = n < 0 ? -errno : static_cast<int>(n);
+									 }
+
+									 asio::post(m_strand, [this]()
+												{ (this->*m_file_read.done)(m_file_read.result); });
+								 });
+	}
+
+	// Sends the current byte range of the file through a
+	// pair of fixed size buffers: while one is being written
+	// to the socket the next chunk is read into the other.
+	// Memory per connection never exceeds
+	// max_stream_buffer_bytes, however large the file is.
+	void stream_file_body()
+	{
+		m_stream_chunk_size = std::max<std::size_t>(m_config.max_stream_buffer_bytes / 2, 1);
+
+		if (m_stream_base == nullptr && m_ring != nullptr)
+		{
+			// Borrowed for the rest of the response.
+			m_registered_buffer = m_ring->acquire_buffer();
+			m_stream_base = m_registered_buffer;
+		}
+
+		if (m_stream_base == nullptr)
+		{
+			if (!m_stream_buffers)
+			{
+				// Allocated once and reused for every
+				// request on this connection.
+				m_stream_buffers.reset(new char[2 * m_stream_chunk_size]);
+			}
+
+			m_stream_base = m_stream_buffers.get();
+		}
+
+		m_stream_current = 0;
+		m_stream_error = boost::system::error_code();
+
+		if (async_chunk_reads())
+		{
+			// The first chunk has to be read before
+			// anything can be written.
+			m_stream_write_error = boost::system::error_code();
+			m_stream_pending = 1;
+			read_chunk_async();
+			return;
+		}
+
+		m_stream_ready = read_chunk(m_stream_current);
+
+		if (m_stream_error)
+		{
+			m_keep_alive = false;
+			on_response_sent(m_stream_error, 0);
+			return;
+		}
+
+		if (m_stream_ready == 0)
+		{
+			on_range_sent();
+			return;
+		}
+
+		write_next_chunk();
+	}
+
+	void write_next_chunk()
+	{
+		arm_deadline(m_config.response_write_timeout);
+
+		if (async_chunk_reads())
+		{
+			m_stream_pending = 2;
+		}
+
+		write(asio::buffer(m_stream_base + m_stream_current * m_stream_chunk_size,
+						   m_stream_ready),
+			  &Service::on_chunk_sent);
+
+		// Fill the other buffer while the write is in
+		// flight. Its handler runs on our strand, so it
+		// cannot observe the buffers before we are done.
+		// On the ring or the file I/O pool the read goes on
+		// along with the write, and whichever completes last
+		// carries on.
+		m_stream_current ^= 1;
+
+		if (async_chunk_reads())
+		{
+			read_chunk_async();
+			return;
+		}
+
+		m_stream_ready = read_chunk(m_stream_current);
+	}
+
+	void on_chunk_sent(const boost::system::error_code &ec,
+					   std::size_t bytes_transferred)
+	{
+		if (async_chunk_reads())
+		{
+			m_stream_write_error = ec;
+			on_stream_step_done();
+			return;
+		}
+
+		if (ec.value() != 0)
+		{
+			on_response_sent(ec, bytes_transferred);
+			return;
+		}
+
+		if (m_stream_error)
+		{
+			// The promised content length cannot be
+			// honored, so give up on the connection.
+			m_keep_alive = false;
+			on_response_sent(m_stream_error, 0);
+			return;
+		}
+
+		if (m_stream_ready == 0)
+		{
+			on_range_sent();
+			return;
+		}
+
+		write_next_chunk();
+	}
+
+	// Reads the next chunk of the current byte range into
+	// the given buffer and returns its length, zero once
+	// the whole range has been read. Failures and files
+	// shrinking under us are reported through m_stream_error.
+	std::size_t read_chunk(unsigned int buffer_index)
+	{
+		char *buffer = m_stream_base + buffer_index * m_stream_chunk_size;
+
+		std::size_t remaining =
+			static_cast<std::size_t>(m_resource_end - m_resource_offset);
+		std::size_t length = std::min(remaining, m_stream_chunk_size);
+		std::size_t filled = 0;
+
+		while (filled < length)
+		{
+			ssize_t n = ::pread(m_resource_fd.get(),
+								buffer + filled,
+								length - filled,
+								m_resource_offset);
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (n <= 0)
+			{
+				m_stream_error = n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+									   : boost::system::error_code(asio::error::eof);
+				return 0;
+			}
+
+			filled += static_cast<std::size_t>(n);
+			m_resource_offset += n;
+		}
+
+		return filled;
+	}
+
+	// Whether chunks are read by read_chunk_async(), rather
+	// than read_chunk() on the event loop.
+	bool async_chunk_reads() const
+	{
+		return m_ring != nullptr || m_file_io != nullptr;
+	}
+
+	// Reads the next chunk of the current byte range into
+	// the current buffer, through the ring or the file I/O
+	// pool. m_stream_ready counts what has arrived so far.
+	void read_chunk_async()
+	{
+		std::size_t remaining =
+			static_cast<std::size_t>(m_resource_end - m_resource_offset);
+
+		m_stream_wanted = std::min(remaining, m_stream_chunk_size);
+		m_stream_ready = 0;
+
+		if (m_stream_wanted == 0)
+		{
+			on_stream_step_done();
+			return;
+		}
+
+		read_chunk_rest();
+	}
+
+	// Reads what is still missing of the current chunk.
+	// What is in the page cache is read at once, the rest
+	// on the pool. Completes through on_chunk_read(), which
+	// may be called before this returns.
+	void read_chunk_rest()
+	{
+		char *data = m_stream_base + m_stream_current * m_stream_chunk_size + m_stream_ready;
+		std::size_t size = m_stream_wanted - m_stream_ready;
+
+		if (m_ring != nullptr)
+		{
+			m_ring->read(m_resource_fd.get(), data, size, m_resource_offset, m_ring_file_op);
+			return;
+		}
+
+		ssize_t n = read_cached(m_resource_fd.get(), data, size, m_resource_offset);
+
+		if (n < 0 && errno == EAGAIN)
+		{
+			m_file_read.fd = m_resource_fd.get();
+			m_file_read.data = data;
+			m_file_read.size = size;
+			m_file_read.offset = m_resource_offset;
+			m_file_read.done = &Service::on_chunk_read;
+
+			if (submit_file_read())
+			{
+				return;
+			}
+
+			// The pool is full; read it here after all.
+			do
+			{
+				n = ::pread(m_resource_fd.get(), data, size, m_resource_offset);
+			} while (n < 0 && errno == EINTR);
+		}
+
+		on_chunk_read(n < 0 ? -errno : static_cast<int>(n));
+	}
+
+	void on_chunk_read(int result)
+	{
+		if (result <= 0)
+		{
+			m_stream_error = result < 0 ? boost::system::error_code(-result, boost::system::system_category())
+										: boost::system::error_code(asio::error::eof);
+			m_stream_ready = 0;
+			on_stream_step_done();
+			return;
+		}
+
+		m_stream_ready += static_cast<std::size_t>(result);
+		m_resource_offset += result;
+
+		if (m_stream_ready < m_stream_wanted)
+		{
+			read_chunk_rest();
+			return;
+		}
+
+		on_stream_step_done();
+	}
+
+	// Called as the write of a chunk and the read of the
+	// next one complete; the stream carries on once neither
+	// is pending.
+	void on_stream_step_done()
+	{
+		if (--m_stream_pending > 0)
+		{
+			return;
+		}
+
+		if (m_stream_write_error)
+		{
+			on_response_sent(m_stream_write_error, 0);
+			return;
+		}
+
+		if (m_stream_error)
+		{
+			// The promised content length cannot be
+			// honored, so give up on the connection.
+			m_keep_alive = false;
+			on_response_sent(m_stream_error, 0);
+			return;
+		}
+
+		if (m_stream_ready == 0)
+		{
+			on_range_sent();
+			return;
+		}
+
+		write_next_chunk();
+	}
+
+	void set_tcp_cork(bool enabled)
+	{
+		int value = enabled ? 1 : 0;
+		::setsockopt(m_sock.native_handle(), IPPROTO_TCP, TCP_CORK,
+					 &value, sizeof(value));
+	}
+
+	void on_response_sent(const boost::system::error_code &ec,
+						  std::size_t bytes_transferred)
+	{
+		if (ec.value() != 0)
+		{
+			Log::error("write", ec, &m_peer);
+
+			on_finish();
+			return;
+		}
+
+		m_requests_served++;
+
+		Metrics::record(Metrics::Stage::write,
+						std::chrono::steady_clock::now() - m_response_start);
+		Metrics::count_response(m_response_status_code,
+								m_response_head_bytes + m_content_length);
+		Log::access(m_peer,
+					m_parser.method(),
+					m_parser.target(),
+					m_response_status_code,
+					m_response_head_bytes + m_content_length,
+					std::chrono::steady_clock::now() - m_request_start);
+
+		// A response already under way when the server
+		// started draining is the connection's last.
+		if (m_keep_alive && !m_limiter.draining())
+		{
+			// Keep the connection open and wait for
+			// the next request on it.
+			reset_request_state();
+			start_handling();
+			return;
+		}
+
+		boost::system::error_code ignored_ec;
+		m_sock.shutdown(asio::ip::tcp::socket::shutdown_both,
+						 ignored_ec);
+
+		on_finish();
+	}
+
+	// Forget everything about the previous request
+	// before reading the next one on this connection.
+	void reset_request_state()
+	{
+		// Move a pipelined request to the front of the
+		// buffer; the parser restarts at its first byte.
+		std::size_t consumed = m_parser.consumed();
+		std::memmove(m_request_buffer.data(),
+					 m_request_buffer.data() + consumed,
+					 m_request_bytes - consumed);
+		m_request_bytes -= consumed;
+		m_parser.reset();
+
+		reset_response_state();
+		m_request_line_timed = false;
+	}
+
+	// Forget everything about the previous response, which
+	// over HTTP/2 may be followed by others on the same
+	// connection before anything is sent.
+	void reset_response_state()
+	{
+		m_resource_file_path.clear();
+		m_etag.clear();
+		m_last_modified.clear();
+		m_content_encoding = ContentEncoding::identity;
+		m_vary = false;
+		m_cached_resource.reset();
+		m_resource_fd.reset();
+
+		if (m_registered_buffer != nullptr)
+		{
+			m_ring->release_buffer(m_registered_buffer);
+			m_registered_buffer = nullptr;
+		}
+
+		m_stream_base = nullptr;
+		m_resource_offset = 0;
+		m_resource_end = 0;
+		m_ranges.clear();
+		m_part_headers.clear();
+		m_range_index = 0;
+		m_content_length = 0;
+		m_response_status_code = 200;
+		m_resource_size_bytes = 0;
+		m_response_headers.clear();
+		m_response_head.clear();
+		m_response_head_bytes = 0;
+	}
+
+	// Each phase of reading a request has its own deadline,
+	// counted from the start of the phase rather than from
+	// the last read, so that trickling bytes does not help.
+	void enter_read_phase(ReadPhase phase)
+	{
+		m_read_phase = phase;
+
+		switch (phase)
+		{
+		case ReadPhase::idle:
+			arm_deadline(m_config.keep_alive_idle_timeout);
+			break;
+		case ReadPhase::request_line:
+			arm_deadline(m_config.request_line_timeout);
+			break;
+		case ReadPhase::headers:
+			arm_deadline(m_config.request_headers_timeout);
+			break;
+		}
+	}
+
+	void arm_deadline(std::chrono::milliseconds timeout)
+	{
+		// Fails once the deadline has expired, and then
+		// the connection is about to be closed anyway.
+		m_wheel.arm(m_deadline, timeout);
+	}
+
+	void on_deadline_expired()
+	{
+		m_timed_out = true;
+
+		if (m_finishing)
+		{
+			// on_finish() has been waiting for us.
+			recycle();
+			return;
+		}
+
+		// The ring holds on to the socket of an operation
+		// in flight, so closing it is not enough there.
+		if (m_ring != nullptr)
+		{
+			m_ring->cancel(m_ring_read_op);
+			m_ring->cancel(m_ring_write_op);
+		}
+
+		// Closing the socket aborts the pending operation,
+		// whose handler then cleans up.
+		boost::system::error_code ignored_ec;
+		m_sock.close(ignored_ec);
+	}
+
+	// Here we perform the cleanup.
+	void on_finish()
+	{
+		if (!m_wheel.cancel(m_deadline) && !m_timed_out)
+		{
+			// The deadline has just expired. Wait for its
+			// handler to run before reusing the object it
+			// refers to.
+			m_finishing = true;
+			return;
+		}
+
+		recycle();
+	}
+
+	// Returns the object to the pool, in the state of a
+	// freshly constructed one but with its buffers kept.
+	void recycle()
+	{
+		boost::system::error_code ignored_ec;
+		m_sock.close(ignored_ec);
+
+		m_request_bytes = 0;
+		m_parser.reset();
+		reset_request_state();
+
+		m_h2.reset();
+		m_h2_buffers.clear();
+		m_h2_reading = false;
+		m_h2_writing = false;
+		m_h2_closing = false;
+		m_h2_warming = false;
+
+		m_requests_served = 0;
+		m_keep_alive = true;
+		m_wheel.reset(m_deadline);
+		m_read_phase = ReadPhase::request_line;
+		m_timed_out = false;
+		m_finishing = false;
+
+		// Only used without sendfile, and too large to
+		// keep around on idle objects.
+		m_stream_buffers.reset();
+
+		// The connection no longer counts against the
+		// limit; this may resume a paused acceptor.
+		m_limiter.release();
+		m_limiter.connection_closed();
+		Metrics::connection_closed();
+
+		ServicePool::release(this, m_config.service_pool_size);
+	}
+
+	template <typename Handler>
+	asio::executor_binder<CustomAllocHandler<Handler>,
+						  asio::strand<asio::io_service::executor_type>>
+	strand_handler(Handler handler)
+	{
+		return asio::bind_executor(m_strand,
+								   make_custom_alloc_handler(m_handler_memory,
+															 std::move(handler)));
+	}
+
+private:
+	asio::ip::tcp::socket m_sock;
+	asio::ip::tcp::endpoint m_peer;
+	const ServerConfig &m_config;
+	ResourceCache &m_cache;
+	ConnectionLimiter &m_limiter;
+	const Router &m_router;
+
+	// Where file lookups go, or nullptr to do them here.
+	FileIoPool *m_file_io;
+
+	// Lookup state owned by the connection, and that not in
+	// use by a lookup under way.
+	std::vector<std::unique_ptr<PendingLookup>> m_lookups;
+	std::vector<PendingLookup *> m_free_lookups;
+
+	// The ring of the event loop, if it has one, and the
+	// operations this connection may have in flight on it:
+	// a read and a write on the socket, which only overlap
+	// over HTTP/2, and one reading a streamed file.
+	IoUring *m_ring;
+	IoUring::Operation m_ring_read_op;
+	IoUring::Operation m_ring_write_op;
+	IoUring::Operation m_ring_file_op;
+	IoHandler m_ring_on_received;
+
+	// What remains of a write on the ring.
+	std::vector<iovec> m_ring_iovecs;
+	std::size_t m_ring_iovec_index;
+	msghdr m_ring_message;
+	std::size_t m_ring_written;
+	IoHandler m_ring_on_written;
+
+	// Serializes the handlers of this connection, since the
+	// deadline may expire on another thread of the pool.
+	asio::strand<asio::io_service::executor_type> m_strand;
+	HandlerMemory m_handler_memory;
+
+	// Deadline of the current phase of the connection.
+	TimingWheel &m_wheel;
+	TimingWheel::Timer m_deadline;
+	ReadPhase m_read_phase;
+	bool m_timed_out;
+	bool m_finishing;
+
+	// Raw bytes of the request head being received, plus
+	// whatever part of a pipelined request follows it.
+	std::array<char, 4096> m_request_buffer;
+	std::size_t m_request_bytes;
+	HttpRequestParser m_parser;
+	RequestView m_request_view;
+	std::string m_resource_file_path;
+
+	// Handlers yet to answer, and whether the one being
+	// called has answered before returning.
+	unsigned int m_handlers_pending;
+	bool m_in_handler;
+	bool m_handler_answered;
+
+	// Start of the stages timed for the metrics.
+	std::chrono::steady_clock::time_point m_request_start;
+	std::chrono::steady_clock::time_point m_request_line_at;
+	std::chrono::steady_clock::time_point m_headers_at;
+	std::chrono::steady_clock::time_point m_response_start;
+	bool m_request_line_timed;
+	std::size_t m_response_head_bytes;
+	std::vector<asio::const_buffer> m_response_buffers;
+
+	// Validators of the requested resource.
+	std::string m_etag;
+	std::string m_last_modified;
+
+	// Encoding of the body, and whether it depends on
+	// the client's Accept-Encoding.
+	ContentEncoding m_content_encoding;
+	bool m_vary;
+
+	unsigned int m_requests_served;
+	bool m_keep_alive;
+
+	std::shared_ptr<const CachedResource> m_cached_resource;
+	FileDescriptor m_resource_fd;
+	off_t m_resource_offset;
+	off_t m_resource_end;
+
+	// Byte ranges making up the response body, and for
+	// multipart bodies the boundary and headers preceding
+	// each of them followed by the closing boundary.
+	std::vector<ByteRange> m_ranges;
+	std::vector<std::string> m_part_headers;
+	std::size_t m_range_index;
+	std::size_t m_content_length;
+
+	// Double buffer used by stream_file_body(), either a
+	// registered buffer borrowed from the ring or our own.
+	std::unique_ptr<char[]> m_stream_buffers;
+	char *m_stream_base;
+	char *m_registered_buffer;
+	std::size_t m_stream_chunk_size;
+	unsigned int m_stream_current;
+	std::size_t m_stream_ready;
+	boost::system::error_code m_stream_error;
+
+	// Progress of the chunk being read on the ring or the
+	// file I/O pool, and how many of the read and the write
+	// are in flight.
+	std::size_t m_stream_wanted;
+	unsigned int m_stream_pending;
+	boost::system::error_code m_stream_write_error;
+
+	// What of the file sendfile(2) can send without waiting
+	// for the disk: what has been read ahead, or read in by
+	// the file I/O pool.
+	off_t m_warm_begin;
+	off_t m_warm_end;
+
+	// A read of a body file on the file I/O pool, of which
+	// a connection has at most one under way. Without data
+	// the file is only read into the page cache. file holds
+	// a duplicate of fd when the read may outlive the stream
+	// owning the original.
+	struct FileRead
+	{
+		int fd = -1;
+		FileDescriptor file;
+		char *data = nullptr;
+		std::size_t size = 0;
+		off_t offset = 0;
+		int result = 0;
+		void (Service::*done)(int result) = nullptr;
+	};
+
+	FileRead m_file_read;
+	unsigned int m_response_status_code;
+	std::size_t m_resource_size_bytes;
+	std::string m_response_headers;
+	std::string m_response_head;
+
+	// The HTTP/2 connection, once switched to it. Reads and
+	// writes go on independently of each other.
+	std::unique_ptr<Http2Connection> m_h2;
+	std::vector<asio::const_buffer> m_h2_buffers;
+	bool m_h2_reading;
+	bool m_h2_writing;
+	bool m_h2_closing;
+	bool m_h2_warming;
+};
+
+Service *ServicePool::acquire(asio::io_service &ios,
+							  const ServerConfig &config,
+							  ResourceCache &cache,
+							  TimingWheel &wheel,
+							  ConnectionLimiter &limiter,
+							  const Router &router,
+							  FileIoPool *file_io,
+							  IoUring *ring)
+{
+	auto &services = free_list().services;
+
+	if (services.empty())
+	{
+		return new Service(ios, config, cache, wheel, limiter, router, file_io, ring);
+	}
+
+	Service *service = services.back();
+	services.pop_back();
+
+	return service;
+}
+
+void ServicePool::release(Service *service, std::size_t max_pooled)
+{
+	auto &services = free_list().services;
+
+	if (services.size() >= max_pooled)
+	{
+		delete service;
+		return;
+	}
+
+	services.push_back(service);
+}
+
+ServicePool::FreeList::~FreeList()
+{
+	for (Service *service : services)
+	{
+		delete service;
+	}
+}
+
+ResponseWriter::~ResponseWriter()
+{
+	if (m_service != nullptr)
+	{
+		send(500, std::string_view(), std::string());
+	}
+}
+
+void ResponseWriter::send(unsigned int status, std::string_view content_type, std::string body)
+{
+	Service *service = m_service;
+	m_service = nullptr;
+
+	service->answer(m_stream_id, status, std::move(m_headers), content_type,
+					std::move(body), std::string_view(), std::string_view(), nullptr);
+}
+
+void ResponseWriter::send_file(std::string_view root, std::string_view path)
+{
+	Service *service = m_service;
+	m_service = nullptr;
+
+	service->answer(m_stream_id, 200, std::move(m_headers), std::string_view(),
+					std::string(), root, path, nullptr);
+}
+
+void ResponseWriter::send_resource(std::shared_ptr<const CachedResource> resource)
+{
+	Service *service = m_service;
+	m_service = nullptr;
+
+	service->answer(m_stream_id, 200, std::move(m_headers), std::string_view(),
+					std::string(), std::string_view(), std::string_view(), std::move(resource));
+}
+
+class Acceptor
+{
+public:
+	typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+		reuse_port;
+
+	Acceptor(asio::io_service &ios, unsigned short port_num,
+			 const ServerConfig &config,
+			 ResourceCache &cache,
+			 TimingWheel &wheel,
+			 ConnectionLimiter &limiter,
+			 const Router &router,
+			 FileIoPool *file_io,
+			 IoUring *ring,
+			 bool share_port = false) : m_ios(ios),
+										m_acceptor(m_ios),
+										m_strand(asio::make_strand(ios)),
+										m_config(config),
+										m_cache(cache),
+										m_wheel(wheel),
+										m_limiter(limiter),
+										m_router(router),
+										m_file_io(file_io),
+										m_ring(ring),
+										m_ring_accept([this](int result, unsigned int flags)
+													  { asio::post(m_strand, [this, result, flags]()
+																   { onRingAccept(result, (flags & IORING_CQE_F_MORE) != 0); }); }),
+										m_ringAccepting(false),
+										m_ringPaused(false),
+										m_isStopped(false)
+	{
+		// Sent as is to every connection turned away.
+		m_overload_response = "HTTP/1.1 503 Service Unavailable\r\n"
+							  "retry-after: " +
+							  std::to_string(m_config.overload_retry_after.count()) +
+							  "\r\n"
+							  "connection: close\r\n"
+							  "content-length: 0\r\n"
+							  "\r\n";
+
+		asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::any(),
+										 port_num);
+
+		m_acceptor.open(endpoint.protocol());
+		m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+		// Let several acceptors listen on the same port and
+		// have the kernel balance connections between them.
+		if (share_port)
+		{
+			m_acceptor.set_option(reuse_port(true));
+		}
+
+		m_acceptor.bind(endpoint);
+	}
+
+	// Start accepting incoming connection requests.
+	void Start()
+	{
+		m_acceptor.listen();
+
+		if (m_ring != nullptr)
+		{
+			InitRingAccept();
+			return;
+		}
+
+		if (m_config.batch_accept)
+		{
+			// accept4() must not block once the backlog
+			// has been drained.
+			m_acceptor.native_non_blocking(true);
+			InitBatchAccept();
+			return;
+		}
+
+		for (unsigned int i = 0; i < std::max(m_config.outstanding_accepts, 1u); i++)
+		{
+			InitAccept();
+		}
+	}
+
+	// Stop accepting incoming connection requests.
+	void Stop()
+	{
+		m_isStopped.store(true);
+
+		// Aborts the outstanding accepts, whose handlers
+		// give back what was set aside for them.
+		asio::post(m_strand, [this]()
+				   { closeAcceptor(); });
+	}
+
+private:
+
+	// At the limit, leave new connections in the listen
+	// backlog until one of ours finishes. Returns false
+	// if accepting has been paused.
+	bool acquireSlot()
+	{
+		if (m_config.reject_when_overloaded || m_limiter.try_acquire())
+		{
+			return true;
+		}
+
+		m_limiter.wait([this]()
+					   { asio::post(m_strand, [this]()
+									{ onSlotAvailable(); }); });
+		return false;
+	}
+
+	void releaseSlot()
+	{
+		if (!m_config.reject_when_overloaded)
+		{
+			m_limiter.release();
+		}
+	}
+
+	// Starts serving a freshly accepted connection, or
+	// turns it away when over the limit.
+	void onConnection(Service *service)
+	{
+		if (m_config.reject_when_overloaded && !m_limiter.try_acquire())
+		{
+			reject(service->socket());
+			ServicePool::release(service, m_config.service_pool_size);
+			return;
+		}
+
+		service->start_handling();
+	}
+
+	void InitAccept()
 	{
-		if (ec.value() != 0)
+		if (!acquireSlot())
 		{
-			std::cout << "Error occured! Error code = "
-					  << ec.value()
-					  << ". Message: " << ec.message();
+			return;
+		}
 
-			if (ec == asio::error::not_found)
-			{
-				// No delimiter has been fonud in the
-				// request message.
+		Service *service = ServicePool::acquire(m_ios, m_config, m_cache, m_wheel, m_limiter, m_router, m_file_io, m_ring);
 
-				m_response_status_code = 413;
-				send_response();
+		// Accept handlers run on a strand, since with a
+		// shared event loop the completions of several
+		// outstanding accepts could otherwise run at once.
+		m_acceptor.async_accept(service->socket(),
+								service->peer(),
+								asio::bind_executor(m_strand,
+													[this, service](
+														const boost::system::error_code &error)
+													{
+														onAccept(error, service);
+													}));
+	}
 
-				return;
-			}
-			else
+	void onAccept(const boost::system::error_code &ec,
+				  Service *service)
+	{
+		if (ec.value() == 0)
+		{
+			onConnection(service);
+		}
+		else
+		{
+			// Closing the acceptor aborts the other
+			// outstanding accepts; nothing to report.
+			if (ec != asio::error::operation_aborted)
 			{
-				// In case of any other error �
-				// close the socket and clean up.
-				on_finish();
-				return;
+				Log::error("accept", ec);
 			}
+
+			// Give back the slot taken for it.
+			releaseSlot();
+			ServicePool::release(service, m_config.service_pool_size);
 		}
 
-		// Parse the request line.
-		std::string request_line;
-		std::istream request_stream(&m_request);
-		std::getline(request_stream, request_line, '\r');
-		// Remove symbol '\n' from the buffer.
-		request_stream.get();
+		// Init next async accept operation if
+		// acceptor has not been stopped yet.
+		if (!m_isStopped.load())
+		{
+			InitAccept();
+		}
+		else
+		{
+			// Stop accepting incoming connections
+			// and free allocated resources.
+			closeAcceptor();
+		}
+	}
 
-		// Parse the request line.
-		std::string request_method;
-		std::istringstream request_line_stream(request_line);
-		request_line_stream >> request_method;
+	void InitBatchAccept()
+	{
+		m_acceptor.async_wait(asio::ip::tcp::acceptor::wait_read,
+							  asio::bind_executor(m_strand,
+												  [this](const boost::system::error_code &error)
+												  {
+													  onReadable(error);
+												  }));
+	}
 
-		// We only support GET method.
-		if (request_method.compare("GET") != 0)
+	void onReadable(const boost::system::error_code &ec)
+	{
+		if (ec.value() != 0 && ec != asio::error::operation_aborted)
 		{
-			// Unsupported method.
-			m_response_status_code = 501;
-			send_response();
+			Log::error("accept", ec);
+		}
 
+		if (m_isStopped.load())
+		{
+			closeAcceptor();
 			return;
 		}
 
-		request_line_stream >> m_requested_resource;
-
-		std::string request_http_version;
-		request_line_stream >> request_http_version;
-
-		if (request_http_version.compare("HTTP/1.1") != 0)
+		if (ec.value() == 0 && !drainBacklog())
 		{
-			// Unsupported HTTP version or bad request.
-			m_response_status_code = 505;
-			send_response();
-
+			// Paused at the limit; onSlotAvailable()
+			// carries on.
 			return;
 		}
 
-		// At this point the request line is successfully
-		// received and parsed. Now read the request headers.
-		asio::async_read_until(*m_sock.get(),
-							   m_request,
-							   "\r\n\r\n",
-							   [this](
-								   const boost::system::error_code &ec,
-								   std::size_t bytes_transferred)
-							   {
-								   on_headers_received(ec,
-													   bytes_transferred);
-							   });
-
-		return;
+		InitBatchAccept();
 	}
 
-	void on_headers_received(const boost::system::error_code &ec,
-							 std::size_t bytes_transferred)
+	// Accepts the connections waiting in the backlog, up to
+	// a bound so that a flood cannot starve the other
+	// handlers of the loop. Returns false if accepting has
+	// been paused at the connection limit.
+	bool drainBacklog()
 	{
-		if (ec.value() != 0)
-		{
-			std::cout << "Error occured! Error code = "
-					  << ec.value()
-					  << ". Message: " << ec.message();
+		static const unsigned int MAX_ACCEPTS_PER_TURN = 64;
 
-			if (ec == asio::error::not_found)
+		for (unsigned int i = 0; i < MAX_ACCEPTS_PER_TURN; i++)
+		{
+			if (!acquireSlot())
 			{
-				// No delimiter has been fonud in the
-				// request message.
-
-				m_response_status_code = 413;
-				send_response();
-				return;
+				return false;
 			}
-			else
+
+			asio::ip::tcp::endpoint peer;
+			socklen_t peer_length = static_cast<socklen_t>(peer.capacity());
+
+			int fd = ::accept4(m_acceptor.native_handle(), peer.data(), &peer_length,
+							   SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
 			{
-				// In case of any other error - close the
-				// socket and clean up.
-				on_finish();
-				return;
+				int error = errno;
+				releaseSlot();
+
+				if (error == EINTR || error == ECONNABORTED)
+				{
+					continue;
+				}
+
+				if (error != EAGAIN && error != EWOULDBLOCK)
+				{
+					Log::error("accept", boost::system::error_code(error, boost::system::system_category()));
+				}
+
+				// Backlog drained.
+				return true;
 			}
-		}
 
-		// Parse and store headers.
-		std::istream request_stream(&m_request);
-		std::string header_name, header_value;
+			Service *service = ServicePool::acquire(m_ios, m_config, m_cache, m_wheel, m_limiter, m_router, m_file_io, m_ring);
 
-		while (!request_stream.eof())
-		{
-			std::getline(request_stream, header_name, ':');
-			if (!request_stream.eof())
+			peer.resize(peer_length);
+			service->peer() = peer;
+
+			boost::system::error_code ec;
+			service->socket().assign(asio::ip::tcp::v4(), fd, ec);
+			if (ec.value() != 0)
 			{
-				std::getline(request_stream,
-							 header_value,
-							 '\r');
+				Log::error("accept", ec);
 
-				// Remove symbol \n from the stream.
-				request_stream.get();
-				m_request_headers[header_name] =
-					header_value;
+				::close(fd);
+				releaseSlot();
+				ServicePool::release(service, m_config.service_pool_size);
+				continue;
 			}
+
+			onConnection(service);
 		}
 
-		// Now we have all we need to process the request.
-		process_request();
-		send_response();
+		return true;
+	}
 
-		return;
+	// Keeps a multishot accept armed on the ring, which
+	// completes once for every connection accepted.
+	void InitRingAccept()
+	{
+		m_ringAccepting = true;
+		m_ring->accept_multishot(m_acceptor.native_handle(), m_ring_accept);
 	}
 
-	void process_request()
+	void onRingAccept(int result, bool more)
 	{
-		// Read file.
-		std::string resource_file_path =
-			std::string("D:\\http_root") +
-			m_requested_resource;
+		if (!more)
+		{
+			m_ringAccepting = false;
+		}
 
-		if (!std::filesystem::exists(resource_file_path))
+		if (result >= 0)
 		{
-			// Resource not found.
-			m_response_status_code = 404;
+			onRingConnection(result);
+		}
+		else if (result == -EINVAL)
+		{
+			// The kernel predates multishot accepts; have
+			// the reactor accept instead.
+			Log::error("accept", boost::system::error_code(-result, boost::system::system_category()));
+			m_ring = nullptr;
+
+			if (!m_isStopped.load())
+			{
+				Start();
+			}
 
 			return;
 		}
+		else if (result != -ECANCELED)
+		{
+			Log::error("accept", boost::system::error_code(-result, boost::system::system_category()));
+		}
 
-		std::ifstream resource_fstream(
-			resource_file_path,
-			std::ifstream::binary);
+		if (m_isStopped.load())
+		{
+			closeAcceptor();
+			return;
+		}
 
-		if (!resource_fstream.is_open())
+		if (!m_ringAccepting && !m_ringPaused)
 		{
-			// Could not open file.
-			// Something bad has happened.
-			m_response_status_code = 500;
+			InitRingAccept();
+		}
+	}
 
+	void onRingConnection(int fd)
+	{
+		if (m_isStopped.load())
+		{
+			::close(fd);
 			return;
 		}
 
-		// Find out file size.
-		resource_fstream.seekg(0, std::ifstream::end);
-		m_resource_size_bytes =
-			static_cast<std::size_t>(
-				resource_fstream.tellg());
+		// The connection is ours already, so at the limit
+		// it can only be turned away.
+		bool admitted = m_config.reject_when_overloaded || m_limiter.try_acquire();
 
-		m_resource_buffer.reset(
-			new char[m_resource_size_bytes]);
+		Service *service = ServicePool::acquire(m_ios, m_config, m_cache, m_wheel, m_limiter, m_router, m_file_io, m_ring);
 
-		resource_fstream.seekg(std::ifstream::beg);
-		resource_fstream.read(m_resource_buffer.get(),
-							  m_resource_size_bytes);
+		boost::system::error_code ec;
+		service->socket().assign(asio::ip::tcp::v4(), fd, ec);
+		if (ec.value() != 0)
+		{
+			Log::error("accept", ec);
 
-		m_response_headers += std::string("content-length") +
-							  ": " +
-							  std::to_string(m_resource_size_bytes) +
-							  "\r\n";
-	}
+			::close(fd);
+			if (admitted)
+			{
+				releaseSlot();
+			}
+			ServicePool::release(service, m_config.service_pool_size);
+			return;
+		}
 
-	void send_response()
-	{
-		m_sock->shutdown(
-			asio::ip::tcp::socket::shutdown_receive);
+		// Multishot accepts leave out the peer's address.
+		service->peer() = service->socket().remote_endpoint(ec);
 
-		auto status_line =
-			http_status_table.at(m_response_status_code);
+		if (!admitted)
+		{
+			reject(service->socket());
+			ServicePool::release(service, m_config.service_pool_size);
+			pauseRingAccept();
+			return;
+		}
 
-		m_response_status_line = std::string("HTTP/1.1 ") +
-								 status_line +
-								 "\r\n";
+		onConnection(service);
+	}
 
-		m_response_headers += "\r\n";
+	// Stops accepting until a slot is free again.
+	void pauseRingAccept()
+	{
+		if (m_ringPaused)
+		{
+			return;
+		}
 
-		std::vector<asio::const_buffer> response_buffers;
-		response_buffers.push_back(
-			asio::buffer(m_response_status_line));
+		m_ringPaused = true;
 
-		if (m_response_headers.length() > 0)
+		if (m_ringAccepting)
 		{
-			response_buffers.push_back(
-				asio::buffer(m_response_headers));
+			m_ring->cancel(m_ring_accept);
 		}
 
-		if (m_resource_size_bytes > 0)
+		m_limiter.wait([this]()
+					   { asio::post(m_strand, [this]()
+									{ onSlotAvailable(); }); });
+	}
+
+	void closeAcceptor()
+	{
+		// The ring keeps the socket open as long as the
+		// accept is armed.
+		if (m_ring != nullptr && m_ringAccepting)
 		{
-			response_buffers.push_back(
-				asio::buffer(m_resource_buffer.get(),
-							 m_resource_size_bytes));
+			m_ring->cancel(m_ring_accept);
 		}
 
-		// Initiate asynchronous write operation.
-		asio::async_write(*m_sock.get(),
-						  response_buffers,
-						  [this](
-							  const boost::system::error_code &ec,
-							  std::size_t bytes_transferred)
-						  {
-							  on_response_sent(ec,
-											   bytes_transferred);
-						  });
+		boost::system::error_code ignored_ec;
+		m_acceptor.close(ignored_ec);
 	}
 
-	void on_response_sent(const boost::system::error_code &ec,
-						  std::size_t bytes_transferred)
+	void onSlotAvailable()
 	{
-		if (ec.value() != 0)
+		if (m_isStopped.load())
 		{
-			std::cout << "Error occured! Error code = "
-					  << ec.value()
-					  << ". Message: " << ec.message();
+			closeAcceptor();
 		}
+		else if (m_ring != nullptr)
+		{
+			m_ringPaused = false;
 
-		m_sock->shutdown(asio::ip::tcp::socket::shutdown_both);
-
-		on_finish();
+			if (!m_ringAccepting)
+			{
+				InitRingAccept();
+			}
+		}
+		else if (m_config.batch_accept)
+		{
+			onReadable(boost::system::error_code());
+		}
+		else
+		{
+			InitAccept();
+		}
 	}
 
-	// Here we perform the cleanup.
-	void on_finish()
+	// Turns a connection away without setting up a Service
+	// for it. The response is tiny and the socket fresh, so
+	// a single non-blocking send gets it out.
+	void reject(asio::ip::tcp::socket &sock)
 	{
-		delete this;
+		int fd = sock.native_handle();
+
+		::send(fd, m_overload_response.data(), m_overload_response.size(),
+			   MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		// Closing with unread data resets the connection,
+		// which may destroy the response before the client
+		// reads it; so drain whatever has already arrived.
+		char discard[1024];
+		while (::recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+		{
+		}
+
+		boost::system::error_code ignored_ec;
+		sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+		sock.close(ignored_ec);
 	}
 
 private:
-	std::shared_ptr<boost::asio::ip::tcp::socket> m_sock;
-	boost::asio::streambuf m_request;
-	std::map<std::string, std::string> m_request_headers;
-	std::string m_requested_resource;
+	asio::io_service &m_ios;
+	asio::ip::tcp::acceptor m_acceptor;
+	asio::strand<asio::io_service::executor_type> m_strand;
 
-	std::unique_ptr<char[]> m_resource_buffer;
-	unsigned int m_response_status_code;
-	std::size_t m_resource_size_bytes;
-	std::string m_response_headers;
-	std::string m_response_status_line;
+	const ServerConfig &m_config;
+	ResourceCache &m_cache;
+	TimingWheel &m_wheel;
+	ConnectionLimiter &m_limiter;
+	const Router &m_router;
+	FileIoPool *m_file_io;
+	std::string m_overload_response;
+
+	// Accepting through the ring, when the loop has one.
+	IoUring *m_ring;
+	IoUring::Operation m_ring_accept;
+	bool m_ringAccepting;
+	bool m_ringPaused;
+
+	std::atomic<bool> m_isStopped;
 };
 
-const std::map<unsigned int, std::string>
-	Service::http_status_table =
-		{
-			{200, "200 OK"},
-			{404, "404 Not Found"},
-			{413, "413 Request Entity Too Large"},
-			{500, "500 Server Error"},
-			{501, "501 Not Implemented"},
-			{505, "505 HTTP Version Not Supported"}};
+// How Server::Stop() went.
+struct DrainReport
+{
+	// Connections that were closed cleanly during the drain.
+	std::size_t drained = 0;
 
-class Acceptor
+	// Connections still open at the deadline, and closed
+	// regardless.
+	std::size_t aborted = 0;
+};
+
+class Server
 {
 public:
-	Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-															   m_acceptor(m_ios,
-																		  asio::ip::tcp::endpoint(
-																			  asio::ip::address_v4::any(),
-																			  port_num)),
-															   m_isStopped(false)
+	// Routes requests for the pattern's paths to the
+	// handler, as described for Router. Routes are added
+	// before Start(); returns false if the pattern is
+	// malformed or already taken.
+	bool Route(std::string_view pattern, std::shared_ptr<RequestHandler> handler)
 	{
+		return m_router.add(pattern, std::move(handler));
 	}
 
-	// Start accepting incoming connection requests.
-	void Start()
+	bool Route(std::string_view pattern, FunctionHandler::Function function)
 	{
-		m_acceptor.listen();
-		InitAccept();
+		return Route(pattern, std::make_shared<FunctionHandler>(std::move(function)));
 	}
 
-	// Stop accepting incoming connection requests.
-	void Stop()
+	// Start the server.
+	void Start(unsigned short port_num,
+			   unsigned int thread_pool_size,
+			   const ServerConfig &config = ServerConfig())
 	{
-		m_isStopped.store(true);
-	}
 
-private:
-	void InitAccept()
-	{
-		std::shared_ptr<asio::ip::tcp::socket>
-			sock(new asio::ip::tcp::socket(m_ios));
+		assert(thread_pool_size > 0);
 
-		m_acceptor.async_accept(*sock.get(),
-								[this, sock](
-									const boost::system::error_code &error)
-								{
-									onAccept(error, sock);
-								});
-	}
+		m_config = config;
 
-	void onAccept(const boost::system::error_code &ec,
-				  std::shared_ptr<asio::ip::tcp::socket> sock)
-	{
-		if (ec.value() == 0)
+		// A pack that cannot be mapped stops the server from
+		// starting, rather than having it serve the wrong
+		// files.
+		std::shared_ptr<RequestHandler> files;
+		if (m_config.asset_pack_path.empty())
 		{
-			(new Service(sock))->start_handling();
+			files = std::make_shared<StaticFileHandler>(m_config.document_root);
 		}
 		else
 		{
-			std::cout << "Error occured! Error code = "
-					  << ec.value()
-					  << ". Message: " << ec.message();
+			files = std::make_shared<AssetPackHandler>(m_config.asset_pack_path);
 		}
 
-		// Init next async accept operation if
-		// acceptor has not been stopped yet.
-		if (!m_isStopped.load())
+		// sendfile(2) has no MSG_NOSIGNAL; a peer that went
+		// away must fail the write, not end the process.
+		::signal(SIGPIPE, SIG_IGN);
+
+		Log::start(m_config.log_path,
+				   m_config.access_log,
+				   m_config.log_buffer_records,
+				   m_config.log_flush_interval);
+
+		m_cache.reset(new ResourceCache(m_config));
+		m_limiter.reset(new ConnectionLimiter(m_config.max_connections));
+
+		if (m_config.file_io_threads > 0)
 		{
-			InitAccept();
+			m_file_io.reset(new FileIoPool(m_config.file_io_threads,
+										   m_config.file_io_queue_limit));
 		}
-		else
+
+		// Unless taken by routes of their own, the metrics
+		// have their path, and files get every other one.
+		if (m_config.expose_metrics)
 		{
-			// Stop accepting incoming connections
-			// and free allocated resources.
-			m_acceptor.close();
+			m_router.add(m_config.metrics_path, std::make_shared<MetricsHandler>());
 		}
-	}
 
-private:
-	asio::io_service &m_ios;
-	asio::ip::tcp::acceptor m_acceptor;
-	std::atomic<bool> m_isStopped;
-};
+		m_router.add("/*", std::move(files));
 
-class Server
-{
-public:
-	Server()
-	{
-		m_work.reset(new asio::io_service::work(m_ios));
-	}
+		// Either one event loop run by the whole pool or
+		// one event loop per thread.
+		unsigned int loops_count =
+			m_config.io_context_per_core ? thread_pool_size : 1;
 
-	// Start the server.
-	void Start(unsigned short port_num,
-			   unsigned int thread_pool_size)
-	{
+		// A loop run by a single thread can skip some of
+		// its internal locking.
+		int concurrency_hint =
+			m_config.io_context_per_core ? 1 : static_cast<int>(thread_pool_size);
 
-		assert(thread_pool_size > 0);
+		for (unsigned int i = 0; i < loops_count; i++)
+		{
+			m_ios.emplace_back(new asio::io_service(concurrency_hint));
+			m_work.emplace_back(new asio::io_service::work(*m_ios.back()));
+
+			// Connection deadlines of this loop.
+			m_wheels.emplace_back(new TimingWheel(*m_ios.back(),
+												  m_config.timing_wheel_tick,
+												  m_config.timing_wheel_slots));
+			m_wheels.back()->start();
 
-		// Create and strat Acceptor.
-		acc.reset(new Acceptor(m_ios, port_num));
-		acc->Start();
+			m_rings.push_back(CreateRing(*m_ios.back()));
+
+			// Create and strat Acceptor.
+			m_acceptors.emplace_back(new Acceptor(*m_ios.back(),
+												  port_num,
+												  m_config,
+												  *m_cache,
+												  *m_wheels.back(),
+												  *m_limiter,
+												  m_router,
+												  m_file_io.get(),
+												  m_rings.back().get(),
+												  m_config.io_context_per_core));
+			m_acceptors.back()->Start();
+		}
 
 		// Create specified number of threads and
 		// add them to the pool.
 		for (unsigned int i = 0; i < thread_pool_size; i++)
 		{
+			asio::io_service &ios = *m_ios[i % loops_count];
+
 			std::unique_ptr<std::thread> th(
-				new std::thread([this]()
-								{ m_ios.run(); }));
+				new std::thread([&ios]()
+								{ ios.run(); }));
+
+			if (m_config.io_context_per_core)
+			{
+				pin_to_core(*th, i);
+			}
 
 			m_thread_pool.push_back(std::move(th));
 		}
 	}
 
-	// Stop the server.
-	void Stop()
+	// Stop the server. New connections are no longer
+	// accepted, and open ones are closed after their current
+	// response, or when they time out idling, for up to
+	// shutdown_drain_timeout. Whatever is still open then
+	// is closed mid-request.
+	DrainReport Stop()
 	{
-		acc->Stop();
-		m_ios.stop();
+		for (auto &acc : m_acceptors)
+		{
+			acc->Stop();
+		}
+
+		m_limiter->start_draining();
+
+		DrainReport report;
+		report.aborted = m_limiter->wait_for_connections(
+			std::chrono::steady_clock::now() + m_config.shutdown_drain_timeout);
+		report.drained = m_limiter->drained();
+
+		// Connections waiting on file I/O get an answer, or
+		// an error, from the loops still running, and can
+		// then be finished off below.
+		if (m_file_io)
+		{
+			m_file_io->stop();
+		}
+
+		if (report.aborted > 0)
+		{
+			// Every open connection has a deadline armed;
+			// expiring them all closes their sockets. Give
+			// their handlers a moment to clean up.
+			for (auto &wheel : m_wheels)
+			{
+				wheel->expire_all();
+			}
+
+			m_limiter->wait_for_connections(
+				std::chrono::steady_clock::now() + std::chrono::seconds(1));
+		}
+
+		for (auto &wheel : m_wheels)
+		{
+			wheel->stop();
+		}
+
+		for (auto &ios : m_ios)
+		{
+			ios->stop();
+		}
 
 		for (auto &th : m_thread_pool)
 		{
 			th->join();
 		}
+
+		Log::stop();
+
+		return report;
+	}
+
+private:
+	// The loop's ring if the io_uring backend has been
+	// chosen, or nullptr to use epoll.
+	std::unique_ptr<IoUring> CreateRing(asio::io_service &ios)
+	{
+		if (m_config.io_backend != IoBackend::io_uring)
+		{
+			return nullptr;
+		}
+
+		std::size_t stream_chunk_size =
+			std::max<std::size_t>(m_config.max_stream_buffer_bytes / 2, 1);
+
+		try
+		{
+			std::unique_ptr<IoUring> ring(new IoUring(ios,
+													  m_config.io_uring_entries,
+													  m_config.io_uring_registered_buffers,
+													  2 * stream_chunk_size));
+			ring->start();
+			return ring;
+		}
+		catch (system::system_error &e)
+		{
+			// Not available here, possibly disallowed by a
+			// seccomp filter; carry on with epoll.
+			Log::error("io_uring", e.code());
+			return nullptr;
+		}
+	}
+
+	static void pin_to_core(std::thread &th, unsigned int index)
+	{
+		unsigned int cores = std::thread::hardware_concurrency();
+		if (cores == 0)
+		{
+			return;
+		}
+
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		CPU_SET(index % cores, &cpu_set);
+
+		int rc = pthread_setaffinity_np(th.native_handle(),
+										sizeof(cpu_set),
+										&cpu_set);
+		if (rc != 0)
+		{
+			// Not fatal, the thread just stays unpinned.
+			Log::error("pin_to_core", boost::system::error_code(rc, boost::system::system_category()));
+		}
 	}
 
 private:
-	asio::io_service m_ios;
-	std::unique_ptr<asio::io_service::work> m_work;
-	std::unique_ptr<Acceptor> acc;
+	// The event loops, and the acceptors feeding them.
+	std::vector<std::unique_ptr<asio::io_service>> m_ios;
+	std::vector<std::unique_ptr<asio::io_service::work>> m_work;
+	std::vector<std::unique_ptr<TimingWheel>> m_wheels;
+	std::vector<std::unique_ptr<IoUring>> m_rings;
+	ServerConfig m_config;
+	std::unique_ptr<ResourceCache> m_cache;
+	std::unique_ptr<ConnectionLimiter> m_limiter;
+	std::unique_ptr<FileIoPool> m_file_io;
+	Router m_router;
+	std::vector<std::unique_ptr<Acceptor>> m_acceptors;
 	std::vector<std::unique_ptr<std::thread>> m_thread_pool;
 };
 
@@ -435,18 +10021,29 @@ int main()
 	try
 	{
 		Server srv;
+		ServerConfig config;
 
+		// One loop per core, or a shared loop run by
+		// twice as many threads as there are cores.
 		unsigned int thread_pool_size =
-			std::thread::hardware_concurrency() * 2;
+			std::thread::hardware_concurrency() *
+			(config.io_context_per_core ? 1 : 2);
 
 		if (thread_pool_size == 0)
 			thread_pool_size = DEFAULT_THREAD_POOL_SIZE;
 
-		srv.Start(port_num, thread_pool_size);
+		srv.Route("/health", [](const RequestView &, ResponseWriter response)
+				  { response.send(200, "text/plain", "ok\n"); });
+
+		srv.Start(port_num, thread_pool_size, config);
 
 		std::this_thread::sleep_for(std::chrono::seconds(60));
 
-		srv.Stop();
+		DrainReport report = srv.Stop();
+
+		std::cout << "Server stopped. Connections drained: "
+				  << report.drained
+				  << ", aborted: " << report.aborted << std::endl;
 	}
 	catch (system::system_error &e)
 	{